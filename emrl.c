@@ -14,31 +14,110 @@
 #include <string.h>
 
 #include "emrl.h"
+#ifdef USE_TX_QUEUE
+#include "emrl_queue.h"
+#endif
+#include "emrl_trace.h"
+
+#if defined(USE_SUGGEST) && !(defined(USE_HISTORY) && defined(USE_ESCAPE_INPUT))
+#error USE_SUGGEST needs USE_HISTORY and USE_ESCAPE_INPUT
+#endif
+
+#define PRINT(str) print(p_this, str)
+
+#ifdef USE_CYCLE_STATS
+#define CYCLES_START() emrl_cycles cycles_start = EMRL_CYCLES()
+#define CYCLES_END(api) record_cycles(&p_this->cycle_stats[api], EMRL_CYCLES() - cycles_start)
+#else
+#define CYCLES_START()
+#define CYCLES_END(api)
+#endif
+
+#ifdef USE_TRACE
+#define TRACE(event, chr, arg) trace(p_this, event, chr, arg)
+#else
+#define TRACE(event, chr, arg)
+#endif
+
+#ifdef USE_HIGHLIGHT
+#define HL_INSERT(pos, count) hl_insert(p_this, pos, count)
+#define HL_DELETE(pos) hl_delete(p_this, pos)
+#define HL_PRINTED(start, end) hl_printed(p_this, start, end)
+#define HL_DEFAULT() hl_set_attr(p_this, 0)
+#define HL_REFRESH() hl_refresh(p_this)
+#define HL_UNKNOWN 0xff
+#else
+#define HL_INSERT(pos, count)
+#define HL_DELETE(pos)
+#define HL_PRINTED(start, end)
+#define HL_DEFAULT()
+#define HL_REFRESH()
+#endif
+
+#ifdef USE_SUGGEST
+#define SG_HIDE() suggest_draw(p_this, 0)
+#define SG_UPDATE() suggest_update(p_this)
+#else
+#define SG_HIDE()
+#define SG_UPDATE()
+#endif
 
-#define PRINT(str) (void)p_this->fputs(str, p_this->file)
+#ifdef USE_MACHINE_MODE
+#define MACHINE() (p_this->machine)
+#else
+#define MACHINE() false
+#endif
+
+#ifdef USE_STREAMING
+#define STREAM_FULL() stream_full(p_this)
+#define STREAM_DUE() stream_due(p_this)
+#define STREAMED() (p_this->streamed)
+#else
+#define STREAM_FULL() NULL
+#define STREAM_DUE() false
+#define STREAMED() false
+#endif
+
+#ifdef USE_INSERT_ESCAPE_SEQUENCE
+#define DEFAULT_CAP_INSERT EMRL_CAP_INSERT
+#else
+#define DEFAULT_CAP_INSERT 0
+#endif
+#ifdef USE_DELETE_ESCAPE_SEQUENCE
+#define DEFAULT_CAP_DELETE EMRL_CAP_DELETE
+#else
+#define DEFAULT_CAP_DELETE 0
+#endif
+#define DEFAULT_CAPS (EMRL_TERM_VT100 | DEFAULT_CAP_INSERT | DEFAULT_CAP_DELETE)
 
-#define SEQ_STEP_RIGHT "\033[C"
 #define SEQ_STEP_LEFT "\b"
 #define SEQ_DELETE_FORWARD "\033[P"
-#define SEQ_DELETE_BACK "\b\033[P"
+#define SEQ_ERASE_BACK "\b \b"
 #define SEQ_INSERT_SPACE "\033[@"
 #define SEQ_ERASE_TO_END "\033[K"
+#define SEQ_ERASE_BELOW "\033[J"
+#define SEQ_DEVICE_ATTRIBUTES "\033[c"
+#define SEQ_NORMAL "\033[m"
+
+// Rows are taken to be at least this wide when the width isn't known
+#define SUGGEST_MIN_WIDTH 80
+#define MAX_PRINTABLE_LEN 4		// "M-^?"
+#define HISTORY_RESCUES 2			// Retained entries moved per addition, bounds the copying
+#define STATE_MAGIC "emrl"
+#define STATE_VERSION 1
 
 // TODO
 // don't assume ascii character encoding, esp using \b above
 // handle CSI escapes introduced by 0x9b
 // ensure CSI parameters <= 255
-// allow buffer setting
 // check historic support for escape sequences above
 // more history api -> help choose what to add
 // completion
 // option to build without snprintf
 // static initialisation macro
-// recognise more keys - insert, pgup, pgdown, home, end
-// C++
+// recognise more keys - insert, pgup, pgdown, home
 // utf8 support?
 // use BEL?
-// attempt to handle print errors?
 
 
 enum rp_type
@@ -47,562 +126,3400 @@ enum rp_type
 	rp_erase
 };
 
+#ifdef USE_SAVE_STATE
+// Saved state is written and read a field at a time, see emrl_save_state()
+struct state_out
+{
+	uint8_t *p_buf;
+	size_t size;
+	size_t len;
+};
+
+struct state_in
+{
+	const uint8_t *p_pos;
+	const uint8_t *p_end;
+	bool error;
+};
+
+enum state_flag
+{
+	state_machine = 0x01,
+	state_streaming = 0x02,
+	state_streamed = 0x04,
+	state_da_pending = 0x08
+};
+#endif
+
+static inline char *process_char(struct emrl_res *p_this, char chr);
+#ifdef USE_HISTORY
+static inline bool add_to_history(struct emrl_res *p_this, const char *p_command);
+static inline void clear_history(struct emrl_res *p_this);
+static inline bool hist_count_use(struct emrl_res *p_this, const char *p_command);
+static inline void hist_make_room(struct emrl_res *p_this, size_t need);
+static inline void hist_write(struct emrl_history *ph, const char *p_data, size_t len);
+static inline bool hist_entry_equal(const struct emrl_history *ph, emrl_hist_idx entry, const char *p_str);
+static inline emrl_hist_idx hist_next(const struct emrl_history *ph, size_t pos);
+static inline emrl_hist_idx hist_prev(const struct emrl_history *ph, size_t pos);
+static inline emrl_hist_idx hist_search_forward(const struct emrl_res *p_this, emrl_hist_idx entry);
+static inline emrl_hist_idx hist_search_backward(const struct emrl_res *p_this, emrl_hist_idx entry);
+static inline void hist_show_prev(struct emrl_res *p_this);
+static inline void hist_show_next(struct emrl_res *p_this);
+static inline void hist_show_current(struct emrl_res *p_this);
+static inline size_t hist_entry_len(const struct emrl_history *ph, emrl_hist_idx entry);
+static inline void print_entry(struct emrl_res *p_this, emrl_hist_idx entry, size_t start, size_t end);
+#endif
+#ifdef USE_SUGGEST
+static inline char hist_entry_char(const struct emrl_history *ph, emrl_hist_idx entry, size_t pos);
+static inline int hist_entry_compare(const struct emrl_history *ph, emrl_hist_idx entry, const char *p_str, size_t len);
+static inline int hist_entries_compare(const struct emrl_history *ph, emrl_hist_idx entry_a, emrl_hist_idx entry_b);
+static inline size_t hist_age(const struct emrl_history *ph, emrl_hist_idx entry);
+static inline void suggest_index_add(struct emrl_res *p_this, emrl_hist_idx entry);
+static inline void suggest_index_drop(struct emrl_res *p_this, emrl_hist_idx entry);
+static inline void suggest_drop_overwritten(struct emrl_res *p_this, size_t len);
+static inline void suggest_moved(struct emrl_res *p_this, emrl_hist_idx from, emrl_hist_idx to);
+static inline size_t suggest_bound(const struct emrl_res *p_this, size_t len, bool after);
+static inline emrl_hist_idx suggest_find(struct emrl_res *p_this);
+static inline void suggest_update(struct emrl_res *p_this);
+static inline void suggest_draw(struct emrl_res *p_this, emrl_hist_idx entry);
+static inline void suggest_covered(struct emrl_res *p_this);
+static inline size_t suggest_forget(struct emrl_res *p_this);
+static inline void suggest_accept(struct emrl_res *p_this);
+#endif
+#ifdef USE_SAVE_STATE
+static inline void state_put(struct state_out *p_out, const void *p_data, size_t len);
+static inline void state_put_uint(struct state_out *p_out, size_t value);
+static inline size_t state_get_uint(struct state_in *p_in);
+static inline const char *state_get_bytes(struct state_in *p_in, size_t len);
+static inline const char *state_get_string(struct state_in *p_in, size_t max_len);
+static inline bool state_esc_valid(size_t esc_state, const char *p_esc, size_t esc_len);
+#ifdef USE_HISTORY
+static inline void state_put_entry(struct state_out *p_out, const struct emrl_history *ph, emrl_hist_idx entry);
+#endif
+#endif
+static inline void print(struct emrl_res *p_this, const char *p_str);
+static inline void tx_kick(struct emrl_res *p_this);
+#ifdef USE_CYCLE_STATS
+static inline void record_cycles(struct emrl_cycle_stats *p_stats, emrl_cycles cycles);
+#endif
+#ifdef USE_TRACE
+static inline void trace(struct emrl_res *p_this, enum emrl_trace_event event, char chr, unsigned arg);
+#endif
+#ifdef USE_HIGHLIGHT
+static inline struct emrl_highlight *hl_active(struct emrl_res *p_this);
+static inline void hl_insert(struct emrl_res *p_this, size_t pos, size_t count);
+static inline void hl_delete(struct emrl_res *p_this, size_t pos);
+static inline void hl_printed(struct emrl_res *p_this, size_t start, size_t end);
+static inline void hl_set_attr(struct emrl_res *p_this, uint8_t attr);
+static inline void hl_refresh(struct emrl_res *p_this);
+static inline bool hl_append(struct emrl_res *p_this, size_t start);
+static inline void hl_update(struct emrl_res *p_this, const char *p_line, size_t pos);
+static inline bool hl_print_line(struct emrl_res *p_this);
+static inline const char *hl_displayed(struct emrl_res *p_this);
+static inline size_t hl_paint(struct emrl_res *p_this, const char *p_line, size_t pos);
+static inline void hl_move(struct emrl_res *p_this, size_t from, size_t to);
+#endif
+#ifdef USE_ESCAPE_INPUT
 static inline void process_escape_state(struct emrl_res *p_this, char chr);
+static inline void process_da_state(struct emrl_res *p_this, char chr);
 static inline void interpret_csi_escape(struct emrl_res *p_this);
+static inline void reset_esc(struct emrl_res *p_this, bool known);
 static inline void erase_forward(struct emrl_res *p_this);
+static inline void end_of_line(struct emrl_res *p_this);
+static inline bool esc_continues(struct emrl_res *p_this);
+static inline void esc_stamp(struct emrl_res *p_this);
+#endif
 static inline void erase_back(struct emrl_res *p_this);
 static inline void move_cursor_to_end(struct emrl_res *p_this);
 static inline void add_string(struct emrl_res *p_this, const char *p_str);
-#if !defined(USE_INSERT_ESCAPE_SEQUENCE) || !defined(USE_DELETE_ESCAPE_SEQUENCE)
-static inline void reprint_from_cursor(struct emrl_res *p_this, enum rp_type type, size_t back_mv);
+static inline size_t fast_path_len(struct emrl_res *p_this, const char *p_str, size_t len);
+static inline size_t printable_run(const char *p_str, size_t len, char delim);
+static inline void append_run(struct emrl_res *p_this, const char *p_str, size_t len);
+static inline void print_appended(struct emrl_res *p_this, size_t len);
+#ifdef USE_MACHINE_MODE
+static inline size_t machine_run_len(struct emrl_res *p_this, const char *p_str, size_t len);
+static inline size_t machine_append(struct emrl_res *p_this, const char *p_str, size_t len);
+static inline char *machine_char(struct emrl_res *p_this, char chr);
 #endif
-static inline void reset_esc(struct emrl_res *p_this, bool known);
-static inline char *hist_search_forward(struct emrl_res *p_this, char *p_entry);
-static inline char *hist_search_backward(struct emrl_res *p_this, char *p_entry);
-static inline void hist_show_prev(struct emrl_res *p_this);
-static inline void hist_show_next(struct emrl_res *p_this);
-static inline void hist_show_current(struct emrl_res *p_this);
+static inline void reset_line(struct emrl_res *p_this);
+static inline char *line_complete(struct emrl_res *p_this);
+#ifdef USE_STREAMING
+static inline char *stream_full(struct emrl_res *p_this);
+static inline bool stream_due(const struct emrl_res *p_this);
+#endif
+#ifdef USE_LINE_QUEUE
+static inline bool queue_line(struct emrl_res *p_this, enum emrl_part part);
+#endif
+static inline bool use_insert(struct emrl_res *p_this, size_t add_len, size_t to_end_len);
+static inline bool use_delete(struct emrl_res *p_this, size_t len);
+static inline void reprint_from_cursor(struct emrl_res *p_this, enum rp_type type, size_t back_mv);
 static inline void clear_from_prompt(struct emrl_res *p_this);
+static inline void print_line(struct emrl_res *p_this);
+static inline void move_cursor(struct emrl_res *p_this, size_t from, size_t to);
+#ifdef USE_WRAP
+static inline void move_rows(struct emrl_res *p_this, size_t from, size_t to);
+#endif
+static inline void move_cursor_back(struct emrl_res *p_this, size_t count);
+static inline void move_cursor_forward(struct emrl_res *p_this, size_t from, size_t count);
+static inline size_t move_back_len(struct emrl_res *p_this, size_t count);
+static inline size_t csi_len(size_t count);
+static inline void erase_to_end(struct emrl_res *p_this, size_t pos, size_t count);
+static inline size_t wrap_width(const struct emrl_res *p_this);
+static inline bool on_other_row(const struct emrl_res *p_this, size_t from, size_t to);
+static inline void wrap_fixup(struct emrl_res *p_this, size_t pos);
+static inline void print_csi(struct emrl_res *p_this, size_t count, char final);
+static inline bool can_reprint(struct emrl_res *p_this);
+static inline void print_displayed(struct emrl_res *p_this, size_t start, size_t end);
+static inline void print_cells(struct emrl_res *p_this, const char *p_cells, size_t len);
+static inline void print_repeated(struct emrl_res *p_this, char chr, size_t count);
 static inline void deferred_history_copy(struct emrl_res *p_this);
 static inline unsigned char_to_printable(unsigned char chr, char *p_print_str);
 
-void emrl_init(struct emrl_res *p_this, emrl_fputs_func fputs, emrl_file file, const char *delim)
+void emrl_init(struct emrl_res *p_this, emrl_fputs_func fputs, emrl_file file, const char *delim,
+               char *cmd_buf, size_t cmd_buf_size, char *hist_buf, size_t hist_buf_size)
 {
+	// Need space for at least one character plus terminator, and for the history boundary bytes.
+	// The delimiter position must fit the type it is stored in.
+	assert(cmd_buf_size >= 2);
+	assert(strlen(delim) <= UINT8_MAX);
+
+	// Only as much of each buffer is used as its offset type can index, otherwise the last offset
+	// would wrap and leave the buffer apparently much smaller or empty
+	if(cmd_buf_size - 1 > EMRL_CMD_IDX_MAX)
+		cmd_buf_size = (size_t)EMRL_CMD_IDX_MAX + 1;
+
 	p_this->fputs = fputs;
 	p_this->file = file;
-	p_this->delim = p_this->p_delim = delim;
+	p_this->delim = delim;
+	p_this->delim_pos = 0;
+
+	p_this->cmd_buf = cmd_buf;
+	p_this->cursor = p_this->cmd_free = 0;
+	p_this->cmd_last = cmd_buf_size - 1;
+	p_this->print_error = false;
+	p_this->prompt = "";
+	p_this->hide_depth = 0;
+#ifdef USE_MACHINE_MODE
+	p_this->machine = false;
+#endif
+	p_this->caps = DEFAULT_CAPS;
+#ifdef USE_ESCAPE_INPUT
+	p_this->esc_len = 0;
+	p_this->esc_state = emrl_esc_none;
+	p_this->da_pending = false;
+	p_this->da_level = 0;
+	p_this->esc_now = NULL;
+	p_this->esc_gap = 0;
+#endif
+#ifdef USE_WRAP
+	p_this->width = 0;
+#endif
+#ifdef USE_STREAMING
+	p_this->line_part = emrl_part_whole;
+	p_this->streaming = p_this->streamed = false;
+#endif
+#ifdef USE_LINE_QUEUE
+	emrl_set_line_queue(p_this, NULL, 0);
+#endif
+#ifdef USE_TX_QUEUE
+	p_this->p_txq = NULL;
+	p_this->tx_kick = NULL;
+	p_this->tx_pending = false;
+#endif
 
-	p_this->p_esc = p_this->esc_buf;
-	p_this->p_esc_last = p_this->esc_buf + sizeof p_this->esc_buf - 1;
+#ifdef USE_CYCLE_STATS
+	emrl_reset_cycle_stats(p_this);
+#endif
+#ifdef USE_TRACE
+	p_this->p_trace = NULL;
+	p_this->trace_out_len = 0;
+#endif
+#ifdef USE_HIGHLIGHT
+	p_this->p_hl = NULL;
+#endif
+#ifdef USE_SUGGEST
+	p_this->suggest.p_index = NULL;
+	p_this->suggest.size = 0;
+	p_this->suggest.start = p_this->suggest.end = 0;
+#endif
 
-	p_this->p_cursor = p_this->p_cmd_free = p_this->cmd_buf;
-	p_this->p_cmd_last = p_this->cmd_buf + sizeof p_this->cmd_buf - 1;
-	p_this->esc_state = emrl_esc_none;
+#ifdef USE_HISTORY
+	// A history buffer may be given later with emrl_history_rebuffer()
+	assert(0 == hist_buf_size || hist_buf_size >= 4);
+	if(0 != hist_buf_size && hist_buf_size - 1 > EMRL_HIST_IDX_MAX)
+		hist_buf_size = (size_t)EMRL_HIST_IDX_MAX + 1;
+	p_this->history.buf = (0 != hist_buf_size) ? hist_buf : NULL;
+	p_this->history.last = (0 != hist_buf_size) ? hist_buf_size - 1 : 0;
+	p_this->history.retain = false;
+	clear_history(p_this);
+#else
+	(void)hist_buf;
+	(void)hist_buf_size;
+#endif
+}
 
+#ifdef USE_HISTORY
+static inline void clear_history(struct emrl_res *p_this)
+{
 	struct emrl_history *ph = &p_this->history;
-	ph->p_oldest = ph->p_newest = ph->p_current = NULL;
-	ph->p_put = ph->buf + 1;
-	ph->p_buf_last = ph->buf + sizeof ph->buf - 1;
+	ph->oldest = ph->newest = ph->current = ph->recalled = 0;
+	ph->cmd_free_bak = 0;
+	ph->put = 1;
+#ifdef USE_SUGGEST
+	p_this->suggest.count = 0;
+	p_this->suggest.shown = p_this->suggest.match = 0;
+#endif
+	if(0 == ph->last)
+		return;
 
 	// Initialise first and last byte of history buffer to zero to delimit the buffer boundaries.
 	// This enables faster searching using strchr (as opposed to a loop with bounds checks),
 	// provided of course that no data is written to these bytes.
 	ph->buf[0] = '\0';
-	ph->buf[sizeof ph->buf - 1] = '\0';
+	ph->buf[ph->last] = '\0';
 	// Need a null delimiting start of unwritten oldest entry
-	ph->buf[sizeof ph->buf - 2] = '\0';
+	ph->buf[ph->last - 1] = '\0';
 }
+#endif
 
 
-char *emrl_process_char(struct emrl_res *p_this, char chr)
+#ifdef USE_TX_QUEUE
+// Send output to a queue rather than through fputs. Fragments are copied straight into the queue
+// and kick (may be NULL) is called at most once per API call when new output has been queued,
+// e.g. to start a DMA transfer of the span given by emrl_queue_acquire(). Passing a NULL queue
+// reverts to fputs output.
+void emrl_set_tx_queue(struct emrl_res *p_this, struct emrl_queue *p_txq, emrl_tx_kick_func kick)
 {
-	if(emrl_esc_none != p_this->esc_state)
-	{
-		process_escape_state(p_this, chr);
-		return NULL;
-	}
+	p_this->p_txq = p_txq;
+	p_this->tx_kick = kick;
+	p_this->tx_pending = false;
+}
+#endif
 
-	if(chr == *p_this->p_delim)
-	{
-		++p_this->p_delim;
-		if('\0' == *p_this->p_delim)
-		{
-			deferred_history_copy(p_this);
-			move_cursor_to_end(p_this);
+#ifdef USE_MACHINE_MODE
+// Machine mode is for scripted peers rather than people. Input is split into lines at the
+// delimiter and nothing else: there is no echo, editing, escape sequence handling or history, and
+// bulk input is searched for the delimiter with memchr(). Bytes that don't fit in the command
+// buffer are dropped from the end of the line.
+//
+// Switching mode in either direction discards any partial line and history search, leaving the
+// state as after emrl_init(). Nothing is printed, call emrl_redraw() after switching back to
+// interactive mode to show the prompt.
+void emrl_set_machine_mode(struct emrl_res *p_this, bool machine)
+{
+	p_this->machine = machine;
+	reset_line(p_this);
+#ifdef USE_STREAMING
+	p_this->streamed = false;
+#endif
+#ifdef USE_ESCAPE_INPUT
+	p_this->esc_len = 0;
+	p_this->esc_state = emrl_esc_none;
+#endif
+#ifdef USE_HISTORY
+	p_this->history.current = 0;
+#endif
+#ifdef USE_SUGGEST
+	(void)suggest_forget(p_this);
+#endif
+}
+#endif
 
-			*p_this->p_cmd_free = '\0';
-			p_this->p_delim = p_this->delim;
-			p_this->p_cursor = p_this->p_cmd_free = p_this->cmd_buf;
+#ifdef USE_STREAMING
+// Opt in to delivering lines longer than the command buffer in pieces, rather than dropping the
+// characters that don't fit. Once the buffer is full its contents are returned as a chunk of the
+// line, straight from the command buffer, and the buffer starts again empty. emrl_line_part()
+// tells which piece of the line was returned. The last piece may be empty if the line filled the
+// buffer exactly.
+//
+// In interactive mode chunks are only taken while typing at the end of the line, a few bytes short
+// of full so that no character is refused, and text already returned can no longer be edited.
+// Chunks shouldn't be added to the history.
+void emrl_set_streaming(struct emrl_res *p_this, bool streaming)
+{
+	p_this->streaming = streaming;
+}
 
-			return p_this->cmd_buf;
-		}
-	}
-	else
-	{
-		p_this->p_delim = p_this->delim;
-	}
+// Position of the most recently returned line or chunk, always emrl_part_whole unless streaming
+enum emrl_part emrl_line_part(const struct emrl_res *p_this)
+{
+	return (enum emrl_part)p_this->line_part;
+}
+#endif
 
-	char str_buf[5];
-	switch(chr)
-	{
-		case '\b':
-			erase_back(p_this);
-			break;
+#ifdef USE_LINE_QUEUE
+// Queue completed lines in p_buf rather than returning them, so that input can still be accepted
+// and echoed while the application works through earlier lines at its own pace. Lines and
+// streamed chunks are taken in order with emrl_peek_line() and emrl_pop_line(), and each takes
+// its length plus two bytes. The buffer must hold at least one full command buffer's worth.
+//
+// In interactive mode a new line is started below each queued one, with the prompt, and command
+// output should be printed with emrl_print_async(). If the queue is full the bell is rung and the
+// line stays in place to be entered again. In machine mode use emrl_process_buf(), which stops at
+// the delimiter of a line that doesn't fit and leaves it unconsumed. A streamed chunk that doesn't
+// fit stays in the command buffer in the same way, and input after it is left unconsumed. In
+// interactive mode a chunk that doesn't fit isn't taken, so characters beyond the command buffer
+// are dropped as if not streaming.
+//
+// Queued lines aren't included in the saved state. Passing a NULL buffer discards any queued
+// lines and goes back to returning lines from the process functions.
+void emrl_set_line_queue(struct emrl_res *p_this, char *p_buf, size_t size)
+{
+	assert(NULL == p_buf || size >= (size_t)p_this->cmd_last + 2);
+
+	struct emrl_line_queue *pq = &p_this->lines;
+	pq->buf = p_buf;
+	pq->size = size;
+	pq->get = pq->put = pq->wrap = 0;
+	pq->count = 0;
+	pq->held = false;
+}
 
-		case '\r':
-		case '\n':
-			// Ignore (unless in delim string)
-			break;
+// Oldest queued line, or NULL if the queue is empty. The line stays valid until it is popped.
+// p_part may be NULL if not streaming.
+const char *emrl_peek_line(const struct emrl_res *p_this, enum emrl_part *p_part)
+{
+	const struct emrl_line_queue *pq = &p_this->lines;
+	if(0 == pq->count)
+		return NULL;
 
-		case EMRL_ASCII_ESC:
-			p_this->esc_state = emrl_esc_new;
-			break;
+	if(NULL != p_part)
+		*p_part = (enum emrl_part)pq->buf[pq->get];
 
-		case EMRL_ASCII_DEL:
-			erase_back(p_this);
-			break;
+	return pq->buf + pq->get + 1;
+}
 
-		default:
-			char_to_printable(chr, str_buf);
-			add_string(p_this, str_buf);
-			break;
+// Remove the oldest queued line once the application has finished with it
+void emrl_pop_line(struct emrl_res *p_this)
+{
+	struct emrl_line_queue *pq = &p_this->lines;
+	if(0 == pq->count)
+		return;
+
+	// Start again from the beginning of the buffer when empty, leaving the most room for a line
+	if(0 == --pq->count)
+	{
+		pq->get = pq->put = pq->wrap = 0;
+		return;
 	}
 
-	return NULL;
+	pq->get += strlen(pq->buf + pq->get + 1) + 2;
+	if(pq->get == pq->wrap)
+		pq->get = pq->wrap = 0;
 }
 
+size_t emrl_lines_queued(const struct emrl_res *p_this)
+{
+	return p_this->lines.count;
+}
+#endif
 
-void emrl_add_to_history(struct emrl_res *p_this, const char *p_command)
+// Select the sequences used to draw the line, a combination of EMRL_CAP_ flags such as one of the
+// EMRL_TERM_ profiles. Each edit is drawn with whichever correct choice is the fewest bytes, which
+// may be reprinting the rest of the line and moving back rather than an insert or delete sequence
+// even when the terminal has one. EMRL_TERM_DUMB redraws with spaces and backspaces, counting the
+// prompt as printable characters. Highlighting needs EMRL_CAP_SGR and EMRL_CAP_MOVE.
+//
+// The default is EMRL_TERM_VT100, with insert and delete unless USE_INSERT_ESCAPE_SEQUENCE or
+// USE_DELETE_ESCAPE_SEQUENCE are undefined.
+void emrl_set_terminal(struct emrl_res *p_this, unsigned caps)
 {
-	struct emrl_history *ph = &p_this->history;
-	size_t cmd_len = strlen(p_command) + 1;
+	// Attributes can't be reset once SGR is dropped
+	HL_DEFAULT();
+	p_this->caps = caps;
+#ifdef USE_HIGHLIGHT
+	if(NULL != p_this->p_hl)
+		p_this->p_hl->dirty = true;
+#endif
+	tx_kick(p_this);
+}
 
-	if(cmd_len > (sizeof ph->buf - 2))
-		return;
+unsigned emrl_terminal(const struct emrl_res *p_this)
+{
+	return p_this->caps;
+}
 
-	ph->p_newest = ph->p_put;
+#ifdef USE_WRAP
+// Columns of the terminal, so that a line longer than a row is drawn across the rows it wraps
+// onto. The default of 0 draws the line as though every line fits on one row. Moving between rows
+// needs EMRL_CAP_MOVE, and a terminal that holds the cursor at the right margin until the next
+// character is printed, as the VT100 and its successors do. The prompt is taken to be
+// strlen(prompt) cells wide, and chunks left on the display by interactive streaming aren't
+// counted.
+//
+// If the width changes while the line is shown, e.g. on a NAWS update or SIGWINCH, set it between
+// emrl_hide() and emrl_show() so that the line is removed as it was drawn. The width isn't part
+// of the saved state.
+void emrl_set_width(struct emrl_res *p_this, size_t width)
+{
+	p_this->width = (width <= UINT16_MAX) ? width : UINT16_MAX;
+}
 
-	// Will we overwrite the oldest member?
-	bool overwrite;
-	if(NULL == ph->p_oldest)
-	{
-		// No oldest member to overwrite, remember to initialise
-		ph->p_oldest = ph->p_newest;
-		overwrite = false;
-	}
-	else
-	{
-		// Calculate number of bytes to before we pass p_oldest
-		ptrdiff_t len_to_ovr = ph->p_oldest - ph->p_put;
-		if(len_to_ovr < 0)
-			len_to_ovr += (sizeof ph->buf - 2);
+size_t emrl_width(const struct emrl_res *p_this)
+{
+	return p_this->width;
+}
+#endif
 
-		overwrite = (cmd_len > (size_t)len_to_ovr);
-	}
+#ifdef USE_ESCAPE_INPUT
+// Ask the terminal for its Device Attributes. The reply is consumed as input rather than shown,
+// and selects EMRL_TERM_XTERM for VT220 class terminals onwards, or EMRL_TERM_VT100 for earlier
+// ones. Until then, or if no reply comes, the current capabilities stay in use. A terminal that
+// doesn't understand the request may show it, so only ask where an ANSI terminal is likely.
+void emrl_detect_terminal(struct emrl_res *p_this)
+{
+	if(MACHINE())
+		return;
 
-	// Will we pass the end of the buffer?
-	size_t len_to_wrap = ph->p_buf_last - ph->p_put;
-	if(cmd_len <= len_to_wrap)
-	{
-		// No, one copy needed
-		(void)memcpy(ph->p_put, p_command, cmd_len);
-		ph->p_put += cmd_len;
+	p_this->da_pending = true;
+	PRINT(SEQ_DEVICE_ATTRIBUTES);
+	tx_kick(p_this);
+}
 
-		// Pre-wrap p_put since it is used to update p_newest
-		if(ph->p_put == ph->p_buf_last)
-			ph->p_put = ph->buf + 1;
-	}
-	else
+// Drop an escape sequence when its next byte takes longer than gap to arrive, the byte is then
+// taken as input of its own. Without a timeout, a lone ESC key or a sequence that lost a byte on
+// the way swallows the next keystroke, which is shown in caret notation as part of an unknown
+// sequence. now returns the time in any units that wrap around the range of emrl_cycles, and is
+// only called while a sequence is pending. Gaps are measured between calls, so pass input in as it
+// arrives. Pass NULL to wait for the rest of a sequence however long it takes, the default.
+void emrl_set_escape_timeout(struct emrl_res *p_this, emrl_time_func now, emrl_cycles gap)
+{
+	p_this->esc_now = now;
+	p_this->esc_gap = gap;
+	esc_stamp(p_this);
+}
+
+// Escape timeout for a link at baud, counting ticks_per_sec. The bytes of a sequence are sent back
+// to back, so EMRL_ESC_GAP_CHARS character times of 10 bits are plenty, but no less than
+// EMRL_ESC_GAP_MIN_MS for links that deliver data in bursts. Pass 0 for baud if it isn't known.
+emrl_cycles emrl_escape_gap(unsigned long baud, unsigned long ticks_per_sec)
+{
+	uint64_t gap = (uint64_t)ticks_per_sec * EMRL_ESC_GAP_MIN_MS / 1000;
+	if(0 != baud)
 	{
-		// Yes, two copies needed
-		(void)memcpy(ph->p_put, p_command, len_to_wrap);
-		cmd_len -= len_to_wrap;
-		(void)memcpy(ph->buf+1, p_command+len_to_wrap, cmd_len);
-		ph->p_put = ph->buf + 1 + cmd_len;
+		uint64_t chars_gap = (uint64_t)ticks_per_sec * 10 * EMRL_ESC_GAP_CHARS / baud;
+		if(chars_gap > gap)
+			gap = chars_gap;
 	}
 
-	if(overwrite)
-		ph->p_oldest = hist_search_forward(p_this, ph->p_put);
+	const emrl_cycles max_gap = (emrl_cycles)-1;
+	return (gap < max_gap) ? (emrl_cycles)gap : max_gap;
 }
+#endif
 
-
-static inline void process_escape_state(struct emrl_res *p_this, char chr)
+#ifdef USE_SAVE_STATE
+// Write the editing state to p_buf so that another instance, possibly in a new process, can carry
+// on where this one left off: the partial line and cursor, any escape sequence or delimiter match
+// in progress, the history and history search position, and the mode settings. Configuration
+// given to emrl_init() and the set functions taking pointers isn't included.
+//
+// Returns the number of bytes needed, like snprintf() the state has only been written in full if
+// this is no more than size. Fields are encoded a byte at a time, so the state doesn't depend on
+// the build or platform that wrote it, or on the optional features it was built with.
+size_t emrl_save_state(const struct emrl_res *p_this, void *p_buf, size_t size)
 {
-	// Overflow check not needed in emrl_esc_new (always first character)
-	// or emrl_esc_ss3 (always second character)
-	*p_this->p_esc++ = chr;
+	struct state_out out = {p_buf, size, 0};
 
-	if(emrl_esc_new == p_this->esc_state)
+	state_put(&out, STATE_MAGIC, sizeof STATE_MAGIC - 1);
+	state_put_uint(&out, STATE_VERSION);
+
+	unsigned flags = 0;
+#ifdef USE_MACHINE_MODE
+	if(p_this->machine)
+		flags |= state_machine;
+#endif
+#ifdef USE_STREAMING
+	if(p_this->streaming)
+		flags |= state_streaming;
+	if(p_this->streamed)
+		flags |= state_streamed;
+#endif
+#ifdef USE_ESCAPE_INPUT
+	if(p_this->da_pending)
+		flags |= state_da_pending;
+#endif
+	state_put_uint(&out, flags);
+#ifdef USE_STREAMING
+	state_put_uint(&out, p_this->line_part);
+#else
+	state_put_uint(&out, emrl_part_whole);
+#endif
+	state_put_uint(&out, p_this->caps);
+#ifdef USE_ESCAPE_INPUT
+	state_put_uint(&out, p_this->da_level);
+#else
+	state_put_uint(&out, 0);
+#endif
+	state_put_uint(&out, p_this->hide_depth);
+	state_put_uint(&out, p_this->delim_pos);
+#ifdef USE_ESCAPE_INPUT
+	state_put_uint(&out, p_this->esc_state);
+	state_put_uint(&out, p_this->esc_len);
+	state_put(&out, p_this->esc_buf, p_this->esc_len);
+#else
+	state_put_uint(&out, emrl_esc_none);
+	state_put_uint(&out, 0);
+#endif
+
+#ifdef USE_HISTORY
+	// During a history search the command buffer holds the line typed before it started
+	const struct emrl_history *ph = &p_this->history;
+	size_t line_len = (0 != ph->current) ? ph->cmd_free_bak : p_this->cmd_free;
+#else
+	size_t line_len = p_this->cmd_free;
+#endif
+	state_put_uint(&out, line_len);
+	state_put(&out, p_this->cmd_buf, line_len);
+	state_put_uint(&out, p_this->cursor);
+
+#ifdef USE_HISTORY
+	// History from oldest to newest, with the search position counted back from the newest
+	size_t count = 0;
+	size_t current_pos = 0;
+	if(0 != ph->newest)
 	{
-		switch(chr)
+		emrl_hist_idx entry = ph->oldest;
+		for(;;)
 		{
-			case '[':
-				p_this->esc_state = emrl_esc_csi;
-				break;
+			++count;
+			if(entry == ph->current)
+				current_pos = count;
 
-			case 'O':
-				p_this->esc_state = emrl_esc_ss3;
+			if(entry == ph->newest)
 				break;
 
-			default:
-				reset_esc(p_this, false);
-				break;
+			entry = hist_search_forward(p_this, entry);
 		}
 	}
-	else if(emrl_esc_ss3 == p_this->esc_state)
-	{
-		reset_esc(p_this, false);
-	}
-	else if(emrl_esc_csi == p_this->esc_state)
+
+	state_put_uint(&out, (0 != current_pos) ? count - current_pos + 1 : 0);
+	state_put_uint(&out, count);
+	if(0 != count)
 	{
-		// Check for a 'final byte'
-		if(chr >= 0x40 && chr <= 0x7e)
-		{
-			interpret_csi_escape(p_this);
-		}
-		else if(p_this->p_esc == p_this->p_esc_last)
+		emrl_hist_idx entry = ph->oldest;
+		for(;;)
 		{
-			reset_esc(p_this, false);
+			state_put_entry(&out, ph, entry);
+			if(entry == ph->newest)
+				break;
+
+			entry = hist_search_forward(p_this, entry);
 		}
 	}
+#else
+	// No search position and no entries
+	state_put_uint(&out, 0);
+	state_put_uint(&out, 0);
+#endif
+
+	return out.len;
 }
 
-static inline void interpret_csi_escape(struct emrl_res *p_this)
+// Continue from state written by emrl_save_state(), into an instance set up with emrl_init() and
+// not yet used. Nothing is printed, the display is assumed to still show the line as it was when
+// the state was saved. A highlighter should be set afterwards. History entries, any escape
+// sequence in progress, and the machine mode and streaming settings are dropped by builds without
+// those features.
+//
+// Returns false, leaving the instance unchanged, if the state is malformed, from an unknown
+// version, or the line or a history entry doesn't fit the command buffer. A smaller history
+// buffer than before drops the oldest entries, and if the entry being shown in a history search
+// is lost the search ends with that entry as the line being edited.
+bool emrl_restore_state(struct emrl_res *p_this, const void *p_buf, size_t len)
 {
-	bool known = true;
-	size_t len = p_this->p_esc - p_this->esc_buf;
-	if(2 == len)
+	struct state_in in = {p_buf, (const uint8_t *)p_buf + len, false};
+
+	const char *p_magic = state_get_bytes(&in, sizeof STATE_MAGIC - 1);
+	if(NULL == p_magic || 0 != memcmp(p_magic, STATE_MAGIC, sizeof STATE_MAGIC - 1) ||
+	   STATE_VERSION != state_get_uint(&in))
+		return false;
+
+	size_t flags = state_get_uint(&in);
+	size_t line_part = state_get_uint(&in);
+	size_t caps = state_get_uint(&in);
+	size_t da_level = state_get_uint(&in);
+	size_t hide_depth = state_get_uint(&in);
+	size_t delim_pos = state_get_uint(&in);
+	size_t esc_state = state_get_uint(&in);
+	size_t esc_len = state_get_uint(&in);
+	if(in.error || line_part > emrl_part_last || caps > UINT8_MAX || da_level > UINT8_MAX ||
+	   hide_depth > UINT8_MAX || delim_pos >= strlen(p_this->delim))
+		return false;
+
+	const char *p_esc = state_get_bytes(&in, esc_len);
+	if(NULL == p_esc || !state_esc_valid(esc_state, p_esc, esc_len))
+		return false;
+
+	size_t line_len = state_get_uint(&in);
+	const char *p_line = (line_len <= p_this->cmd_last) ? state_get_bytes(&in, line_len) : NULL;
+	size_t cursor = state_get_uint(&in);
+	size_t current_back = state_get_uint(&in);
+	size_t count = state_get_uint(&in);
+	if(in.error || NULL == p_line || current_back > count)
+		return false;
+
+	// Check every entry before changing anything
+	const uint8_t *p_entries = in.p_pos;
+	const char *p_current = NULL;
+	for(size_t i = count; i > 0; --i)
 	{
-		switch(p_this->esc_buf[1])
-		{
-			case 'A':
-				// Up
-				hist_show_prev(p_this);
-				break;
+		const char *p_entry = state_get_string(&in, p_this->cmd_last);
+		if(NULL == p_entry)
+			return false;
 
-			case 'B':
-				// Down
-				hist_show_next(p_this);
-				break;
+		if(i == current_back)
+			p_current = p_entry;
+	}
 
-			case 'C':
-				// Right
-				if(p_this->p_cursor != p_this->p_cmd_free)
-				{
-					++p_this->p_cursor;
-					PRINT(SEQ_STEP_RIGHT);
-				}
-				break;
+	size_t shown_len = (NULL != p_current) ? strlen(p_current) : line_len;
+	if(cursor > shown_len)
+		return false;
 
-			case 'D':
-				// Left
-				if(p_this->p_cursor != p_this->cmd_buf)
-				{
-					--p_this->p_cursor;
-					PRINT(SEQ_STEP_LEFT);
-				}
-				break;
+#ifdef USE_HISTORY
+	// Rebuild the history by adding the entries again, so offsets are never taken from the state
+	struct emrl_history *ph = &p_this->history;
+#ifdef USE_MACHINE_MODE
+	p_this->machine = false;
+#endif
+	clear_history(p_this);
+	in.p_pos = p_entries;
+	for(size_t i = count; i > 0; --i)
+		(void)add_to_history(p_this, state_get_string(&in, p_this->cmd_last));
 
-			default:
-				known = false;
-				break;
-		}
+	if(NULL != p_current)
+	{
+		// Find the entry again counting back from the newest, it may have been dropped
+		emrl_hist_idx entry = ph->newest;
+		while(--current_back > 0 && entry != ph->oldest)
+			entry = hist_search_backward(p_this, entry);
+
+		if(0 == current_back)
+		{
+			ph->current = entry;
+			ph->cmd_free_bak = line_len;
+		}
+		else
+		{
+			p_line = p_current;
+			line_len = shown_len;
+		}
+	}
+#else
+	// The entry shown by a history search becomes the line
+	(void)p_entries;
+	if(NULL != p_current)
+	{
+		p_line = p_current;
+		line_len = shown_len;
+	}
+#endif
+
+	(void)memcpy(p_this->cmd_buf, p_line, line_len);
+	p_this->cmd_free = shown_len;
+	p_this->cursor = cursor;
+	p_this->delim_pos = delim_pos;
+#ifdef USE_ESCAPE_INPUT
+	(void)memcpy(p_this->esc_buf, p_esc, esc_len);
+	p_this->esc_len = esc_len;
+	p_this->esc_state = esc_state;
+	p_this->da_pending = (0 != (flags & state_da_pending));
+	p_this->da_level = da_level;
+	esc_stamp(p_this);
+#else
+	(void)p_esc;
+	(void)da_level;
+#endif
+
+#ifdef USE_MACHINE_MODE
+	p_this->machine = (0 != (flags & state_machine));
+#endif
+#ifdef USE_STREAMING
+	p_this->streaming = (0 != (flags & state_streaming));
+	p_this->streamed = (0 != (flags & state_streamed));
+	p_this->line_part = line_part;
+#else
+	(void)line_part;
+#endif
+	(void)flags;
+	p_this->caps = caps;
+	p_this->hide_depth = hide_depth;
+#ifdef USE_SUGGEST
+	(void)suggest_forget(p_this);
+#endif
+
+	return true;
+}
+#endif
+
+#ifdef USE_TRACE
+// Write events to a trace ring, or stop tracing if p_trace is NULL. Each record is timestamped
+// with EMRL_TRACE_TIME().
+void emrl_set_trace(struct emrl_res *p_this, struct emrl_trace *p_trace)
+{
+	p_this->p_trace = p_trace;
+	p_this->trace_out_len = 0;
+}
+#endif
+
+#ifdef USE_HIGHLIGHT
+// Set up a highlighter. Spans from func select an entry of sgr for each cell of the line, the
+// parameters of an SGR sequence such as "1;32" for bold green. Attribute 0 is the terminal's
+// default rendition and sgr[0] is not used, 255 is reserved. p_spans holds max_spans spans and
+// p_shown must be the same size as the command buffer.
+void emrl_highlight_init(struct emrl_highlight *p_hl, emrl_highlight_func func, void *p_ctx,
+                         const char *const *sgr, struct emrl_span *p_spans, size_t max_spans,
+                         uint8_t *p_shown)
+{
+	p_hl->func = func;
+	p_hl->p_ctx = p_ctx;
+	p_hl->sgr = sgr;
+	p_hl->p_spans = p_spans;
+	p_hl->max_spans = max_spans;
+	p_hl->p_shown = p_shown;
+	p_hl->attr = 0;
+	p_hl->dirty = false;
+}
+
+// Colour the line as it is edited, or stop if p_hl is NULL. After each call that changes the line
+// the highlighter is run over the whole line, but only cells whose attribute differs from what
+// is displayed are printed again. Everything else is drawn as without a highlighter, with insert
+// and delete sequences shifting cells along with their attributes.
+//
+// Highlighting takes effect from the next change to the line or emrl_redraw(). The terminal is
+// returned to its default rendition before emrl prints anything other than the line, or returns a
+// completed line.
+void emrl_set_highlight(struct emrl_res *p_this, struct emrl_highlight *p_hl)
+{
+	if(NULL != p_this->p_hl)
+	{
+		HL_DEFAULT();
+		tx_kick(p_this);
+	}
+
+	p_this->p_hl = p_hl;
+	if(NULL != p_hl)
+	{
+		// Assume the line was drawn without attributes
+		(void)memset(p_hl->p_shown, 0, p_this->cmd_last + 1);
+		p_hl->attr = 0;
+		p_hl->dirty = true;
+	}
+}
+#endif
+
+
+char *emrl_process_char(struct emrl_res *p_this, char chr)
+{
+	CYCLES_START();
+	char *p_command = process_char(p_this, chr);
+#ifdef USE_LINE_QUEUE
+	if(NULL != p_this->lines.buf)
+	{
+		p_command = NULL;
+		p_this->lines.held = false;
+	}
+#endif
+	HL_REFRESH();
+	SG_UPDATE();
+	tx_kick(p_this);
+	CYCLES_END(emrl_api_process_char);
+	return p_command;
+}
+
+// Process a block of input, stopping early if a line is completed. The number of bytes consumed
+// is written to *p_used, any remainder should be passed in again once the returned line has been
+// dealt with. With a line queue all of the input is consumed, unless a machine mode line is held
+// at its delimiter. Runs of printable ASCII typed at the end of the line are appended to the
+// command buffer with one copy and echoed with one print, rather than a character at a time.
+char *emrl_process_buf(struct emrl_res *p_this, const char *p_buf, size_t len, size_t *p_used)
+{
+	CYCLES_START();
+	const char *p_in = p_buf;
+	const char *p_end = p_buf + len;
+	char *p_command = NULL;
+
+	while(p_in < p_end && NULL == p_command)
+	{
+#ifdef USE_MACHINE_MODE
+		if(p_this->machine)
+		{
+			// Everything up to a possible delimiter is line data
+			size_t run_len = machine_run_len(p_this, p_in, p_end - p_in);
+			if(run_len > 0)
+			{
+				TRACE(emrl_trace_char, *p_in, run_len);
+				size_t added = machine_append(p_this, p_in, run_len);
+
+				// The rest of the run is dropped unless the full buffer is returned as a chunk
+				p_command = STREAM_FULL();
+#ifdef USE_LINE_QUEUE
+				// A chunk refused by a full queue stays in the buffer, and the rest of the run
+				// is left unconsumed
+				if(NULL == p_command && STREAM_DUE())
+				{
+					p_in += added;
+					break;
+				}
+#endif
+				p_in += (NULL != p_command) ? added : run_len;
+			}
+
+			if(NULL == p_command && p_in < p_end)
+			{
+				p_command = process_char(p_this, *p_in++);
+
+#ifdef USE_LINE_QUEUE
+				// A line refused by a full queue waits at its delimiter
+				if(p_this->lines.held)
+				{
+					p_this->lines.held = false;
+					--p_in;
+					break;
+				}
+#endif
+			}
+		}
+		else
+#endif
+		{
+			size_t run_len = fast_path_len(p_this, p_in, p_end - p_in);
+			if(run_len > 0)
+			{
+				append_run(p_this, p_in, run_len);
+				p_in += run_len;
+				p_command = STREAM_FULL();
+			}
+			else
+			{
+				p_command = process_char(p_this, *p_in++);
+			}
+		}
+
+#ifdef USE_LINE_QUEUE
+		// Queued lines are taken with emrl_peek_line(), carry on with the input
+		if(NULL != p_this->lines.buf)
+			p_command = NULL;
+#endif
+	}
+
+	*p_used = p_in - p_buf;
+	HL_REFRESH();
+	SG_UPDATE();
+	tx_kick(p_this);
+	CYCLES_END(emrl_api_process_buf);
+	return p_command;
+}
+
+static inline char *process_char(struct emrl_res *p_this, char chr)
+{
+	TRACE(emrl_trace_char, chr, 1);
+
+#ifdef USE_MACHINE_MODE
+	if(p_this->machine)
+		return machine_char(p_this, chr);
+#endif
+
+#ifdef USE_ESCAPE_INPUT
+	if(emrl_esc_none != p_this->esc_state && esc_continues(p_this))
+	{
+		process_escape_state(p_this, chr);
+		return NULL;
+	}
+#endif
+
+	if(chr == p_this->delim[p_this->delim_pos])
+	{
+		++p_this->delim_pos;
+		if('\0' == p_this->delim[p_this->delim_pos])
+		{
+			deferred_history_copy(p_this);
+			HL_REFRESH();
+			HL_DEFAULT();
+			move_cursor_to_end(p_this);
+			SG_HIDE();
+
+			return line_complete(p_this);
+		}
+	}
+	else
+	{
+		p_this->delim_pos = 0;
+	}
+
+	char str_buf[MAX_PRINTABLE_LEN + 1];
+	switch(chr)
+	{
+		case '\b':
+			erase_back(p_this);
+			break;
+
+		case '\r':
+		case '\n':
+			// Ignore (unless in delim string)
+			break;
+
+#ifdef USE_ESCAPE_INPUT
+		case EMRL_ASCII_ESC:
+			p_this->esc_state = emrl_esc_new;
+			esc_stamp(p_this);
+			break;
+#endif
+
+		case EMRL_ASCII_DEL:
+			erase_back(p_this);
+			break;
+
+		default:
+			char_to_printable(chr, str_buf);
+			add_string(p_this, str_buf);
+			return STREAM_FULL();
+	}
+
+	return NULL;
+}
+
+
+#ifdef USE_HISTORY
+// May be called while a history search is in progress, e.g. for a line taken from the line queue.
+// The search ends with the entry shown becoming the line being edited, since adding may overwrite
+// it.
+void emrl_add_to_history(struct emrl_res *p_this, const char *p_command)
+{
+	CYCLES_START();
+	deferred_history_copy(p_this);
+	(void)add_to_history(p_this, p_command);
+	CYCLES_END(emrl_api_add_to_history);
+}
+
+// Choose how entries are dropped when the history is full. By default the oldest entry goes
+// first. With retention each entry carries a use count in one extra byte. Adding a command that
+// repeats the newest entry, or the entry just recalled by a history search, counts another use
+// rather than storing it again. When an entry that has been used reaches the oldest end it is
+// moved to the newest end with its count halved, so entries that stop being used age out. At most
+// HISTORY_RESCUES entries are moved for each command added, which keeps the work bounded by the
+// size of the command buffer.
+//
+// Any history is discarded. Use counts aren't part of the saved state.
+void emrl_set_history_retention(struct emrl_res *p_this, bool retain)
+{
+	deferred_history_copy(p_this);
+	p_this->history.retain = retain;
+	clear_history(p_this);
+}
+
+// Copy the entry back places before the newest, 0 for the newest, to p_buf which must have room
+// for a full command buffer. Returns false if there are fewer entries. Takes time in proportion to
+// back.
+bool emrl_history_entry(const struct emrl_res *p_this, size_t back, char *p_buf)
+{
+	const struct emrl_history *ph = &p_this->history;
+	emrl_hist_idx entry = ph->newest;
+	if(0 == entry)
+		return false;
+
+	for(; back > 0; --back)
+	{
+		if(entry == ph->oldest)
+			return false;
+
+		entry = hist_search_backward(p_this, entry);
+	}
+
+	// Entry may wrap around the end of the history buffer
+	const char *p_entry = ph->buf + entry;
+	size_t len = strlen(p_entry);
+	(void)memcpy(p_buf, p_entry, len);
+	if(entry + len == ph->last)
+		(void)strcpy(p_buf + len, ph->buf + 1);
+	else
+		p_buf[len] = '\0';
+
+	return true;
+}
+
+// Move the history to another buffer, e.g. to grow or shrink it as it's used. The buffers mustn't
+// overlap, and the new one may be NULL with a size of 0 to keep no history. The newest entries that
+// fit are kept with their use counts, and a history search or suggestion carries on if its entry is
+// kept. If the entry shown by a history search is dropped the search ends with that entry as the
+// line being edited. Nothing is printed. Takes time in proportion to the history kept. A buffer
+// larger than EMRL_HIST_IDX_MAX + 1 bytes is clamped to that size, as in emrl_init().
+void emrl_history_rebuffer(struct emrl_res *p_this, char *p_buf, size_t size)
+{
+	assert(0 == size || size >= 4);
+	if(0 != size && size - 1 > EMRL_HIST_IDX_MAX)
+		size = (size_t)EMRL_HIST_IDX_MAX + 1;
+	struct emrl_history *ph = &p_this->history;
+
+	// Find the oldest entry to keep, each takes its text, terminator and any use count
+	size_t space = (0 != size) ? size - 2 : 0;
+	size_t kept = 0;
+	emrl_hist_idx first = 0;
+	bool keep_current = false;
+	for(emrl_hist_idx entry = ph->newest; 0 != entry; )
+	{
+		size_t len = hist_entry_len(ph, entry) + 1 + ph->retain;
+		if(kept + len > space)
+			break;
+
+		kept += len;
+		first = entry;
+		if(entry == ph->current)
+			keep_current = true;
+
+		entry = (entry != ph->oldest) ? hist_search_backward(p_this, entry) : 0;
+	}
+
+	if(!keep_current)
+		deferred_history_copy(p_this);
+
+	const struct emrl_history old = *ph;
+#ifdef USE_SUGGEST
+	emrl_hist_idx shown = p_this->suggest.shown;
+	emrl_hist_idx match = p_this->suggest.match;
+	emrl_hist_idx match_to = 0;
+#endif
+	ph->buf = (0 != size) ? p_buf : NULL;
+	ph->last = (0 != size) ? size - 1 : 0;
+	clear_history(p_this);
+	ph->cmd_free_bak = old.cmd_free_bak;
+
+	// Copy oldest first, the entries are written as if they had just been added
+	for(emrl_hist_idx entry = first; 0 != entry; )
+	{
+		size_t pos = entry;
+		if(ph->retain)
+		{
+			ph->buf[ph->put] = old.buf[hist_prev(&old, pos)];
+			ph->put = hist_next(ph, ph->put);
+		}
+
+		emrl_hist_idx to = ph->put;
+		char chr;
+		do
+		{
+			chr = old.buf[pos];
+			ph->buf[ph->put] = chr;
+			ph->put = hist_next(ph, ph->put);
+			pos = hist_next(&old, pos);
+		}
+		while('\0' != chr);
+
+		if(0 == ph->oldest)
+			ph->oldest = to;
+
+		ph->newest = to;
+		if(entry == old.current)
+			ph->current = to;
+
+		if(entry == old.recalled)
+			ph->recalled = to;
+
+#ifdef USE_SUGGEST
+		suggest_index_add(p_this, to);
+		if(entry == shown)
+			p_this->suggest.shown = to;
+
+		if(entry == match)
+			match_to = to;
+#endif
+
+		// The next entry starts after the terminator and any use count
+		if(entry == old.newest)
+			break;
+
+		entry = ph->retain ? hist_next(&old, pos) : pos;
+	}
+#ifdef USE_SUGGEST
+	// Indexing forgets the match, it still holds if its entry was kept
+	p_this->suggest.match = match_to;
+#endif
+}
+
+// Returns true if adding p_command to the history wouldn't drop any entries, e.g. to decide
+// whether to give the history a larger buffer first. Commands that wouldn't be added at all, or
+// would only count another use with retention, don't drop any.
+bool emrl_history_fits(const struct emrl_res *p_this, const char *p_command)
+{
+	const struct emrl_history *ph = &p_this->history;
+	const char *p_cmd_end = memchr(p_command, '\0', (size_t)p_this->cmd_last + 1);
+	if(MACHINE() || NULL == p_cmd_end)
+		return true;
+
+	if(ph->retain)
+	{
+		// Adding ends any history search, making the entry shown the one recalled
+		emrl_hist_idx recalled = (0 != ph->current) ? ph->current : ph->recalled;
+		if((0 != recalled && hist_entry_equal(ph, recalled, p_command)) ||
+		   (0 != ph->newest && hist_entry_equal(ph, ph->newest, p_command)))
+			return true;
+	}
+
+	size_t need = p_cmd_end - p_command + 1 + ph->retain;
+	if(0 == ph->last)
+		return false;
+
+	size_t ring_len = ph->last - 1;
+	if(0 == ph->oldest)
+		return need <= ring_len;
+
+	// Free bytes run from put up to the oldest entry, or its use count
+	emrl_hist_idx end = ph->retain ? hist_prev(ph, ph->oldest) : ph->oldest;
+	ptrdiff_t space = (ptrdiff_t)end - ph->put;
+	if(space < 0)
+		space += ring_len;
+
+	return need <= (size_t)space;
+}
+
+#ifdef USE_SUGGEST
+// Suggest the rest of the line from the history as it's typed. While the cursor is at the end of
+// the line, the rest of the newest entry that starts with it is shown after it in EMRL_SUGGEST_SGR,
+// and cursor right or end takes it into the line. The suggestion is redrawn once per call, only
+// printing the cells that change, and is kept to the cursor's row. The terminal needs
+// EMRL_CAP_SGR.
+//
+// Entries are found through an index of their offsets in order of their text, with room for slots
+// offsets at p_index. EMRL_SUGGEST_SLOTS() of the history buffer size has room for every entry,
+// with fewer slots the least recent entries go unsuggested. Adding to the history moves up to the
+// whole index along by one slot. A suggestion is found with two binary searches of the index and a
+// scan of the entries starting with the line, and the scan is skipped while the line is typed along
+// the suggestion. Pass NULL to stop suggesting.
+void emrl_set_suggestions(struct emrl_res *p_this, emrl_hist_idx *p_index, size_t slots)
+{
+	struct emrl_suggest *sg = &p_this->suggest;
+	suggest_draw(p_this, 0);
+	sg->p_index = (0 != slots) ? p_index : NULL;
+	sg->size = slots;
+	sg->count = 0;
+	sg->shown = sg->match = 0;
+
+	// Index the entries already there, oldest first so the index keeps the newest if it fills
+	const struct emrl_history *ph = &p_this->history;
+	for(emrl_hist_idx entry = ph->oldest; 0 != entry; )
+	{
+		suggest_index_add(p_this, entry);
+		entry = (entry != ph->newest) ? hist_search_forward(p_this, entry) : 0;
+	}
+
+	tx_kick(p_this);
+}
+#endif
+
+// Returns false if the command wasn't added
+static inline bool add_to_history(struct emrl_res *p_this, const char *p_command)
+{
+	struct emrl_history *ph = &p_this->history;
+
+	// No history in machine mode
+	if(MACHINE())
+		return false;
+
+	// Entries must fit in the command buffer to be recalled. This also bounds the work done here
+	// and in history searches, so don't search further than that for the terminator.
+	size_t max_len = p_this->cmd_last;
+	const char *p_cmd_end = memchr(p_command, '\0', max_len + 1);
+	if(NULL == p_cmd_end)
+		return false;
+
+	size_t cmd_len = p_cmd_end - p_command + 1;
+
+	// Usable bytes, excluding the zeroed boundary bytes at each end
+	size_t ring_len = ph->last - 1;
+	if(0 == ph->last || cmd_len + ph->retain > ring_len)
+		return false;
+
+	if(ph->retain)
+	{
+		if(hist_count_use(p_this, p_command))
+			return true;
+
+		hist_make_room(p_this, cmd_len + 1);
+
+		// Unused so far
+		ph->buf[ph->put] = 1;
+		ph->put = hist_next(ph, ph->put);
+		if(0 == ph->oldest)
+			ph->oldest = ph->put;
+
+		ph->newest = ph->put;
+		hist_write(ph, p_command, cmd_len);
+#ifdef USE_SUGGEST
+		suggest_index_add(p_this, ph->newest);
+#endif
+		return true;
+	}
+
+#ifdef USE_SUGGEST
+	suggest_drop_overwritten(p_this, cmd_len);
+#endif
+	ph->newest = ph->put;
+
+	// Will we overwrite the oldest member?
+	bool overwrite;
+	if(0 == ph->oldest)
+	{
+		// No oldest member to overwrite, remember to initialise
+		ph->oldest = ph->newest;
+		overwrite = false;
+	}
+	else
+	{
+		// Calculate number of bytes to before we pass oldest
+		ptrdiff_t len_to_ovr = (ptrdiff_t)ph->oldest - ph->put;
+		if(len_to_ovr < 0)
+			len_to_ovr += ring_len;
+
+		overwrite = (cmd_len > (size_t)len_to_ovr);
+	}
+
+	// Will we pass the end of the buffer?
+	size_t len_to_wrap = ph->last - ph->put;
+
+	// If the new terminator lands on an old one, the entry after it survives intact and becomes
+	// the oldest, searching forward from put would wrongly discard it
+	size_t term = (cmd_len <= len_to_wrap) ? (ph->put + cmd_len - 1) : (cmd_len - len_to_wrap);
+	bool on_boundary = ('\0' == ph->buf[term]);
+
+	hist_write(ph, p_command, cmd_len);
+
+	if(overwrite)
+		ph->oldest = on_boundary ? ph->put : hist_search_forward(p_this, ph->put);
+
+#ifdef USE_SUGGEST
+	suggest_index_add(p_this, ph->newest);
+#endif
+	return true;
+}
+
+// With retention, a command repeating the newest entry or the entry just recalled counts as a use
+// of that entry. Returns false if the command should be added.
+static inline bool hist_count_use(struct emrl_res *p_this, const char *p_command)
+{
+	struct emrl_history *ph = &p_this->history;
+
+	emrl_hist_idx entry = ph->recalled;
+	ph->recalled = 0;
+	if(0 == entry || !hist_entry_equal(ph, entry, p_command))
+		entry = ph->newest;
+
+	if(0 == entry || !hist_entry_equal(ph, entry, p_command))
+		return false;
+
+	unsigned char *p_count = (unsigned char *)ph->buf + hist_prev(ph, entry);
+	if(*p_count < UINT8_MAX)
+		++*p_count;
+
+	return true;
+}
+
+// Free need bytes from put onwards by dropping the oldest entries. An entry that has been used is
+// moved to the newest end with its count halved instead, unless it is the only entry. Moving an
+// entry doesn't free any space, but it brings the next entry to the oldest end.
+static inline void hist_make_room(struct emrl_res *p_this, size_t need)
+{
+	struct emrl_history *ph = &p_this->history;
+	size_t ring_len = ph->last - 1;
+	unsigned rescues = 0;
+
+	while(0 != ph->oldest)
+	{
+		// Free bytes run from put up to the count of the oldest entry
+		emrl_hist_idx src = hist_prev(ph, ph->oldest);
+		ptrdiff_t space = (ptrdiff_t)src - ph->put;
+		if(space < 0)
+			space += ring_len;
+
+		if((size_t)space >= need)
+			return;
+
+		unsigned char count = (unsigned char)ph->buf[src] - 1;
+		emrl_hist_idx next = (ph->oldest != ph->newest) ? hist_search_forward(p_this, ph->oldest) : 0;
+		if(0 != count && 0 != next && rescues < HISTORY_RESCUES)
+		{
+			++rescues;
+
+			// The copy trails the original by the free space, so a byte is always read before it
+			// is overwritten
+			ph->buf[ph->put] = (char)(1 + count / 2);
+			ph->put = hist_next(ph, ph->put);
+			src = hist_next(ph, src);
+			ph->newest = ph->put;
+#ifdef USE_SUGGEST
+			// Taken out of the index while its text is intact, the copy may overwrite it
+			suggest_moved(p_this, ph->oldest, ph->newest);
+			suggest_index_drop(p_this, ph->oldest);
+#endif
+
+			char chr;
+			do
+			{
+				chr = ph->buf[src];
+				ph->buf[ph->put] = chr;
+				ph->put = hist_next(ph, ph->put);
+				src = hist_next(ph, src);
+			}
+			while('\0' != chr);
+#ifdef USE_SUGGEST
+			suggest_index_add(p_this, ph->newest);
+#endif
+		}
+#ifdef USE_SUGGEST
+		else
+		{
+			suggest_index_drop(p_this, ph->oldest);
+		}
+#endif
+
+		ph->oldest = next;
+	}
+}
+
+// Copy to put, wrapping around the end of the buffer
+static inline void hist_write(struct emrl_history *ph, const char *p_data, size_t len)
+{
+	// Will we pass the end of the buffer?
+	size_t len_to_wrap = ph->last - ph->put;
+	if(len <= len_to_wrap)
+	{
+		// No, one copy needed
+		(void)memcpy(ph->buf + ph->put, p_data, len);
+		ph->put += len;
+
+		// Pre-wrap put since it is used to update newest
+		if(ph->put == ph->last)
+			ph->put = 1;
+	}
+	else
+	{
+		// Yes, two copies needed
+		(void)memcpy(ph->buf + ph->put, p_data, len_to_wrap);
+		len -= len_to_wrap;
+		(void)memcpy(ph->buf + 1, p_data + len_to_wrap, len);
+		ph->put = 1 + len;
+	}
+}
+
+// Compare an entry that may wrap around the end of the buffer with a string
+static inline bool hist_entry_equal(const struct emrl_history *ph, emrl_hist_idx entry, const char *p_str)
+{
+	const char *p_entry = ph->buf + entry;
+	size_t len = strlen(p_entry);
+	if(entry + len != ph->last)
+		return 0 == strcmp(p_entry, p_str);
+
+	return 0 == strncmp(p_entry, p_str, len) && 0 == strcmp(ph->buf + 1, p_str + len);
+}
+
+// Neighbouring positions in the ring, skipping the boundary bytes
+static inline emrl_hist_idx hist_next(const struct emrl_history *ph, size_t pos)
+{
+	return (pos + 1 == ph->last) ? 1 : pos + 1;
+}
+
+static inline emrl_hist_idx hist_prev(const struct emrl_history *ph, size_t pos)
+{
+	return (1 == pos) ? (size_t)ph->last - 1 : pos - 1;
+}
+#endif
+
+// Returns true if an output call has failed since the last check. Output is suppressed from the
+// failure onwards, so the terminal no longer matches the command buffer and should be redrawn.
+bool emrl_print_error(struct emrl_res *p_this)
+{
+	bool error = p_this->print_error;
+	p_this->print_error = false;
+	return error;
+}
+
+
+// The prompt is printed by emrl_redraw() and when the line is shown after asynchronous output.
+// Only the pointer is stored, the string must remain valid.
+void emrl_set_prompt(struct emrl_res *p_this, const char *prompt)
+{
+	p_this->prompt = prompt;
+}
+
+// Print the prompt and the current line from the start of an empty row, leaving the cursor in
+// place within the line. Use to show the initial prompt, after printing command output, or to
+// recover after emrl_print_error().
+void emrl_redraw(struct emrl_res *p_this)
+{
+	// Nothing is displayed in machine mode, but emrl_print_async() output still needs a kick
+	if(!MACHINE())
+	{
+#ifdef USE_SUGGEST
+		(void)suggest_forget(p_this);
+#endif
+		HL_DEFAULT();
+		PRINT(p_this->prompt);
+		wrap_fixup(p_this, 0);
+		print_line(p_this);
+		move_cursor(p_this, p_this->cmd_free, p_this->cursor);
+		HL_REFRESH();
+		SG_UPDATE();
+		HL_DEFAULT();
+	}
+
+	tx_kick(p_this);
+}
+
+// Remove the prompt and line from the display, leaving the cursor at the start of the now empty
+// row. Calls nest, the line is shown again by the matching emrl_show(). Don't process input
+// while the line is hidden.
+void emrl_hide(struct emrl_res *p_this)
+{
+	if(0 == p_this->hide_depth++ && !MACHINE())
+	{
+		// Start from the prompt's row when the line wraps
+		size_t width = wrap_width(p_this);
+		size_t prompt_len = strlen(p_this->prompt);
+		size_t line_cells = p_this->cmd_free;
+#ifdef USE_SUGGEST
+		line_cells = suggest_forget(p_this);
+#endif
+		size_t cells = prompt_len + line_cells;
+		HL_DEFAULT();
+		if(0 != width)
+			print_csi(p_this, (prompt_len + p_this->cursor) / width, 'A');
+
+		PRINT("\r");
+		if(p_this->caps & EMRL_CAP_ERASE)
+		{
+			PRINT((0 != width) ? SEQ_ERASE_BELOW : SEQ_ERASE_TO_END);
+		}
+		else
+		{
+			print_repeated(p_this, ' ', cells);
+			PRINT("\r");
+			if(0 != width && 0 != cells)
+				print_csi(p_this, (cells - 1) / width, 'A');
+		}
+		tx_kick(p_this);
+	}
+}
+
+void emrl_show(struct emrl_res *p_this)
+{
+	assert(p_this->hide_depth > 0);
+
+	if(0 == --p_this->hide_depth)
+		emrl_redraw(p_this);
+}
+
+// Print a message above the line being edited, the message should end with a new line. To print
+// several messages with a single redraw, surround them with emrl_hide() and emrl_show().
+void emrl_print_async(struct emrl_res *p_this, const char *p_msg)
+{
+	emrl_hide(p_this);
+	PRINT(p_msg);
+	emrl_show(p_this);
+}
+
+
+static inline void print(struct emrl_res *p_this, const char *p_str)
+{
+	// Don't output anything after a failure, a partial escape sequence would be worse than nothing
+	if(p_this->print_error)
+		return;
+
+#ifdef USE_TRACE
+	p_this->trace_out_len += strlen(p_str);
+#endif
+
+#ifdef USE_TX_QUEUE
+	if(NULL != p_this->p_txq)
+	{
+		if(emrl_queue_write(p_this->p_txq, p_str, strlen(p_str)))
+			p_this->tx_pending = true;
+		else
+			p_this->print_error = true;
+	}
+	else
+#endif
+	if(p_this->fputs(p_str, p_this->file) < 0)
+	{
+		p_this->print_error = true;
+	}
+}
+
+#ifdef USE_CYCLE_STATS
+// Mean cycles per call are total_cycles / calls
+const struct emrl_cycle_stats *emrl_cycle_stats(const struct emrl_res *p_this, enum emrl_api api)
+{
+	assert(api < emrl_api_count);
+	return &p_this->cycle_stats[api];
+}
+
+void emrl_reset_cycle_stats(struct emrl_res *p_this)
+{
+	for(unsigned i = 0; i < emrl_api_count; ++i)
+	{
+		struct emrl_cycle_stats *p_stats = &p_this->cycle_stats[i];
+		p_stats->min = (emrl_cycles)-1;
+		p_stats->max = 0;
+		p_stats->calls = 0;
+		p_stats->total_cycles = 0;
+	}
+}
+
+static inline void record_cycles(struct emrl_cycle_stats *p_stats, emrl_cycles cycles)
+{
+	if(cycles < p_stats->min)
+		p_stats->min = cycles;
+
+	if(cycles > p_stats->max)
+		p_stats->max = cycles;
+
+	++p_stats->calls;
+	p_stats->total_cycles += cycles;
+}
+#endif
+
+
+#ifdef USE_TRACE
+static inline void trace(struct emrl_res *p_this, enum emrl_trace_event event, char chr, unsigned arg)
+{
+	if(NULL != p_this->p_trace)
+		emrl_trace_write(p_this->p_trace, EMRL_TRACE_TIME(), event, chr, arg);
+}
+#endif
+
+
+static inline void tx_kick(struct emrl_res *p_this)
+{
+#ifdef USE_TRACE
+	// Output for the API call is complete
+	if(p_this->trace_out_len > 0)
+	{
+		TRACE(emrl_trace_render, '\0', p_this->trace_out_len);
+		p_this->trace_out_len = 0;
+	}
+#endif
+
+#ifdef USE_TX_QUEUE
+	if(p_this->tx_pending)
+	{
+		p_this->tx_pending = false;
+		if(NULL != p_this->tx_kick)
+			p_this->tx_kick(p_this->file);
+	}
+#else
+	(void)p_this;
+#endif
+}
+
+#ifdef USE_HIGHLIGHT
+// Highlighter if one is set and the terminal can show it, painting needs attributes and movement
+static inline struct emrl_highlight *hl_active(struct emrl_res *p_this)
+{
+	const unsigned needed = EMRL_CAP_SGR | EMRL_CAP_MOVE;
+	return ((p_this->caps & needed) == needed) ? p_this->p_hl : NULL;
+}
+
+// Cells inserted at pos by the terminal take its current attribute, the rest shift along
+static inline void hl_insert(struct emrl_res *p_this, size_t pos, size_t count)
+{
+	struct emrl_highlight *p_hl = p_this->p_hl;
+	if(NULL == p_hl)
+		return;
+
+	uint8_t *p_pos = p_hl->p_shown + pos;
+	(void)memmove(p_pos + count, p_pos, p_this->cmd_free - pos - count);
+	(void)memset(p_pos, p_hl->attr, count);
+	p_hl->dirty = true;
+}
+
+static inline void hl_delete(struct emrl_res *p_this, size_t pos)
+{
+	struct emrl_highlight *p_hl = p_this->p_hl;
+	if(NULL == p_hl)
+		return;
+
+	uint8_t *p_pos = p_hl->p_shown + pos;
+	(void)memmove(p_pos, p_pos + 1, p_this->cmd_free - pos);
+	p_hl->dirty = true;
+}
+
+// Cells from start to end have been printed with the current attribute
+static inline void hl_printed(struct emrl_res *p_this, size_t start, size_t end)
+{
+	struct emrl_highlight *p_hl = p_this->p_hl;
+	if(NULL == p_hl)
+		return;
+
+	(void)memset(p_hl->p_shown + start, p_hl->attr, end - start);
+	p_hl->dirty = true;
+}
+
+static inline void hl_set_attr(struct emrl_res *p_this, uint8_t attr)
+{
+	struct emrl_highlight *p_hl = p_this->p_hl;
+	if(NULL == p_hl || attr == p_hl->attr)
+		return;
+
+	// Each attribute is set from the default rendition rather than added to the last one
+	if(0 == attr)
+	{
+		PRINT("\033[m");
+	}
+	else
+	{
+		PRINT("\033[0;");
+		PRINT(p_hl->sgr[attr]);
+		PRINT("m");
+	}
+
+	p_hl->attr = attr;
+}
+
+// Run the highlighter over the line and print the cells whose attribute has changed
+static inline void hl_refresh(struct emrl_res *p_this)
+{
+	struct emrl_highlight *p_hl = hl_active(p_this);
+	if(NULL == p_hl || !p_hl->dirty || MACHINE())
+		return;
+
+	p_hl->dirty = false;
+
+	const char *p_line = hl_displayed(p_this);
+	if(NULL != p_line)
+		hl_update(p_this, p_line, p_this->cursor);
+}
+
+// Text from start to the end of the line has been appended but not printed, with the terminal
+// cursor at start. Print it with its attributes rather than plain and then again for any that
+// are highlighted. Returns false if it should be printed plain.
+static inline bool hl_append(struct emrl_res *p_this, size_t start)
+{
+	struct emrl_highlight *p_hl = hl_active(p_this);
+	if(NULL == p_hl || MACHINE())
+		return false;
+
+	(void)memset(p_hl->p_shown + start, HL_UNKNOWN, p_this->cmd_free - start);
+	p_hl->dirty = false;
+	hl_update(p_this, p_this->cmd_buf, start);
+
+	return true;
+}
+
+// Bring the line up to date from the terminal cursor at pos, then return the cursor to its place
+static inline void hl_update(struct emrl_res *p_this, const char *p_line, size_t pos)
+{
+	hl_move(p_this, hl_paint(p_this, p_line, pos), p_this->cursor);
+
+	// Leave the terminal set for the character before the cursor, text typed next usually has the
+	// same attribute so won't need printing again
+	hl_set_attr(p_this, (0 != p_this->cursor) ? p_this->p_hl->p_shown[p_this->cursor - 1] : 0);
+}
+
+// Print the whole line with its attributes from the start of the line, leaving the cursor at the
+// end. Returns false if the line should be printed plain.
+static inline bool hl_print_line(struct emrl_res *p_this)
+{
+	struct emrl_highlight *p_hl = hl_active(p_this);
+	if(NULL == p_hl)
+		return false;
+
+	const char *p_line = hl_displayed(p_this);
+	if(NULL == p_line)
+		return false;
+
+	(void)memset(p_hl->p_shown, HL_UNKNOWN, p_this->cmd_free);
+	(void)hl_paint(p_this, p_line, 0);
+	p_hl->dirty = false;
+
+	return true;
+}
+
+// Text of the displayed line, NULL for a history entry that wraps around the end of the history
+// buffer, which is left plain until it is edited
+static inline const char *hl_displayed(struct emrl_res *p_this)
+{
+#ifdef USE_HISTORY
+	const struct emrl_history *ph = &p_this->history;
+	if(0 != ph->current)
+		return ((size_t)ph->current + p_this->cmd_free < ph->last) ? ph->buf + ph->current : NULL;
+#endif
+
+	return p_this->cmd_buf;
+}
+
+// Print the cells whose attribute differs from the highlighter's, starting with the terminal
+// cursor at pos. Runs of cells with the same new attribute are printed together, including any
+// cells in between that were already right, since that is no more output than moving past them.
+// Returns the final cursor position.
+static inline size_t hl_paint(struct emrl_res *p_this, const char *p_line, size_t pos)
+{
+	struct emrl_highlight *p_hl = p_this->p_hl;
+	size_t len = p_this->cmd_free;
+
+	const struct emrl_span *p_span = p_hl->p_spans;
+	const struct emrl_span *p_spans_end = p_span + p_hl->func(p_hl->p_ctx, p_line, len, p_hl->p_spans,
+	                                                          p_hl->max_spans);
+	uint8_t *p_shown = p_hl->p_shown;
+	size_t cell = 0;
+	while(cell < len)
+	{
+		// Attribute wanted for this cell and the cells following it that share the same span
+		while(p_span < p_spans_end && (size_t)p_span->start + p_span->len <= cell)
+			++p_span;
+
+		size_t run_end;
+		uint8_t want;
+		if(p_span < p_spans_end && p_span->start <= cell)
+		{
+			want = p_span->attr;
+			run_end = p_span->start + p_span->len;
+		}
+		else
+		{
+			want = 0;
+			run_end = (p_span < p_spans_end) ? p_span->start : len;
+		}
+
+		if(run_end > len)
+			run_end = len;
+
+		// Trim cells at each end that already have the attribute
+		while(cell < run_end && p_shown[cell] == want)
+			++cell;
+
+		size_t print_end = run_end;
+		while(print_end > cell && p_shown[print_end - 1] == want)
+			--print_end;
+
+		if(cell < print_end)
+		{
+			hl_move(p_this, pos, cell);
+			hl_set_attr(p_this, want);
+			print_cells(p_this, p_line + cell, print_end - cell);
+			wrap_fixup(p_this, print_end);
+			(void)memset(p_shown + cell, want, print_end - cell);
+			pos = print_end;
+		}
+
+		cell = run_end;
+	}
+
+	return pos;
+}
+
+// Like move_cursor(), but never moves forward by printing cells since their attributes may be wrong
+static inline void hl_move(struct emrl_res *p_this, size_t from, size_t to)
+{
+	if(to > from && !on_other_row(p_this, from, to))
+	{
+		char out_buf[24];
+		(void)snprintf(out_buf, sizeof out_buf, "\033[%zuC", to - from);
+		PRINT(out_buf);
+	}
+	else
+	{
+		move_cursor(p_this, from, to);
+	}
+}
+#endif
+
+#ifdef USE_ESCAPE_INPUT
+static inline void process_escape_state(struct emrl_res *p_this, char chr)
+{
+	if(emrl_esc_da == p_this->esc_state)
+	{
+		process_da_state(p_this, chr);
+		return;
+	}
+
+	// Overflow check not needed in emrl_esc_new (always first character)
+	// or emrl_esc_ss3 (always second character)
+	p_this->esc_buf[p_this->esc_len++] = chr;
+
+	if(emrl_esc_new == p_this->esc_state)
+	{
+		switch(chr)
+		{
+			case '[':
+				p_this->esc_state = emrl_esc_csi;
+				break;
+
+			case 'O':
+				p_this->esc_state = emrl_esc_ss3;
+				break;
+
+			default:
+				reset_esc(p_this, false);
+				break;
+		}
+	}
+	else if(emrl_esc_ss3 == p_this->esc_state)
+	{
+		reset_esc(p_this, false);
+	}
+	else if(emrl_esc_csi == p_this->esc_state)
+	{
+		// A private parameter starts a Device Attributes reply, which may not fit in esc_buf
+		if(2 == p_this->esc_len && '?' == chr && p_this->da_pending)
+		{
+			p_this->esc_state = emrl_esc_da;
+			p_this->da_level = 0;
+		}
+		// Check for a 'final byte'
+		else if(chr >= 0x40 && chr <= 0x7e)
+		{
+			interpret_csi_escape(p_this);
+		}
+		else if(p_this->esc_len == sizeof p_this->esc_buf - 1)
+		{
+			reset_esc(p_this, false);
+		}
+	}
+}
+
+// Only the first parameter of the reply is kept, which gives the terminal's class. esc_len stays at
+// 2 while it is read and the rest of the reply is skipped up to the final byte.
+static inline void process_da_state(struct emrl_res *p_this, char chr)
+{
+	if(chr >= '0' && chr <= '9')
+	{
+		if(2 == p_this->esc_len)
+		{
+			unsigned level = p_this->da_level * 10u + (chr - '0');
+			p_this->da_level = (level > UINT8_MAX) ? UINT8_MAX : level;
+		}
+	}
+	else if(chr >= 0x40 && chr <= 0x7e)
+	{
+		if('c' == chr)
+		{
+			// 62 onwards is VT220 class and later, which has ICH, the VT102 (6) only has DCH
+			p_this->da_pending = false;
+			HL_DEFAULT();
+			if(p_this->da_level >= 62)
+				p_this->caps = EMRL_TERM_XTERM;
+			else if(6 == p_this->da_level)
+				p_this->caps = EMRL_TERM_VT100 | EMRL_CAP_DELETE;
+			else
+				p_this->caps = EMRL_TERM_VT100;
+		}
+
+		p_this->esc_buf[p_this->esc_len - 1] = chr;
+		reset_esc(p_this, true);
+	}
+	else
+	{
+		p_this->esc_len = 3;
+	}
+}
+
+static inline void interpret_csi_escape(struct emrl_res *p_this)
+{
+	bool known = true;
+	size_t len = p_this->esc_len;
+	if(2 == len)
+	{
+		switch(p_this->esc_buf[1])
+		{
+			case 'A':
+				// Up
+#ifdef USE_HISTORY
+				hist_show_prev(p_this);
+#endif
+				break;
+
+			case 'B':
+				// Down
+#ifdef USE_HISTORY
+				hist_show_next(p_this);
+#endif
+				break;
+
+			case 'C':
+				// Right
+				if(p_this->cursor != p_this->cmd_free)
+				{
+					move_cursor(p_this, p_this->cursor, p_this->cursor + 1);
+					++p_this->cursor;
+				}
+#ifdef USE_SUGGEST
+				else
+				{
+					suggest_accept(p_this);
+				}
+#endif
+				break;
+
+			case 'D':
+				// Left
+				if(0 != p_this->cursor)
+				{
+					SG_HIDE();
+					--p_this->cursor;
+					move_cursor(p_this, p_this->cursor + 1, p_this->cursor);
+				}
+				break;
+
+			case 'F':
+				end_of_line(p_this);
+				break;
+
+			default:
+				known = false;
+				break;
+		}
+
+	}
+	else if(3 == len)
+	{
+		if(0 == memcmp(p_this->esc_buf+1, "3~", 2))
+			erase_forward(p_this);
+		else if(0 == memcmp(p_this->esc_buf+1, "4~", 2))
+			end_of_line(p_this);
+		else
+			known = false;
+	}
+	else
+	{
+		known = false;
+	}
+
+	reset_esc(p_this, known);
+}
+
+static inline void erase_forward(struct emrl_res *p_this)
+{
+	// Are we at the end if the line? If so, nothing to erase
+	if(p_this->cursor != p_this->cmd_free)
+	{
+		// No - remove character under cursor
+		deferred_history_copy(p_this);
+		char *p_cursor = p_this->cmd_buf + p_this->cursor;
+		size_t len = p_this->cmd_free - p_this->cursor;
+		(void)memmove(p_cursor, p_cursor+1, len);
+		--p_this->cmd_free;
+
+		// Cells freed at the end of the line may take the current background colour
+		HL_DEFAULT();
+		if(use_delete(p_this, len))
+		{
+			PRINT(SEQ_DELETE_FORWARD);
+			HL_DELETE(p_this->cursor);
+		}
+		else
+		{
+			reprint_from_cursor(p_this, rp_erase, len);
+			HL_PRINTED(p_this->cursor, p_this->cmd_free);
+		}
+	}
+}
+
+// End key, which takes in a suggestion once at the end of the line
+static inline void end_of_line(struct emrl_res *p_this)
+{
+	if(p_this->cursor != p_this->cmd_free)
+	{
+		move_cursor_to_end(p_this);
+		p_this->cursor = p_this->cmd_free;
+	}
+#ifdef USE_SUGGEST
+	else
+	{
+		suggest_accept(p_this);
+	}
+#endif
+}
+#endif
+
+static inline void move_cursor_to_end(struct emrl_res *p_this)
+{
+	move_cursor(p_this, p_this->cursor, p_this->cmd_free);
+}
+
+static inline void erase_back(struct emrl_res *p_this)
+{
+	// Are we at the start of the line? Don't erase the prompt!
+	if(0 != p_this->cursor)
+	{
+		deferred_history_copy(p_this);
+
+		// Are we at the end of the line?
+		if(p_this->cursor == p_this->cmd_free)
+		{
+#ifdef USE_SUGGEST
+			// A suggestion following the line is redrawn from the erased cell when input has been
+			// handled, unless it has to be erased from the row above
+			suggest_covered(p_this);
+			bool suggested = (0 != p_this->suggest.end);
+			if(suggested && on_other_row(p_this, p_this->cursor - 1, p_this->cursor))
+			{
+				SG_HIDE();
+				suggested = false;
+			}
+#endif
+
+			// Yes - simple erase sequence
+			--p_this->cursor;
+			--p_this->cmd_free;
+			HL_DEFAULT();
+			if(on_other_row(p_this, p_this->cursor, p_this->cursor + 1))
+			{
+				// Backspace doesn't go back past the start of a row
+				move_cursor(p_this, p_this->cursor + 1, p_this->cursor);
+				erase_to_end(p_this, p_this->cursor, 1);
+			}
+#ifdef USE_SUGGEST
+			else if(suggested)
+			{
+				PRINT(SEQ_STEP_LEFT);
+			}
+#endif
+			else
+			{
+				PRINT(SEQ_ERASE_BACK);
+			}
+			HL_DELETE(p_this->cursor);
+		}
+		else
+		{
+			// No - remove character before cursor and reprint
+			char *p_cursor = p_this->cmd_buf + p_this->cursor;
+			size_t len = p_this->cmd_free - p_this->cursor;
+			(void)memmove(p_cursor-1, p_cursor, len);
+			--p_this->cursor;
+			--p_this->cmd_free;
+
+			HL_DEFAULT();
+			move_cursor(p_this, p_this->cursor + 1, p_this->cursor);
+			if(use_delete(p_this, len+1))
+			{
+				PRINT(SEQ_DELETE_FORWARD);
+				HL_DELETE(p_this->cursor);
+			}
+			else
+			{
+				reprint_from_cursor(p_this, rp_erase, len+1);
+				HL_PRINTED(p_this->cursor, p_this->cmd_free);
+			}
+		}
+		
+	}
+}
+
+static inline void add_string(struct emrl_res *p_this, const char *p_str)
+{
+	size_t add_len = strlen(p_str);
+
+	// Enough space in the command buffer?
+	if((size_t)(p_this->cmd_last - p_this->cmd_free) > add_len)
+	{
+		deferred_history_copy(p_this);
+
+		// Are we at the end of the line?
+		if(p_this->cursor == p_this->cmd_free)
+		{
+			// Yes - simple append
+			(void)memcpy(p_this->cmd_buf + p_this->cmd_free, p_str, add_len);
+			p_this->cmd_free += add_len;
+			p_this->cursor += add_len;
+#ifdef USE_HIGHLIGHT
+			if(hl_append(p_this, p_this->cursor - add_len))
+				return;
+#endif
+			PRINT(p_str);
+			wrap_fixup(p_this, p_this->cursor);
+			HL_INSERT(p_this->cursor - add_len, add_len);
+			return;
+		}
+		else
+		{
+			// No - insert
+			char *p_cursor = p_this->cmd_buf + p_this->cursor;
+			size_t to_end_len = p_this->cmd_free - p_this->cursor;
+			(void)memmove(p_cursor+add_len, p_cursor, to_end_len);
+			(void)memcpy(p_cursor, p_str, add_len);
+			p_this->cmd_free += add_len;
+			if(!use_insert(p_this, add_len, to_end_len))
+			{
+				reprint_from_cursor(p_this, rp_insert, to_end_len);
+				HL_PRINTED(p_this->cursor, p_this->cmd_free);
+			}
+			else if(1 == add_len)
+			{
+				// Usually we will just insert characters as the user types
+				// Optimise this a little and save on print calls, which may be cumbersome
+				char buf[sizeof SEQ_INSERT_SPACE + 1];
+				(void)memcpy(buf, SEQ_INSERT_SPACE, sizeof SEQ_INSERT_SPACE - 1);
+				buf[sizeof SEQ_INSERT_SPACE - 1] = *p_str;
+				buf[sizeof SEQ_INSERT_SPACE] = '\0';
+				PRINT(buf);
+				HL_INSERT(p_this->cursor, add_len);
+			}
+			else
+			{
+				// Only actually happens if we are printing unknown keys or escape sequences
+				char buf[24];
+				(void)snprintf(buf, sizeof buf, "\033[%zu@", add_len);
+				PRINT(buf);
+				PRINT(p_str);
+				HL_INSERT(p_this->cursor, add_len);
+			}
+		}
+
+		p_this->cursor += add_len;	// Update internal cursor
+	}
+}
+
+// Number of bytes at the start of p_str that can bypass process_char(). That's only possible
+// when appending to the line with no escape sequence or delimiter match in progress.
+static inline size_t fast_path_len(struct emrl_res *p_this, const char *p_str, size_t len)
+{
+#ifdef USE_ESCAPE_INPUT
+	if(emrl_esc_none != p_this->esc_state)
+		return 0;
+#endif
+
+	if(0 != p_this->delim_pos || p_this->cursor != p_this->cmd_free)
+		return 0;
+
+	// Same limit as add_string()
+	size_t space = p_this->cmd_last - p_this->cmd_free;
+	if(space <= 1)
+		return 0;
+
+	if(len > space - 1)
+		len = space - 1;
+
+	return printable_run(p_str, len, *p_this->delim);
+}
+
+// Length of the run of printable ASCII characters, other than the first delimiter character, at
+// the start of p_str. Checked a word at a time until a word with an unwanted byte is found.
+static inline size_t printable_run(const char *p_str, size_t len, char delim)
+{
+	typedef unsigned long word;
+	const word ones = ~(word)0 / 255;
+	const word highs = ones * 0x80;
+	const word delims = ones * (unsigned char)delim;
+
+	size_t run_len = 0;
+	while(len - run_len >= sizeof(word))
+	{
+		word w;
+		(void)memcpy(&w, p_str + run_len, sizeof w);
+		word d = w ^ delims;
+
+		// High bit set in any byte < 0x20, > 0x7e or equal to the delimiter
+		word unwanted = ((w - ones * 0x20) & ~w) | (w + ones) | w | ((d - ones) & ~d);
+		if(0 != (unwanted & highs))
+			break;
+
+		run_len += sizeof w;
+	}
+
+	while(run_len < len)
+	{
+		unsigned char chr = p_str[run_len];
+		if(chr < 0x20 || chr > 0x7e || chr == (unsigned char)delim)
+			break;
+
+		++run_len;
+	}
+
+	return run_len;
+}
+
+static inline void append_run(struct emrl_res *p_this, const char *p_str, size_t len)
+{
+	TRACE(emrl_trace_char, *p_str, len);
+	deferred_history_copy(p_this);
+
+	(void)memcpy(p_this->cmd_buf + p_this->cmd_free, p_str, len);
+
+	// Space was checked in fast_path_len()
+	print_appended(p_this, len);
+}
+
+// Print len characters just copied to the end of the command buffer, with room to terminate them
+static inline void print_appended(struct emrl_res *p_this, size_t len)
+{
+	char *p_start = p_this->cmd_buf + p_this->cmd_free;
+	p_this->cursor = p_this->cmd_free += len;
+
+	// Terminate in place to print the run
+	p_start[len] = '\0';
+#ifdef USE_HIGHLIGHT
+	if(hl_append(p_this, p_this->cmd_free - len))
+		return;
+#endif
+	PRINT(p_start);
+	wrap_fixup(p_this, p_this->cmd_free);
+	HL_INSERT(p_this->cmd_free - len, len);
+}
+
+#ifdef USE_MACHINE_MODE
+// Length of the data at the start of p_str that can't be part of a delimiter, in machine mode
+static inline size_t machine_run_len(struct emrl_res *p_this, const char *p_str, size_t len)
+{
+	// Part way through matching the delimiter, continue a character at a time
+	if(0 != p_this->delim_pos)
+		return 0;
+
+	const char *p_delim = memchr(p_str, *p_this->delim, len);
+	return (NULL == p_delim) ? len : (size_t)(p_delim - p_str);
+}
+
+// Add line data in machine mode, returns the number of bytes that fitted
+static inline size_t machine_append(struct emrl_res *p_this, const char *p_str, size_t len)
+{
+	size_t space = p_this->cmd_last - p_this->cmd_free;
+	if(len > space)
+		len = space;
+
+	(void)memcpy(p_this->cmd_buf + p_this->cmd_free, p_str, len);
+	p_this->cursor = p_this->cmd_free += len;
+	return len;
+}
+
+// Unlike interactive mode, characters that partly match the delimiter are held back, then added to
+// the line if the match fails
+static inline char *machine_char(struct emrl_res *p_this, char chr)
+{
+#ifdef USE_LINE_QUEUE
+	// A chunk refused by a full queue is taken before anything more is added, or the character is
+	// held back
+	if(NULL != p_this->lines.buf && STREAM_DUE() && NULL == STREAM_FULL())
+	{
+		p_this->lines.held = true;
+		return NULL;
+	}
+#endif
+
+	if(chr == p_this->delim[p_this->delim_pos])
+	{
+		if('\0' != p_this->delim[++p_this->delim_pos])
+			return NULL;
+
+		return line_complete(p_this);
+	}
+
+	if(0 != p_this->delim_pos)
+	{
+		(void)machine_append(p_this, p_this->delim, p_this->delim_pos);
+		p_this->delim_pos = 0;
+
+		// May start a new match
+		char *p_command = machine_char(p_this, chr);
+		return (NULL != p_command) ? p_command : STREAM_FULL();
+	}
+
+	(void)machine_append(p_this, &chr, 1);
+	return STREAM_FULL();
+}
+#endif
+
+// Start a new, empty line
+static inline void reset_line(struct emrl_res *p_this)
+{
+	p_this->delim_pos = 0;
+	p_this->cursor = p_this->cmd_free = 0;
+}
+
+// Terminate and return the line, or its last piece if earlier pieces were returned as chunks
+static inline char *line_complete(struct emrl_res *p_this)
+{
+	p_this->cmd_buf[p_this->cmd_free] = '\0';
+	enum emrl_part part = STREAMED() ? emrl_part_last : emrl_part_whole;
+
+#ifdef USE_LINE_QUEUE
+	if(NULL != p_this->lines.buf && !queue_line(p_this, part))
+	{
+		// Keep the line until there's room. In machine mode the delimiter match is kept for the
+		// last character to be passed in again.
+		if(MACHINE())
+		{
+			p_this->delim_pos = strlen(p_this->delim) - 1;
+			p_this->lines.held = true;
+		}
+		else
+		{
+			p_this->delim_pos = 0;
+			PRINT("\a");
+		}
+		return NULL;
+	}
+#endif
 
+	TRACE(emrl_trace_line, '\0', p_this->cmd_free);
+
+#ifdef USE_STREAMING
+	p_this->line_part = part;
+	p_this->streamed = false;
+#else
+	(void)part;
+#endif
+	reset_line(p_this);
+
+#ifdef USE_LINE_QUEUE
+	// The application takes the line later, carry on editing a new one below it
+	if(NULL != p_this->lines.buf && !MACHINE())
+	{
+		PRINT("\r\n");
+		PRINT(p_this->prompt);
+		wrap_fixup(p_this, 0);
 	}
-	else if(3 == len)
+#endif
+
+	return p_this->cmd_buf;
+}
+
+#ifdef USE_STREAMING
+// When streaming, return the command buffer as a chunk once it is nearly full. Any partial
+// delimiter match carries on into the next chunk.
+static inline char *stream_full(struct emrl_res *p_this)
+{
+	if(!stream_due(p_this))
+		return NULL;
+
+	// A recalled history entry is displayed but not yet in the command buffer
+	deferred_history_copy(p_this);
+
+	// The chunk stays on the display, give it its final colours
+	HL_REFRESH();
+	HL_DEFAULT();
+
+	p_this->cmd_buf[p_this->cmd_free] = '\0';
+	enum emrl_part part = p_this->streamed ? emrl_part_middle : emrl_part_first;
+#ifdef USE_LINE_QUEUE
+	if(NULL != p_this->lines.buf && !queue_line(p_this, part))
+		return NULL;
+#endif
+
+	TRACE(emrl_trace_line, '\0', p_this->cmd_free);
+	SG_HIDE();
+
+	p_this->line_part = part;
+	p_this->streamed = true;
+	p_this->cursor = p_this->cmd_free = 0;
+
+	return p_this->cmd_buf;
+}
+
+// Take the chunk while there's still space for whatever the next character could add. In machine
+// mode that's a held back partial delimiter plus the character that broke the match. In
+// interactive mode add_string() keeps one byte spare, and a character may take up to four bytes in
+// caret notation.
+static inline bool stream_due(const struct emrl_res *p_this)
+{
+	if(!p_this->streaming || 0 == p_this->cmd_free || p_this->cursor != p_this->cmd_free)
+		return false;
+
+	size_t spare = MACHINE() ? strlen(p_this->delim) - 1 : MAX_PRINTABLE_LEN;
+	return (size_t)(p_this->cmd_last - p_this->cmd_free) <= spare;
+}
+#endif
+
+#ifdef USE_LINE_QUEUE
+// Copy the terminated line or chunk to the line queue, returns false if there isn't room
+static inline bool queue_line(struct emrl_res *p_this, enum emrl_part part)
+{
+	struct emrl_line_queue *pq = &p_this->lines;
+	size_t need = (size_t)p_this->cmd_free + 2;
+
+	if(0 != pq->wrap)
 	{
-		if(0 == memcmp(p_this->esc_buf+1, "3~", 2))
-			erase_forward(p_this);
+		if(pq->get - pq->put < need)
+			return false;
+	}
+	else if(pq->size - pq->put < need)
+	{
+		// Lines are kept contiguous, leave the end of the buffer unused and carry on from the start
+		if(pq->get < need)
+			return false;
+
+		pq->wrap = pq->put;
+		pq->put = 0;
+	}
+
+	pq->buf[pq->put] = (char)part;
+	(void)memcpy(pq->buf + pq->put + 1, p_this->cmd_buf, need - 1);
+	pq->put += need;
+	++pq->count;
+
+	return true;
+}
+#endif
+
+// Insert with ICH if the terminal has it and it is no longer than reprinting the to_end_len cells
+// after the inserted text and moving back over them. The inserted text is printed either way.
+// Cells only shift along the cursor's row, so the line must end on that row.
+static inline bool use_insert(struct emrl_res *p_this, size_t add_len, size_t to_end_len)
+{
+	size_t seq_len = (1 == add_len) ? sizeof SEQ_INSERT_SPACE - 1 : csi_len(add_len);
+	return (p_this->caps & EMRL_CAP_INSERT) && seq_len <= to_end_len + move_back_len(p_this, to_end_len) &&
+	       !on_other_row(p_this, p_this->cursor, p_this->cmd_free - 1);
+}
+
+// Delete with DCH if the terminal has it and it is no longer than reprinting the len cells from
+// the cursor, including the blank over the erased character, and moving back over them. As for
+// insertion the line must end on the cursor's row.
+static inline bool use_delete(struct emrl_res *p_this, size_t len)
+{
+	return (p_this->caps & EMRL_CAP_DELETE) && sizeof SEQ_DELETE_FORWARD - 1 <= len + move_back_len(p_this, len) &&
+	       !on_other_row(p_this, p_this->cursor, p_this->cmd_free);
+}
+
+static inline void reprint_from_cursor(struct emrl_res *p_this, enum rp_type type, size_t back_mv)
+{
+	// Ensure buffer is null terminated before printing
+	p_this->cmd_buf[p_this->cmd_free] = '\0';
+	PRINT(p_this->cmd_buf + p_this->cursor);
+
+	// Append a space to cover the erased character
+	if(rp_erase == type)
+		PRINT(" ");
+
+	size_t end = p_this->cmd_free + (rp_erase == type);
+	wrap_fixup(p_this, end);
+	move_cursor(p_this, end, end - back_mv);
+}
+
+#ifdef USE_ESCAPE_INPUT
+static inline void reset_esc(struct emrl_res *p_this, bool known)
+{
+	TRACE(emrl_trace_escape, p_this->esc_buf[p_this->esc_len - 1], known);
+
+	if(!known)
+	{
+		// Space for "^[" (ESC in caret notation),
+		// plus 4 bytes for each  member of esc_buf ("M-[x" possible for each)
+		// plus null terminator
+		char str_buf[4 * (sizeof p_this->esc_buf) + 3];
+		char *p_str = str_buf + 2;
+		size_t esc_pos = 0;
+
+		// ESC character not in escape buffer, add manually
+		str_buf[0] = '^';
+		str_buf[1] = '[';
+
+		do
+		{
+			p_str += char_to_printable(p_this->esc_buf[esc_pos++], p_str);
+		}
+		while(esc_pos < p_this->esc_len);
+
+		add_string(p_this, str_buf);
+	}
+
+	p_this->esc_len = 0;
+	p_this->esc_state = emrl_esc_none;
+}
+
+// Returns false, dropping the pending escape sequence, if the byte just received is past the
+// escape timeout
+static inline bool esc_continues(struct emrl_res *p_this)
+{
+	if(NULL == p_this->esc_now)
+		return true;
+
+	emrl_cycles now = p_this->esc_now();
+	if((emrl_cycles)(now - p_this->esc_time) <= p_this->esc_gap)
+	{
+		p_this->esc_time = now;
+		return true;
+	}
+
+	TRACE(emrl_trace_escape, '\0', 0);
+	p_this->esc_len = 0;
+	p_this->esc_state = emrl_esc_none;
+	return false;
+}
+
+static inline void esc_stamp(struct emrl_res *p_this)
+{
+	if(NULL != p_this->esc_now && emrl_esc_none != p_this->esc_state)
+		p_this->esc_time = p_this->esc_now();
+}
+#endif
+
+#ifdef USE_SAVE_STATE
+static inline void state_put(struct state_out *p_out, const void *p_data, size_t len)
+{
+	// Keep counting once out of space, for the size needed
+	if(p_out->len <= p_out->size && len <= p_out->size - p_out->len)
+		(void)memcpy(p_out->p_buf + p_out->len, p_data, len);
+
+	p_out->len += len;
+}
+
+// Seven bits per byte, least significant first, with the top bit set on all but the last
+static inline void state_put_uint(struct state_out *p_out, size_t value)
+{
+	uint8_t bytes[(sizeof value * 8 + 6) / 7];
+	size_t len = 0;
+	do
+	{
+		bytes[len] = value & 0x7f;
+		value >>= 7;
+		if(0 != value)
+			bytes[len] |= 0x80;
+
+		++len;
+	}
+	while(0 != value);
+
+	state_put(p_out, bytes, len);
+}
+
+#ifdef USE_HISTORY
+// Entries are written with their terminator, joining the parts of one that wraps
+static inline void state_put_entry(struct state_out *p_out, const struct emrl_history *ph, emrl_hist_idx entry)
+{
+	const char *p_entry = ph->buf + entry;
+	size_t len = strlen(p_entry);
+	if(entry + len == ph->last)
+	{
+		state_put(p_out, p_entry, len);
+		p_entry = ph->buf + 1;
+		len = strlen(p_entry);
+	}
+
+	state_put(p_out, p_entry, len + 1);
+}
+#endif
+
+static inline size_t state_get_uint(struct state_in *p_in)
+{
+	size_t value = 0;
+	for(unsigned shift = 0; p_in->p_pos < p_in->p_end && shift < sizeof value * 8; shift += 7)
+	{
+		uint8_t byte = *p_in->p_pos++;
+		value |= (size_t)(byte & 0x7f) << shift;
+		if(0 == (byte & 0x80))
+			return value;
+	}
+
+	p_in->error = true;
+	return 0;
+}
+
+static inline const char *state_get_bytes(struct state_in *p_in, size_t len)
+{
+	if(len > (size_t)(p_in->p_end - p_in->p_pos))
+	{
+		p_in->error = true;
+		return NULL;
+	}
+
+	const char *p_bytes = (const char *)p_in->p_pos;
+	p_in->p_pos += len;
+	return p_bytes;
+}
+
+// Null terminated string of at most max_len characters, NULL if there isn't one
+static inline const char *state_get_string(struct state_in *p_in, size_t max_len)
+{
+	size_t avail = p_in->p_end - p_in->p_pos;
+	const uint8_t *p_term = memchr(p_in->p_pos, '\0', (avail < max_len + 1) ? avail : max_len + 1);
+	if(NULL == p_term)
+	{
+		p_in->error = true;
+		return NULL;
+	}
+
+	return state_get_bytes(p_in, p_term - p_in->p_pos + 1);
+}
+
+// Only the escape sequence states that input can leave are accepted. Any other would have the
+// next input byte written outside esc_buf.
+static inline bool state_esc_valid(size_t esc_state, const char *p_esc, size_t esc_len)
+{
+	switch(esc_state)
+	{
+		case emrl_esc_none:
+		case emrl_esc_new:
+			return 0 == esc_len;
+
+		case emrl_esc_ss3:
+			return 1 == esc_len && 'O' == p_esc[0];
+
+		case emrl_esc_csi:
+			// Reset once it reaches one byte short of the size of esc_buf
+			return esc_len >= 1 && esc_len <= 4 && '[' == p_esc[0];
+
+		case emrl_esc_da:
+			return (2 == esc_len || 3 == esc_len) && '[' == p_esc[0] && '?' == p_esc[1];
+
+		default:
+			return false;
+	}
+}
+#endif
+
+#ifdef USE_HISTORY
+static inline emrl_hist_idx hist_search_forward(const struct emrl_res *p_this, emrl_hist_idx entry)
+{
+	const struct emrl_history *ph = &p_this->history;
+	const char *p_buf_last = ph->buf + ph->last;
+
+	assert(entry > 0);
+	assert(entry <= ph->last);		// May be equal when updating oldest
+
+	const char *p_entry = strchr(ph->buf + entry, '\0');
+
+	// Hit end of buffer? Keep searching from start
+	if(p_entry == p_buf_last)
+		p_entry = strchr(ph->buf+1, '\0');
+
+	++p_entry;						// Skip past string terminator
+
+	// Did previous entry go right to the end of the buffer, wrap if so
+	if(p_entry == p_buf_last)
+		p_entry = ph->buf + 1;
+
+	// Skip the use count
+	if(ph->retain && ++p_entry == p_buf_last)
+		p_entry = ph->buf + 1;
+
+	return p_entry - ph->buf;
+}
+
+static inline emrl_hist_idx hist_search_backward(const struct emrl_res *p_this, emrl_hist_idx entry)
+{
+	const struct emrl_history *ph = &p_this->history;
+	const char *p_buf_last = ph->buf + ph->last;
+
+	assert(entry > 0);
+	assert(entry < ph->last);
+
+	// Go back past the use count and the null of the previous entry
+	size_t pos = hist_prev(ph, entry);
+	if(ph->retain)
+		pos = hist_prev(ph, pos);
+
+	const char *p_entry = ph->buf + hist_prev(ph, pos);
+	while('\0' != *p_entry)
+		--p_entry;
+
+	// Hit start of buffer? Keep searching from end
+	if(p_entry == ph->buf)
+	{
+		p_entry = p_buf_last - 1;
+		while('\0' != *p_entry)
+			--p_entry;
+	}
+
+	// Entry starts after the null and its use count
+	emrl_hist_idx start = hist_next(ph, p_entry - ph->buf);
+	return ph->retain ? hist_next(ph, start) : start;
+}
+
+static inline void hist_show_prev(struct emrl_res *p_this)
+{
+	struct emrl_history *ph = &p_this->history;
+
+	if(0 != ph->newest && ph->current != ph->oldest)
+	{
+		if(0 == ph->current)
+		{
+			ph->current = ph->newest;
+			ph->cmd_free_bak = p_this->cmd_free;
+		}
+		else
+		{
+			ph->current = hist_search_backward(p_this, ph->current);
+		}
+
+		TRACE(emrl_trace_history, 'A', ph->current);
+		hist_show_current(p_this);
+	}
+}
+
+static inline void hist_show_next(struct emrl_res *p_this)
+{
+	struct emrl_history *ph = &p_this->history;
+
+	// Is history search active?
+	if(0 != ph->current)
+	{
+		// Are we already at the newest entry?
+		if(ph->current == ph->newest)
+		{
+			// Yes, drop out of history search and display original command
+			ph->current = 0;
+			TRACE(emrl_trace_history, 'B', 0);
+
+			clear_from_prompt(p_this);
+			p_this->cursor = p_this->cmd_free = ph->cmd_free_bak;
+			print_line(p_this);
+		}
+		else
+		{
+			// No, show next newest entry
+			ph->current = hist_search_forward(p_this, ph->current);
+			TRACE(emrl_trace_history, 'B', ph->current);
+			hist_show_current(p_this);
+		}
+	}
+}
+
+static inline void hist_show_current(struct emrl_res *p_this)
+{
+	const struct emrl_history *ph = &p_this->history;
+
+	assert(0 != ph->current);
+
+	clear_from_prompt(p_this);
+
+	// Set cmd_free so that arrow movement behaves like cmd_buf contains the history entry,
+	// but don't overwrite anything until the user edits or presses return
+	p_this->cursor = p_this->cmd_free = hist_entry_len(ph, ph->current);
+	print_line(p_this);
+}
+
+static inline size_t hist_entry_len(const struct emrl_history *ph, emrl_hist_idx entry)
+{
+	size_t len = strlen(ph->buf + entry);
+	if(entry + len == ph->last)
+		len += strlen(ph->buf + 1);
+
+	return len;
+}
+
+// Print characters start to end of an entry, which may wrap around the end of the buffer
+static inline void print_entry(struct emrl_res *p_this, emrl_hist_idx entry, size_t start, size_t end)
+{
+	const struct emrl_history *ph = &p_this->history;
+	size_t to_wrap = ph->last - entry;
+	if(start < to_wrap)
+	{
+		size_t len = ((end < to_wrap) ? end : to_wrap) - start;
+		print_cells(p_this, ph->buf + entry + start, len);
+		start += len;
+	}
+
+	if(start < end)
+		print_cells(p_this, ph->buf + 1 + start - to_wrap, end - start);
+}
+#endif
+
+#ifdef USE_SUGGEST
+static inline char hist_entry_char(const struct emrl_history *ph, emrl_hist_idx entry, size_t pos)
+{
+	pos += entry;
+	if(pos >= ph->last)
+		pos -= ph->last - 1;
+
+	return ph->buf[pos];
+}
+
+// Compare the first len characters of an entry with p_str, an entry shorter than len sorts first
+static inline int hist_entry_compare(const struct emrl_history *ph, emrl_hist_idx entry, const char *p_str, size_t len)
+{
+	for(size_t pos = 0; pos < len; ++pos)
+	{
+		unsigned char chr = hist_entry_char(ph, entry, pos);
+		unsigned char str_chr = p_str[pos];
+		if(chr != str_chr)
+			return (chr < str_chr) ? -1 : 1;
+	}
+
+	return 0;
+}
+
+static inline int hist_entries_compare(const struct emrl_history *ph, emrl_hist_idx entry_a, emrl_hist_idx entry_b)
+{
+	for(size_t pos = 0; ; ++pos)
+	{
+		unsigned char chr_a = hist_entry_char(ph, entry_a, pos);
+		unsigned char chr_b = hist_entry_char(ph, entry_b, pos);
+		if(chr_a != chr_b)
+			return (chr_a < chr_b) ? -1 : 1;
+
+		if('\0' == chr_a)
+			return 0;
+	}
+}
+
+// Distance of an entry from the oldest, so more recent entries are further
+static inline size_t hist_age(const struct emrl_history *ph, emrl_hist_idx entry)
+{
+	return (entry >= ph->oldest) ? (size_t)(entry - ph->oldest) : (size_t)entry + ph->last - 1 - ph->oldest;
+}
+
+// Index an entry just written to the history, in place of an older entry with the same text
+static inline void suggest_index_add(struct emrl_res *p_this, emrl_hist_idx entry)
+{
+	struct emrl_suggest *sg = &p_this->suggest;
+	const struct emrl_history *ph = &p_this->history;
+	if(NULL == sg->p_index || '\0' == ph->buf[entry])
+		return;
+
+	// The entry may start with the line the match was found for
+	sg->match = 0;
+
+	emrl_hist_idx *p_index = sg->p_index;
+	size_t lo = 0;
+	size_t hi = sg->count;
+	while(lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if(hist_entries_compare(ph, p_index[mid], entry) < 0)
+			lo = mid + 1;
 		else
-			known = false;
+			hi = mid;
 	}
-	else
+
+	if(lo < sg->count && 0 == hist_entries_compare(ph, p_index[lo], entry))
 	{
-		known = false;
+		suggest_moved(p_this, p_index[lo], entry);
+		p_index[lo] = entry;
+		return;
 	}
 
-	reset_esc(p_this, known);
-}
-
-static inline void erase_forward(struct emrl_res *p_this)
-{
-	// Are we at the end if the line? If so, nothing to erase
-	if(p_this->p_cursor != p_this->p_cmd_free)
+	// Full, the least recent entry goes unsuggested
+	if(sg->count == sg->size)
 	{
-		// No - remove character under cursor
-		deferred_history_copy(p_this);
-		size_t len = p_this->p_cmd_free - p_this->p_cursor;
-		(void)memmove(p_this->p_cursor, p_this->p_cursor+1, len);
-		--p_this->p_cmd_free;
-#ifdef USE_DELETE_ESCAPE_SEQUENCE
-		PRINT(SEQ_DELETE_FORWARD);
-#else
-		reprint_from_cursor(p_this, rp_erase, len);
-#endif
+		size_t least = 0;
+		for(size_t i = 1; i < sg->count; ++i)
+		{
+			if(hist_age(ph, p_index[i]) < hist_age(ph, p_index[least]))
+				least = i;
+		}
+
+		suggest_moved(p_this, p_index[least], 0);
+		(void)memmove(p_index + least, p_index + least + 1, (sg->count - least - 1) * sizeof *p_index);
+		--sg->count;
+		if(least < lo)
+			--lo;
 	}
+
+	(void)memmove(p_index + lo + 1, p_index + lo, (sg->count - lo) * sizeof *p_index);
+	p_index[lo] = entry;
+	++sg->count;
 }
 
-static inline void move_cursor_to_end(struct emrl_res *p_this)
+// Take an entry leaving the history out of the index
+static inline void suggest_index_drop(struct emrl_res *p_this, emrl_hist_idx entry)
 {
-	ptrdiff_t to_end_len = p_this->p_cmd_free - p_this->p_cursor;
-	if(to_end_len > 0)
+	struct emrl_suggest *sg = &p_this->suggest;
+	for(size_t i = 0; i < sg->count; ++i)
 	{
-		char out_buf[16];
-		(void)snprintf(out_buf, sizeof out_buf, "\033[%tdC", to_end_len);
-		PRINT(out_buf);
+		if(sg->p_index[i] == entry)
+		{
+			(void)memmove(sg->p_index + i, sg->p_index + i + 1, (sg->count - i - 1) * sizeof *sg->p_index);
+			--sg->count;
+			break;
+		}
 	}
+
+	suggest_moved(p_this, entry, 0);
 }
 
-static inline void erase_back(struct emrl_res *p_this)
+// Without retention, take the entries that writing len bytes at put will overwrite out of the index
+// while their text is still there to find them by
+static inline void suggest_drop_overwritten(struct emrl_res *p_this, size_t len)
 {
-	// Are we at the start of the line? Don't erase the prompt!
-	if(p_this->p_cursor != p_this->cmd_buf)
+	const struct emrl_history *ph = &p_this->history;
+	if(NULL == p_this->suggest.p_index || 0 == ph->oldest)
+		return;
+
+	size_t ring_len = ph->last - 1;
+	emrl_hist_idx entry = ph->oldest;
+	for(;;)
 	{
-		deferred_history_copy(p_this);
+		ptrdiff_t dist = (ptrdiff_t)entry - ph->put;
+		if(dist < 0)
+			dist += ring_len;
 
-		// Are we at the end of the line?
-		if(p_this->p_cursor == p_this->p_cmd_free)
-		{
-			// Yes - simple erase sequence
-			--p_this->p_cursor;
-			--p_this->p_cmd_free;
-			PRINT(SEQ_DELETE_BACK);
-		}
-		else
-		{
-			// No - remove character before cursor and reprint
-			size_t len = p_this->p_cmd_free - p_this->p_cursor;
-			(void)memmove(p_this->p_cursor-1, p_this->p_cursor, len);
-			--p_this->p_cursor;
-			--p_this->p_cmd_free;
+		if((size_t)dist >= len)
+			return;
 
-#ifdef USE_DELETE_ESCAPE_SEQUENCE
-			PRINT(SEQ_DELETE_BACK);
-#else
-			PRINT(SEQ_STEP_LEFT);
-			reprint_from_cursor(p_this, rp_erase, len+1);
-#endif
-		}
-		
+		suggest_index_drop(p_this, entry);
+		if(entry == ph->newest)
+			return;
+
+		entry = hist_search_forward(p_this, entry);
 	}
 }
 
-static inline void add_string(struct emrl_res *p_this, const char *p_str)
+// The entry at from now starts at to, or has gone if to is 0
+static inline void suggest_moved(struct emrl_res *p_this, emrl_hist_idx from, emrl_hist_idx to)
 {
-	size_t add_len = strlen(p_str);
+	struct emrl_suggest *sg = &p_this->suggest;
+	if(sg->shown == from)
+		sg->shown = to;
 
-	// Enough space in the command buffer?
-	if((p_this->p_cmd_last - p_this->p_cmd_free) > (ptrdiff_t)add_len)
+	if(sg->match == from)
+		sg->match = to;
+}
+
+// Index position of the first entry whose first len characters don't sort before the line, or
+// after it
+static inline size_t suggest_bound(const struct emrl_res *p_this, size_t len, bool after)
+{
+	const struct emrl_suggest *sg = &p_this->suggest;
+	size_t lo = 0;
+	size_t hi = sg->count;
+	while(lo < hi)
 	{
-		deferred_history_copy(p_this);
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = hist_entry_compare(&p_this->history, sg->p_index[mid], p_this->cmd_buf, len);
+		if(cmp < 0 || (after && 0 == cmp))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-		// Are we at the end of the line?
-		if(p_this->p_cursor == p_this->p_cmd_free)
+	return lo;
+}
+
+// The newest entry that starts with the line and is longer, or 0 if there's none or the line isn't
+// being typed at its end
+static inline emrl_hist_idx suggest_find(struct emrl_res *p_this)
+{
+	struct emrl_suggest *sg = &p_this->suggest;
+	const struct emrl_history *ph = &p_this->history;
+	size_t len = p_this->cmd_free;
+	if(NULL == sg->p_index || 0 == len || p_this->cursor != len || 0 != ph->current ||
+	   MACHINE() || STREAMED() || !(p_this->caps & EMRL_CAP_SGR))
+		return 0;
+
+	// An entry starting with the line also starts with any shorter line it starts with, so the
+	// match found for a shorter line is still the newest if it starts with this one
+	if(0 != sg->match && len >= sg->match_len &&
+	   0 == hist_entry_compare(ph, sg->match, p_this->cmd_buf, len) &&
+	   '\0' != hist_entry_char(ph, sg->match, len))
+		return sg->match;
+
+	emrl_hist_idx match = 0;
+	size_t match_age = 0;
+	size_t stop = suggest_bound(p_this, len, true);
+	for(size_t i = suggest_bound(p_this, len, false); i < stop; ++i)
+	{
+		// Only the entry equal to the line has nothing to suggest
+		emrl_hist_idx entry = sg->p_index[i];
+		size_t age = hist_age(ph, entry);
+		if('\0' != hist_entry_char(ph, entry, len) && (0 == match || age > match_age))
 		{
-			// Yes - simple append
-			(void)memcpy(p_this->p_cmd_free, p_str, add_len);
-			p_this->p_cmd_free += add_len;
-			PRINT(p_str);
+			match = entry;
+			match_age = age;
 		}
-		else
-		{
-			// No - insert
-			size_t to_end_len = p_this->p_cmd_free - p_this->p_cursor;
-			(void)memmove(p_this->p_cursor+add_len, p_this->p_cursor, to_end_len);
-			(void)memcpy(p_this->p_cursor, p_str, add_len);
-			p_this->p_cmd_free += add_len;
-#ifdef USE_INSERT_ESCAPE_SEQUENCE
-			char buf[16];
-			if(1 == add_len)
-			{
-				// Usually we will just insert characters as the user types
-				// Optimise this a little and save on print calls, which may be cumbersome
-				(void)memcpy(buf, SEQ_INSERT_SPACE, sizeof SEQ_INSERT_SPACE - 1);
-				buf[sizeof SEQ_INSERT_SPACE - 1] = *p_str;
-				buf[sizeof SEQ_INSERT_SPACE] = '\0';
-				PRINT(buf);
-			}
-			else
-			{
-				// Only actually happens if we are printing unknown keys or escape sequences
-				(void)snprintf(buf, sizeof buf, "\033[%zu@", add_len);
-				PRINT(buf);
-				PRINT(p_str);
-			}
+	}
 
-#else
-			reprint_from_cursor(p_this, rp_insert, to_end_len);
-#endif
-		}
+	sg->match = match;
+	sg->match_len = len;
+	return match;
+}
 
-		p_this->p_cursor += add_len;	// Update internal cursor
-	}
+static inline void suggest_update(struct emrl_res *p_this)
+{
+	if(NULL != p_this->suggest.p_index)
+		suggest_draw(p_this, suggest_find(p_this));
 }
 
-#if !defined(USE_INSERT_ESCAPE_SEQUENCE) || !defined(USE_DELETE_ESCAPE_SEQUENCE)
-static inline void reprint_from_cursor(struct emrl_res *p_this, enum rp_type type, size_t back_mv)
+// Show the rest of an entry after the line in EMRL_SUGGEST_SGR, or no suggestion if entry is 0. The
+// terminal cursor is at the end of the line and is left there. Cells already showing the same text
+// aren't printed again.
+static inline void suggest_draw(struct emrl_res *p_this, emrl_hist_idx entry)
 {
-	char out_buf[16];
+	struct emrl_suggest *sg = &p_this->suggest;
+	const struct emrl_history *ph = &p_this->history;
+	size_t from = p_this->cmd_free;
+	suggest_covered(p_this);
 
-	switch(type)
+	// Kept to the cursor's row so moving back over it is simple
+	size_t end = from;
+	if(0 != entry)
 	{
-		default:
-		case rp_insert:
-			(void)snprintf(out_buf, sizeof out_buf, "\033[%zuD", back_mv);
-			break;
+		size_t width = wrap_width(p_this);
+		size_t col = strlen(p_this->prompt) + from;
+		if(0 != width)
+			col %= width;
+		else
+			width = SUGGEST_MIN_WIDTH;
 
-		case rp_erase:
-			// Prepend a space to the move back to cover erased char,
-			(void)snprintf(out_buf, sizeof out_buf, " \033[%zuD", back_mv);
-			break;
+		size_t room = (col < width) ? width - 1 - col : 0;
+		end = hist_entry_len(ph, entry);
+		if(end - from > room)
+			end = from + room;
 	}
 
-	// Ensure buffer is null terminated before printing
-	*p_this->p_cmd_free = '\0';
-	PRINT(p_this->p_cursor);
-	PRINT(out_buf);
-}
-#endif
+	// Cells up to start show something other than the suggestion, then the suggestion to its end
+	size_t print_to = end;
+	size_t same = end;
+	if(0 != sg->end && 0 != sg->shown && 0 != entry)
+	{
+		print_to = (sg->start < end) ? sg->start : end;
+		size_t same_end = (sg->end < end) ? sg->end : end;
+		same = (entry == sg->shown) ? same_end : print_to;
+		while(same < same_end && hist_entry_char(ph, entry, same) == hist_entry_char(ph, sg->shown, same))
+			++same;
+	}
 
-static inline void reset_esc(struct emrl_res *p_this, bool known)
-{
-	if(!known)
+	size_t pos = from;
+	if(print_to > from || same < end)
 	{
-		// Space for "^[" (ESC in caret notation),
-		// plus 4 bytes for each  member of esc_buf ("M-[x" possible for each)
-		// plus null terminator
-		char str_buf[4 * (sizeof p_this->esc_buf) + 3];
-		char *p_str = str_buf + 2;
-		const char *p_esc_tmp = p_this->esc_buf;
+		HL_DEFAULT();
+		PRINT(EMRL_SUGGEST_SGR);
+		print_entry(p_this, entry, from, print_to);
+		pos = print_to;
+		if(same < end)
+		{
+			// Step over cells that are already right when that's shorter
+			size_t skip = same - pos;
+			if((p_this->caps & EMRL_CAP_MOVE) && 0 != skip && csi_len(skip) <= skip)
+				print_csi(p_this, skip, 'C');
+			else
+				print_entry(p_this, entry, pos, same);
 
-		// ESC character not in escape buffer, add manually
-		str_buf[0] = '^';
-		str_buf[1] = '[';
+			print_entry(p_this, entry, same, end);
+			pos = end;
+		}
+		PRINT(SEQ_NORMAL);
+	}
 
-		do
+	if(sg->end > end)
+	{
+		// Moving forward could reprint the line rather than the suggestion
+		HL_DEFAULT();
+		if(pos < end && (p_this->caps & EMRL_CAP_MOVE))
+		{
+			print_csi(p_this, end - pos, 'C');
+		}
+		else if(pos < end)
 		{
-			p_str += char_to_printable(*p_esc_tmp++, p_str);
+			PRINT(EMRL_SUGGEST_SGR);
+			print_entry(p_this, entry, pos, end);
+			PRINT(SEQ_NORMAL);
 		}
-		while(p_esc_tmp < p_this->p_esc);
 
-		add_string(p_this, str_buf);
+		erase_to_end(p_this, end, sg->end - end);
+		pos = end;
 	}
 
-	p_this->p_esc = p_this->esc_buf;
-	p_this->esc_state = emrl_esc_none;
+	move_cursor(p_this, pos, from);
+	sg->shown = (end > from) ? entry : 0;
+	sg->start = from;
+	sg->end = (end > from) ? end : 0;
 }
 
-static inline char *hist_search_forward(struct emrl_res *p_this, char *p_entry)
+// Characters added to the line are printed over the start of the suggestion
+static inline void suggest_covered(struct emrl_res *p_this)
 {
-	assert(p_entry > p_this->history.buf);
-	assert(p_entry <= p_this->history.p_buf_last);		// May be equal when updating p_oldest
+	struct emrl_suggest *sg = &p_this->suggest;
+	if(0 == sg->end)
+		return;
 
-	p_entry = strchr(p_entry, '\0');
+	if(sg->start < p_this->cmd_free)
+		sg->start = p_this->cmd_free;
 
-	// Hit end of buffer? Keep searching from start
-	if(p_entry == p_this->history.p_buf_last)
-		p_entry = strchr(p_this->history.buf+1, '\0');
+	if(sg->end <= sg->start)
+		sg->start = sg->end = 0;
+}
 
-	++p_entry;											// Skip past string terminator
+// Returns the cells shown for the line and any suggestion after it, for erasing them all
+static inline size_t suggest_forget(struct emrl_res *p_this)
+{
+	struct emrl_suggest *sg = &p_this->suggest;
+	suggest_covered(p_this);
+	size_t cells = (0 != sg->end) ? sg->end : p_this->cmd_free;
+	sg->start = sg->end = 0;
+	return cells;
+}
 
-	// Did previous entry go right to the end of the buffer, wrap if so
-	if(p_entry == p_this->history.p_buf_last)
-		p_entry = p_this->history.buf + 1;
+// Take the rest of the suggestion into the line
+static inline void suggest_accept(struct emrl_res *p_this)
+{
+	// Input since the last update may have changed it
+	suggest_update(p_this);
+
+	const struct emrl_suggest *sg = &p_this->suggest;
+	if(0 == sg->shown)
+		return;
+
+	size_t len = hist_entry_len(&p_this->history, sg->shown);
+	for(size_t pos = p_this->cmd_free; pos < len; ++pos)
+		p_this->cmd_buf[pos] = hist_entry_char(&p_this->history, sg->shown, pos);
 
-	return p_entry;
+	TRACE(emrl_trace_history, 'C', sg->shown);
+	print_appended(p_this, len - p_this->cmd_free);
 }
+#endif
 
-static inline char *hist_search_backward(struct emrl_res *p_this, char *p_entry)
+static inline void clear_from_prompt(struct emrl_res *p_this)
 {
-	struct emrl_history *ph = &p_this->history;
+	// Erased cells may take the current background colour
+	HL_DEFAULT();
+	move_cursor(p_this, p_this->cursor, 0);
+	erase_to_end(p_this, 0, p_this->cmd_free);
+}
 
-	assert(p_entry > ph->buf);
-	assert(p_entry < ph->p_buf_last);
+// Print the text of the line as displayed, which is the current entry during a history search.
+// cmd_free must be the length of the displayed text.
+static inline void print_line(struct emrl_res *p_this)
+{
+#ifdef USE_HIGHLIGHT
+	if(hl_print_line(p_this))
+		return;
+#endif
 
-	// Is the entry at the start of the buffer?
-	if(p_entry-1 == ph->buf)
-		p_entry = ph->p_buf_last - 2;				// Previous null at end, start before it
+#ifdef USE_HISTORY
+	const struct emrl_history *ph = &p_this->history;
+	if(0 != ph->current)
+	{
+		// Entry may wrap around the end of the history buffer
+		const char *p_current = ph->buf + ph->current;
+		PRINT(p_current);
+		if(ph->current + strlen(p_current) == ph->last)
+			PRINT(ph->buf + 1);
+	}
 	else
-		p_entry -= 2;								// Go back past null of previous entry
+#endif
+	if(0 != p_this->cmd_free)
+	{
+		p_this->cmd_buf[p_this->cmd_free] = '\0';
+		PRINT(p_this->cmd_buf);
+	}
 
-	while('\0' != *p_entry)
-		--p_entry;
+	if(0 != p_this->cmd_free)
+		wrap_fixup(p_this, p_this->cmd_free);
+	HL_PRINTED(0, p_this->cmd_free);
+}
 
-	// Hit start of buffer? Keep searching from end
-	if(p_entry == ph->buf)
+// Move the terminal cursor between cells of the line, from and to may be the end of the line
+static inline void move_cursor(struct emrl_res *p_this, size_t from, size_t to)
+{
+#ifdef USE_WRAP
+	if(on_other_row(p_this, from, to))
 	{
-		p_entry = ph->buf + sizeof ph->buf - 2;
-		while('\0' != *p_entry)
-			--p_entry;
+		move_rows(p_this, from, to);
+		return;
 	}
+#endif
 
-	// Entry starts after the null
-	if(++p_entry == ph->p_buf_last)
-		p_entry = ph->buf + 1;
-		
-	return p_entry;
+	if(to < from)
+		move_cursor_back(p_this, from - to);
+	else
+		move_cursor_forward(p_this, from, to - from);
 }
 
-static inline void hist_show_prev(struct emrl_res *p_this)
+#ifdef USE_WRAP
+// Move up or down to the row, then along it with whichever of a carriage return and a move
+// forward, or a move back, is fewer bytes. Going down a row to its start is just a new line.
+static inline void move_rows(struct emrl_res *p_this, size_t from, size_t to)
 {
-	struct emrl_history *ph = &p_this->history;
+	size_t width = p_this->width;
+	size_t prompt_len = strlen(p_this->prompt);
+	size_t from_row = (prompt_len + from) / width;
+	size_t from_col = (prompt_len + from) % width;
+	size_t to_row = (prompt_len + to) / width;
+	size_t to_col = (prompt_len + to) % width;
+
+	if(to_row == from_row + 1 && 0 == to_col)
+	{
+		PRINT("\r\n");
+		return;
+	}
+
+	if(to_row < from_row)
+		print_csi(p_this, from_row - to_row, 'A');
+	else
+		print_csi(p_this, to_row - from_row, 'B');
 
-	if(NULL != ph->p_newest && ph->p_current != ph->p_oldest)
+	if(to_col > from_col)
+	{
+		print_csi(p_this, to_col - from_col, 'C');
+	}
+	else if(to_col < from_col)
 	{
-		if(NULL == ph->p_current)
+		size_t return_len = 1 + ((0 == to_col) ? 0 : (1 == to_col) ? 3 : csi_len(to_col));
+		if(return_len < move_back_len(p_this, from_col - to_col))
 		{
-			ph->p_current = ph->p_newest;
-			ph->p_cmd_free_bak = p_this->p_cmd_free;
+			PRINT("\r");
+			print_csi(p_this, to_col, 'C');
 		}
 		else
 		{
-			ph->p_current = hist_search_backward(p_this, ph->p_current);
+			move_cursor_back(p_this, from_col - to_col);
 		}
+	}
+}
+#endif
 
-		hist_show_current(p_this);
+static inline void move_cursor_back(struct emrl_res *p_this, size_t count)
+{
+	// Backspaces are fewer bytes than a move sequence for short distances
+	if(count <= 3)
+	{
+		static const char backspaces[] = SEQ_STEP_LEFT SEQ_STEP_LEFT SEQ_STEP_LEFT;
+		PRINT(backspaces + sizeof backspaces - 1 - count);
+	}
+	else if(!(p_this->caps & EMRL_CAP_MOVE))
+	{
+		print_repeated(p_this, '\b', count);
+	}
+	else
+	{
+		char out_buf[24];
+		(void)snprintf(out_buf, sizeof out_buf, "\033[%zuD", count);
+		PRINT(out_buf);
 	}
 }
 
-static inline void hist_show_next(struct emrl_res *p_this)
+// Move over count cells from the cell at from, printing them again where that is shorter than a
+// move sequence or there isn't one
+static inline void move_cursor_forward(struct emrl_res *p_this, size_t from, size_t count)
 {
-	struct emrl_history *ph = &p_this->history;
+	if(0 == count)
+		return;
 
-	// Is history search active?
-	if(NULL != ph->p_current)
+	if(!(p_this->caps & EMRL_CAP_MOVE) || (count < csi_len(count) && can_reprint(p_this)))
 	{
-		// Are we already at the newest entry?
-		if(ph->p_current == ph->p_newest)
-		{
-			// Yes, drop out of history search and display original command
-			ph->p_current = NULL;
+		print_displayed(p_this, from, from + count);
+	}
+	else
+	{
+		char out_buf[24];
+		(void)snprintf(out_buf, sizeof out_buf, "\033[%zuC", count);
+		PRINT(out_buf);
+	}
+}
 
-			clear_from_prompt(p_this);
-			p_this->p_cursor = p_this->p_cmd_free = ph->p_cmd_free_bak;
+// Bytes printed by move_cursor_back()
+static inline size_t move_back_len(struct emrl_res *p_this, size_t count)
+{
+	return (count <= 3 || !(p_this->caps & EMRL_CAP_MOVE)) ? count : csi_len(count);
+}
 
-			// Print command text, if there is any to print
-			if(p_this->p_cmd_free > p_this->cmd_buf)
-			{
-				*p_this->p_cmd_free = '\0';
-				PRINT(p_this->cmd_buf);
-			}
-		}
-		else
-		{
-			// No, show next newest entry
-			ph->p_current = hist_search_forward(p_this, ph->p_current);
-			hist_show_current(p_this);
-		}
+// Length of a sequence such as "\033[12D" with count as its parameter
+static inline size_t csi_len(size_t count)
+{
+	size_t len = 3;
+	do
+	{
+		++len;
+		count /= 10;
 	}
+	while(0 != count);
+
+	return len;
 }
 
-static inline void hist_show_current(struct emrl_res *p_this)
+// Clear the count cells displayed from the terminal cursor at pos to the end of the line, leaving
+// the cursor in place
+static inline void erase_to_end(struct emrl_res *p_this, size_t pos, size_t count)
 {
-	const struct emrl_history *ph = &p_this->history;
+	if(0 == count)
+		return;
+
+	// Erasing to the end of the screen takes the rows below as well
+	bool rows = on_other_row(p_this, pos, pos + count);
+	if((p_this->caps & EMRL_CAP_ERASE) &&
+	   (rows || sizeof SEQ_ERASE_TO_END - 1 <= count + move_back_len(p_this, count)))
+	{
+		PRINT(rows ? SEQ_ERASE_BELOW : SEQ_ERASE_TO_END);
+	}
+	else
+	{
+		print_repeated(p_this, ' ', count);
+		wrap_fixup(p_this, pos + count);
+		move_cursor(p_this, pos + count, pos);
+	}
+}
+
+// Columns the line wraps at, 0 if it is drawn as a single row. Rows are changed with CUU and CUD.
+static inline size_t wrap_width(const struct emrl_res *p_this)
+{
+#ifdef USE_WRAP
+	return (p_this->caps & EMRL_CAP_MOVE) ? p_this->width : 0;
+#else
+	(void)p_this;
+	return 0;
+#endif
+}
 
-	assert(NULL != ph->p_current);
+static inline bool on_other_row(const struct emrl_res *p_this, size_t from, size_t to)
+{
+	size_t width = wrap_width(p_this);
+	if(0 == width)
+		return false;
 
-	clear_from_prompt(p_this);
-	PRINT(ph->p_current);
-	size_t len = strlen(ph->p_current);
-	if(ph->p_current + len == ph->p_buf_last)
+	size_t prompt_len = strlen(p_this->prompt);
+	return (prompt_len + from) / width != (prompt_len + to) / width;
+}
+
+// Text has just been printed up to pos. If that filled the row the terminal keeps the cursor at
+// the right margin, so take it to the start of the next row where the cell at pos is.
+static inline void wrap_fixup(struct emrl_res *p_this, size_t pos)
+{
+	size_t width = wrap_width(p_this);
+	size_t cells = strlen(p_this->prompt) + pos;
+	if(0 != width && 0 != cells && 0 == cells % width)
+		PRINT("\r\n");
+}
+
+// Print a CSI sequence with a count, leaving the count out when it is 1 since that's the default
+static inline void print_csi(struct emrl_res *p_this, size_t count, char final)
+{
+	if(0 == count)
+		return;
+
+	char out_buf[24];
+	if(1 == count)
+		(void)snprintf(out_buf, sizeof out_buf, "\033[%c", final);
+	else
+		(void)snprintf(out_buf, sizeof out_buf, "\033[%zu%c", count, final);
+	PRINT(out_buf);
+}
+
+// Cells can be printed again without restoring their attributes
+static inline bool can_reprint(struct emrl_res *p_this)
+{
+#ifdef USE_HIGHLIGHT
+	return NULL == hl_active(p_this);
+#else
+	(void)p_this;
+	return true;
+#endif
+}
+
+// Print cells start to end of the displayed line, which is the current entry during a history
+// search and may wrap around the end of the history buffer
+static inline void print_displayed(struct emrl_res *p_this, size_t start, size_t end)
+{
+#ifdef USE_HISTORY
+	if(0 != p_this->history.current)
 	{
-		PRINT(ph->buf + 1);
-		len += strlen(ph->buf + 1);
+		print_entry(p_this, p_this->history.current, start, end);
+		return;
 	}
+#endif
 
-	// Set p_cmd_free so that arrow movement behaves like cmd_buf contains the history entry,
-	// but don't overwrite anything until the user edits or presses return
-	p_this->p_cursor = p_this->p_cmd_free = p_this->cmd_buf + len;
+	print_cells(p_this, p_this->cmd_buf + start, end - start);
 }
 
-static inline void clear_from_prompt(struct emrl_res *p_this)
+static inline void print_cells(struct emrl_res *p_this, const char *p_cells, size_t len)
+{
+	char out_buf[32];
+	while(len > 0)
+	{
+		size_t out_len = (len < sizeof out_buf) ? len : sizeof out_buf - 1;
+		(void)memcpy(out_buf, p_cells, out_len);
+		out_buf[out_len] = '\0';
+		PRINT(out_buf);
+		p_cells += out_len;
+		len -= out_len;
+	}
+}
+
+static inline void print_repeated(struct emrl_res *p_this, char chr, size_t count)
 {
-	ptrdiff_t back_mv = p_this->p_cursor-p_this->cmd_buf;
-	if(back_mv > 0)
+	char out_buf[16];
+	while(count > 0)
 	{
-		char out_buf[16];
-		(void)snprintf(out_buf, sizeof out_buf, "\033[%tdD" SEQ_ERASE_TO_END, back_mv);
+		size_t out_len = (count < sizeof out_buf) ? count : sizeof out_buf - 1;
+		(void)memset(out_buf, chr, out_len);
+		out_buf[out_len] = '\0';
 		PRINT(out_buf);
+		count -= out_len;
 	}
 }
 
@@ -612,22 +3529,28 @@ static inline void clear_from_prompt(struct emrl_res *p_this)
 // function checks if there is data to copy, and if so, copies it.
 static inline void deferred_history_copy(struct emrl_res *p_this)
 {
+#ifdef USE_HISTORY
 	struct emrl_history *ph = &p_this->history;
 
 	// History search active?
-	if(NULL != ph->p_current)
+	if(0 != ph->current)
 	{
 		// Yes, copy current history entry to the command buffer
-		size_t len = strlen(ph->p_current);
-		(void)memcpy(p_this->cmd_buf, ph->p_current, len);
-		if(ph->p_current + len == ph->p_buf_last)
+		const char *p_current = ph->buf + ph->current;
+		size_t len = strlen(p_current);
+		(void)memcpy(p_this->cmd_buf, p_current, len);
+		if(ph->current + len == ph->last)
 			strcpy(p_this->cmd_buf + len, ph->buf + 1);
 
-		// p_cmd_free should already point to the end of the command
+		// cmd_free should already be the length of the command
 
-		// Exit history search
-		ph->p_current = NULL;
+		// Exit history search, a retained entry entered unchanged counts as used
+		ph->recalled = ph->current;
+		ph->current = 0;
 	}
+#else
+	(void)p_this;
+#endif
 }
 
 static inline unsigned char_to_printable(unsigned char chr, char *p_print_str)
@@ -10,54 +10,354 @@
 #ifndef EMRL_H
 #define EMRL_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include "emrl_config.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define EMRL_ASCII_ETX 3
 #define EMRL_ASCII_EOT 4
 #define EMRL_ASCII_ESC 27
 #define EMRL_ASCII_DEL 127
 
+// Terminal capabilities, see emrl_set_terminal(). Without any of them the line is drawn with
+// printable characters, backspace and carriage return only.
+#define EMRL_CAP_MOVE 0x01		// Cursor forward and back (CUF, CUB)
+#define EMRL_CAP_ERASE 0x02		// Erase to end of line (EL) and of screen (ED)
+#define EMRL_CAP_INSERT 0x04	// Insert blank characters (ICH)
+#define EMRL_CAP_DELETE 0x08	// Delete characters (DCH)
+#define EMRL_CAP_SGR 0x10		// Character attributes, needed for highlighting
+
+#define EMRL_TERM_DUMB 0
+#define EMRL_TERM_VT100 (EMRL_CAP_MOVE | EMRL_CAP_ERASE | EMRL_CAP_SGR)
+#define EMRL_TERM_XTERM (EMRL_TERM_VT100 | EMRL_CAP_INSERT | EMRL_CAP_DELETE)
+
 typedef int (*emrl_fputs_func)(const char *, emrl_file);
+typedef void (*emrl_tx_kick_func)(emrl_file);
+typedef emrl_cycles (*emrl_time_func)(void);
+
+struct emrl_queue;
+#ifdef USE_TRACE
+struct emrl_trace;
+#endif
 
 enum emrl_esc
 {
 	emrl_esc_none,
 	emrl_esc_new,
 	emrl_esc_ss3,
-	emrl_esc_csi
+	emrl_esc_csi,
+	emrl_esc_da
+};
+
+// Position of a returned line within the whole line, see emrl_set_streaming()
+enum emrl_part
+{
+	emrl_part_whole,
+	emrl_part_first,
+	emrl_part_middle,
+	emrl_part_last
+};
+
+#ifdef USE_CYCLE_STATS
+enum emrl_api
+{
+	emrl_api_process_char,
+	emrl_api_process_buf,
+	emrl_api_add_to_history,
+	emrl_api_count
+};
+
+struct emrl_cycle_stats
+{
+	emrl_cycles min;
+	emrl_cycles max;
+	unsigned long calls;
+	unsigned long long total_cycles;
+};
+#endif
+
+// Offsets into the command and history buffers are stored in the smallest type that can index
+// buffers of the configured maximum sizes, which keeps per-instance state compact
+#if EMRL_MAX_CMD_LEN <= UINT8_MAX
+typedef uint8_t emrl_cmd_idx;
+#elif EMRL_MAX_CMD_LEN <= UINT16_MAX
+typedef uint16_t emrl_cmd_idx;
+#else
+typedef size_t emrl_cmd_idx;
+#endif
+
+#if EMRL_HISTORY_BUF_BYTES - 1 <= UINT8_MAX
+typedef uint8_t emrl_hist_idx;
+#elif EMRL_HISTORY_BUF_BYTES - 1 <= UINT16_MAX
+typedef uint16_t emrl_hist_idx;
+#else
+typedef size_t emrl_hist_idx;
+#endif
+
+// Largest offset each type holds, emrl_init() and emrl_history_rebuffer() clamp buffer sizes to these
+#define EMRL_CMD_IDX_MAX ((emrl_cmd_idx)-1)
+#define EMRL_HIST_IDX_MAX ((emrl_hist_idx)-1)
+
+#ifdef USE_HIGHLIGHT
+// Display attribute for part of the line, cells not covered by a span have attribute 0
+struct emrl_span
+{
+	emrl_cmd_idx start;
+	emrl_cmd_idx len;
+	uint8_t attr;
+};
+
+// Fills p_spans with up to max_spans spans for the len characters of p_line, in order and not
+// overlapping, and returns the number of spans filled
+typedef size_t (*emrl_highlight_func)(void *p_ctx, const char *p_line, size_t len,
+                                      struct emrl_span *p_spans, size_t max_spans);
+
+// Highlighter state, buffers are supplied by the caller, see emrl_highlight_init()
+struct emrl_highlight
+{
+	emrl_highlight_func func;
+	void *p_ctx;
+	const char *const *sgr;
+	struct emrl_span *p_spans;
+	size_t max_spans;
+	uint8_t *p_shown;		// Attribute each cell of the line is displayed with
+	uint8_t attr;			// Attribute the terminal is currently set to
+	bool dirty;
 };
+#endif
 
+#ifdef USE_HISTORY
+// Entry offsets are 0 when unset, buf[0] is a boundary byte so never starts an entry. With
+// retention each entry is preceded by a byte holding its use count plus one.
 struct emrl_history
 {
-	char *p_oldest;
-	char *p_newest;
-	char *p_current;
-	char *p_put;
-	char *p_cmd_free_bak;
-	char *p_buf_last;
-	char buf[EMRL_HISTORY_BUF_BYTES];
+	char *buf;
+	emrl_hist_idx last;
+	emrl_hist_idx oldest;
+	emrl_hist_idx newest;
+	emrl_hist_idx current;
+	emrl_hist_idx put;
+	emrl_hist_idx recalled;		// Entry most recently copied to the line by a history search
+	emrl_cmd_idx cmd_free_bak;
+	bool retain;
 };
+#endif
 
-// emrl resources
+#ifdef USE_SUGGEST
+// Index slots that hold every entry a history buffer of the given size can, see
+// emrl_set_suggestions()
+#define EMRL_SUGGEST_SLOTS(hist_buf_size) ((hist_buf_size) / 2)
+
+// History entry suggested to complete the line. The index holds the offset of each distinct entry
+// in order of their text, the newest entry where several have the same text. Cells of the display
+// from start to end, after the end of the line, show the text of entry shown at the same positions.
+// Cells from the end of the line to start show something else. Nothing is shown while end is 0.
+struct emrl_suggest
+{
+	emrl_hist_idx *p_index;
+	size_t size;
+	size_t count;
+	emrl_hist_idx shown;		// 0 if the cells shown are unknown
+	emrl_hist_idx match;		// Entry found for the first match_len characters of the line
+	emrl_cmd_idx match_len;
+	emrl_cmd_idx start;
+	emrl_cmd_idx end;
+};
+#endif
+
+#ifdef USE_LINE_QUEUE
+// Completed lines waiting to be taken by the application, see emrl_set_line_queue(). Each line is
+// stored whole as its part byte, text and terminator. Lines run from get to put, or after put has
+// wrapped back to the start of the buffer, from get to wrap and then from the start to put.
+struct emrl_line_queue
+{
+	char *buf;
+	size_t size;
+	size_t get;
+	size_t put;
+	size_t wrap;			// 0 unless put has wrapped
+	size_t count;
+	bool held;				// Machine mode line or chunk refused by a full queue
+};
+#endif
+
+// emrl resources, fields used for every character come first
 struct emrl_res
 {
-	struct emrl_history history;
+	char *cmd_buf;
+	emrl_cmd_idx cursor;
+	emrl_cmd_idx cmd_free;
+	emrl_cmd_idx cmd_last;
+	uint8_t delim_pos;
+	bool print_error;
+#ifdef USE_TX_QUEUE
+	bool tx_pending;
+#endif
+#ifdef USE_ESCAPE_INPUT
+	uint8_t esc_len;
+	uint8_t esc_state;		// enum emrl_esc
+	char esc_buf[6];
+#endif
+	uint8_t hide_depth;
+#ifdef USE_MACHINE_MODE
+	bool machine;
+#endif
+	uint8_t caps;			// EMRL_CAP_ flags
+#ifdef USE_WRAP
+	uint16_t width;			// Terminal columns, 0 if unknown
+#endif
+#ifdef USE_ESCAPE_INPUT
+	bool da_pending;
+	uint8_t da_level;
+	emrl_time_func esc_now;
+	emrl_cycles esc_gap;
+	emrl_cycles esc_time;	// When the last byte of a pending escape sequence was received
+#endif
 	emrl_fputs_func fputs;
 	emrl_file file;
 	const char *delim;
-	const char *p_delim;
-	char *p_esc;
-	const char *p_esc_last;
-	char *p_cursor;
-	char *p_cmd_free;
-	const char *p_cmd_last;
-	enum emrl_esc esc_state;
-	char esc_buf[6];
-	char cmd_buf[EMRL_MAX_CMD_LEN + 1];
+#ifdef USE_HISTORY
+	struct emrl_history history;
+#endif
+#ifdef USE_SUGGEST
+	struct emrl_suggest suggest;
+#endif
+	const char *prompt;
+#ifdef USE_TX_QUEUE
+	struct emrl_queue *p_txq;
+	emrl_tx_kick_func tx_kick;
+#endif
+#ifdef USE_STREAMING
+	uint8_t line_part;		// enum emrl_part
+	bool streaming;
+	bool streamed;
+#endif
+#ifdef USE_LINE_QUEUE
+	struct emrl_line_queue lines;
+#endif
+#ifdef USE_CYCLE_STATS
+	struct emrl_cycle_stats cycle_stats[emrl_api_count];
+#endif
+#ifdef USE_TRACE
+	struct emrl_trace *p_trace;
+	size_t trace_out_len;
+#endif
+#ifdef USE_HIGHLIGHT
+	struct emrl_highlight *p_hl;
+#endif
 };
 
-void emrl_init(struct emrl_res *p_this, emrl_fputs_func fputs, emrl_file file, const char *delim);
+// Buffers are supplied by the caller, EMRL_MAX_CMD_LEN and EMRL_HISTORY_BUF_BYTES give sensible
+// defaults for their sizes, e.g.
+//
+//     static int out(const char *p_str, emrl_file file) { return fputs(p_str, file); }
+//
+//     static char cmd_buf[EMRL_MAX_CMD_LEN + 1];
+//     static char hist_buf[EMRL_HISTORY_BUF_BYTES];
+//     emrl_init(&emrl, out, stdout, "\r", cmd_buf, sizeof cmd_buf, hist_buf, sizeof hist_buf);
+//
+// The command buffer size includes space for the null terminator. Offsets into the buffers are
+// stored in types sized to fit these defaults, so a buffer larger than EMRL_CMD_IDX_MAX + 1 bytes
+// for commands or EMRL_HIST_IDX_MAX + 1 bytes for history is clamped to that size and the rest of
+// it left unused. Raise EMRL_MAX_CMD_LEN or EMRL_HISTORY_BUF_BYTES to use larger buffers. Built
+// without USE_HISTORY the history buffer is unused and may be NULL with a size of 0. With
+// USE_HISTORY a NULL buffer with a size of 0 keeps no history until emrl_history_rebuffer().
+//
+// Execution time of each call is bounded by the size of the command buffer, not the history
+// buffer or the input seen so far:
+// - emrl_process_char() moves, copies or prints at most one command buffer's worth of data, and
+//   history navigation scans back over at most one entry
+// - emrl_add_to_history() copies the command and scans past at most one partly overwritten entry.
+//   Commands that don't fit in the command buffer are not added since they couldn't be recalled.
+// - with suggestions, adding also moves up to the whole index along one slot, and finding a
+//   suggestion scans the index entries that start with the line
+void emrl_init(struct emrl_res *p_this, emrl_fputs_func fputs, emrl_file file, const char *delim,
+               char *cmd_buf, size_t cmd_buf_size, char *hist_buf, size_t hist_buf_size);
 char *emrl_process_char(struct emrl_res *p_this, char chr);
+char *emrl_process_buf(struct emrl_res *p_this, const char *p_buf, size_t len, size_t *p_used);
+#ifdef USE_HISTORY
 void emrl_add_to_history(struct emrl_res *p_this, const char *p_command);
+void emrl_set_history_retention(struct emrl_res *p_this, bool retain);
+bool emrl_history_entry(const struct emrl_res *p_this, size_t back, char *p_buf);
+void emrl_history_rebuffer(struct emrl_res *p_this, char *p_buf, size_t size);
+bool emrl_history_fits(const struct emrl_res *p_this, const char *p_command);
+#else
+// Lines can still be passed in by code shared with builds that have history
+static inline void emrl_add_to_history(struct emrl_res *p_this, const char *p_command)
+{
+	(void)p_this;
+	(void)p_command;
+}
+#endif
+bool emrl_print_error(struct emrl_res *p_this);
+void emrl_set_prompt(struct emrl_res *p_this, const char *prompt);
+void emrl_redraw(struct emrl_res *p_this);
+void emrl_hide(struct emrl_res *p_this);
+void emrl_show(struct emrl_res *p_this);
+void emrl_print_async(struct emrl_res *p_this, const char *p_msg);
+#ifdef USE_TX_QUEUE
+void emrl_set_tx_queue(struct emrl_res *p_this, struct emrl_queue *p_txq, emrl_tx_kick_func kick);
+#endif
+#ifdef USE_MACHINE_MODE
+void emrl_set_machine_mode(struct emrl_res *p_this, bool machine);
+#endif
+#ifdef USE_STREAMING
+void emrl_set_streaming(struct emrl_res *p_this, bool streaming);
+enum emrl_part emrl_line_part(const struct emrl_res *p_this);
+#else
+// Lines are always returned whole
+static inline enum emrl_part emrl_line_part(const struct emrl_res *p_this)
+{
+	(void)p_this;
+	return emrl_part_whole;
+}
+#endif
+#ifdef USE_SUGGEST
+void emrl_set_suggestions(struct emrl_res *p_this, emrl_hist_idx *p_index, size_t slots);
+#endif
+#ifdef USE_LINE_QUEUE
+void emrl_set_line_queue(struct emrl_res *p_this, char *p_buf, size_t size);
+const char *emrl_peek_line(const struct emrl_res *p_this, enum emrl_part *p_part);
+void emrl_pop_line(struct emrl_res *p_this);
+size_t emrl_lines_queued(const struct emrl_res *p_this);
+#endif
+void emrl_set_terminal(struct emrl_res *p_this, unsigned caps);
+unsigned emrl_terminal(const struct emrl_res *p_this);
+#ifdef USE_WRAP
+void emrl_set_width(struct emrl_res *p_this, size_t width);
+size_t emrl_width(const struct emrl_res *p_this);
+#endif
+#ifdef USE_ESCAPE_INPUT
+void emrl_detect_terminal(struct emrl_res *p_this);
+void emrl_set_escape_timeout(struct emrl_res *p_this, emrl_time_func now, emrl_cycles gap);
+emrl_cycles emrl_escape_gap(unsigned long baud, unsigned long ticks_per_sec);
+#endif
+#ifdef USE_SAVE_STATE
+size_t emrl_save_state(const struct emrl_res *p_this, void *p_buf, size_t size);
+bool emrl_restore_state(struct emrl_res *p_this, const void *p_buf, size_t len);
+#endif
+#ifdef USE_CYCLE_STATS
+const struct emrl_cycle_stats *emrl_cycle_stats(const struct emrl_res *p_this, enum emrl_api api);
+void emrl_reset_cycle_stats(struct emrl_res *p_this);
+#endif
+#ifdef USE_TRACE
+void emrl_set_trace(struct emrl_res *p_this, struct emrl_trace *p_trace);
+#endif
+#ifdef USE_HIGHLIGHT
+void emrl_highlight_init(struct emrl_highlight *p_hl, emrl_highlight_func func, void *p_ctx,
+                         const char *const *sgr, struct emrl_span *p_spans, size_t max_spans,
+                         uint8_t *p_shown);
+void emrl_set_highlight(struct emrl_res *p_this, struct emrl_highlight *p_hl);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif	/* EMRL_H */
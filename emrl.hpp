@@ -0,0 +1,117 @@
+/*
+ * emrl.hpp -- emrl line editing library C++ wrapper
+ *
+ * Copyright (C) 2017 Graeme Hattan (graemeh.dev@gmail.com)
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef EMRL_HPP
+#define EMRL_HPP
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+#include "emrl.h"
+
+namespace emrl
+{
+
+// Line editor with buffer sizes fixed at compile time for each instantiation, using the C library
+// as its engine.
+//
+// Output is passed to a Sink functor, called as sink(const char *). The sink may return an int
+// (as fputs does) or void. Rather than the caller supplying an emrl_fputs_func, each instantiation
+// gets its own trampoline with the sink call inlined into it. The C core is compiled separately
+// and still makes one indirect call to the trampoline for each piece of output, even with -flto.
+//
+// The emrl_file context handed to the C core points back to the editor, so instances must not be
+// copied or moved once constructed.
+//
+// Sizes are limited by what emrl_cmd_idx and emrl_hist_idx can index rather than by the default
+// buffer sizes. Those types are shared with the C core and sized from EMRL_MAX_CMD_LEN and
+// EMRL_HISTORY_BUF_BYTES, which should be set for the largest instance in the program.
+template<std::size_t MaxCmd, std::size_t HistoryBytes, typename Sink>
+class line_editor
+{
+	static_assert(MaxCmd >= 1, "command buffer must hold at least one character");
+	static_assert(HistoryBytes >= 4, "history buffer too small");
+	static_assert(MaxCmd <= EMRL_CMD_IDX_MAX, "command buffer offsets would not fit emrl_cmd_idx");
+	static_assert(HistoryBytes - 1 <= EMRL_HIST_IDX_MAX, "history offsets would not fit emrl_hist_idx");
+	static_assert(std::is_same<emrl_file, void *>::value, "emrl_file must be an opaque context pointer");
+
+public:
+	static constexpr std::size_t max_cmd_len = MaxCmd;
+	static constexpr std::size_t history_bytes = HistoryBytes;
+
+	explicit line_editor(const char *delim, Sink sink = Sink())
+		: m_sink(std::move(sink))
+	{
+		emrl_init(&m_res, &put, static_cast<emrl_file>(this), delim,
+		          m_cmd_buf, sizeof m_cmd_buf, m_hist_buf, sizeof m_hist_buf);
+	}
+
+	line_editor(const line_editor &) = delete;
+	line_editor &operator=(const line_editor &) = delete;
+
+	char *process_char(char chr)
+	{
+		return emrl_process_char(&m_res, chr);
+	}
+
+	// Process a block of input, stopping early if a line is completed. The number of bytes
+	// consumed is written to used, any remainder should be passed in again after the returned
+	// line has been dealt with.
+	char *process(const char *p_buf, std::size_t len, std::size_t &used)
+	{
+		return emrl_process_buf(&m_res, p_buf, len, &used);
+	}
+
+	void add_to_history(const char *p_command)
+	{
+		emrl_add_to_history(&m_res, p_command);
+	}
+
+	Sink &sink()
+	{
+		return m_sink;
+	}
+
+	// Access to the underlying C resources for API not wrapped here
+	emrl_res *res()
+	{
+		return &m_res;
+	}
+
+private:
+	template<typename S>
+	static auto call_sink(S &sink, const char *p_str, int)
+		-> typename std::enable_if<!std::is_void<decltype(sink(p_str))>::value, int>::type
+	{
+		return static_cast<int>(sink(p_str));
+	}
+
+	template<typename S>
+	static int call_sink(S &sink, const char *p_str, long)
+	{
+		sink(p_str);
+		return 0;
+	}
+
+	static int put(const char *p_str, emrl_file file)
+	{
+		line_editor *p_ed = static_cast<line_editor *>(file);
+		return call_sink(p_ed->m_sink, p_str, 0);
+	}
+
+	emrl_res m_res;
+	Sink m_sink;
+	char m_cmd_buf[MaxCmd + 1];
+	char m_hist_buf[HistoryBytes];
+};
+
+}	// namespace emrl
+
+#endif	/* EMRL_HPP */
@@ -10,14 +10,98 @@
 #ifndef EMRL_CONFIG_H
 #define EMRL_CONFIG_H
 
+#include <stdint.h>
 #include <stdio.h>
 
+// Default buffer sizes. Offsets into the buffers are stored in the smallest types that can index
+// these, so they also bound the largest buffers any instance can use.
 #define EMRL_MAX_CMD_LEN 127
 #define EMRL_HISTORY_BUF_BYTES 256
 
+// Smallest history block handed out by emrl_pool, see emrl_pool.h. EMRL_HISTORY_BUF_BYTES must be
+// this times a power of two.
+#define EMRL_POOL_CHUNK_BYTES 32
+
+// Assume the terminal has insert and delete character sequences until emrl_set_terminal() says
+// otherwise
 #define USE_INSERT_ESCAPE_SEQUENCE
 #define USE_DELETE_ESCAPE_SEQUENCE
 
-typedef FILE* emrl_file;
+// Optional features, all built unless EMRL_CUSTOM_FEATURES is defined, in which case only those
+// defined alongside it are, e.g. -DEMRL_CUSTOM_FEATURES -DUSE_HISTORY. The code and emrl_res
+// fields of a feature left out are compiled out altogether. make footprint shows what each costs.
+#ifndef EMRL_CUSTOM_FEATURES
+
+// Command history, see emrl_add_to_history()
+#define USE_HISTORY
+
+// Cursor keys, delete and history navigation sent as escape sequences, and emrl_detect_terminal().
+// Without it an escape is shown and edited like any other control character.
+#define USE_ESCAPE_INPUT
+
+// Lines that wrap at the terminal width, see emrl_set_width()
+#define USE_WRAP
+
+// Type-ahead queue of completed lines, see emrl_set_line_queue()
+#define USE_LINE_QUEUE
+
+// emrl_save_state() and emrl_restore_state()
+#define USE_SAVE_STATE
+
+// Highlighter callback support, see emrl_set_highlight()
+#define USE_HIGHLIGHT
+
+// History entries suggested as the line is typed, see emrl_set_suggestions(). Needs USE_HISTORY
+// and USE_ESCAPE_INPUT.
+#define USE_SUGGEST
+
+// Line splitting without editing for scripted peers, see emrl_set_machine_mode()
+#define USE_MACHINE_MODE
+
+// Lines longer than the command buffer returned in pieces, see emrl_set_streaming()
+#define USE_STREAMING
+
+// Output copied to an emrl_queue rather than passed to fputs, see emrl_set_tx_queue()
+#define USE_TX_QUEUE
+
+#endif
+
+// Attribute suggestions are shown with, faint unless defined otherwise
+#if defined(USE_SUGGEST) && !defined(EMRL_SUGGEST_SGR)
+#define EMRL_SUGGEST_SGR "\033[2m"
+#endif
+
+// Record minimum, maximum and mean cycles spent in each API call, see emrl_cycle_stats()
+//#define USE_CYCLE_STATS
+
+// Free running counter read for cycle statistics, e.g. DWT->CYCCNT on a Cortex-M
+#if defined(USE_CYCLE_STATS) && !defined(EMRL_CYCLES)
+#include <time.h>
+#define EMRL_CYCLES() ((emrl_cycles)clock())
+#endif
+
+// Context passed to the output function, emrl never looks inside it
+typedef void *emrl_file;
+typedef uint32_t emrl_cycles;
+
+// Time allowed between the bytes of an escape sequence, in character times at the baud rate given
+// to emrl_escape_gap() but no less than EMRL_ESC_GAP_MIN_MS, see emrl_set_escape_timeout()
+#define EMRL_ESC_GAP_CHARS 4
+#define EMRL_ESC_GAP_MIN_MS 50
+
+// Write timestamped events to a trace ring, see emrl_set_trace()
+//#define USE_TRACE
+
+// Timestamp for trace records, microseconds from the monotonic clock unless defined otherwise
+#if defined(USE_TRACE) && !defined(EMRL_TRACE_TIME)
+#include <time.h>
+#define EMRL_TRACE_TIME() emrl_trace_time()
+static inline emrl_cycles emrl_trace_time(void)
+{
+	struct timespec now;
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	return (emrl_cycles)(now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+#endif
 
 #endif
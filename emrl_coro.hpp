@@ -0,0 +1,297 @@
+/*
+ * emrl_coro.hpp -- emrl line editing library C++20 coroutine adapter
+ *
+ * Copyright (C) 2017 Graeme Hattan (graemeh.dev@gmail.com)
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef EMRL_CORO_HPP
+#define EMRL_CORO_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <utility>
+
+#include "emrl.hpp"
+
+namespace emrl
+{
+
+// Bump allocator over a caller supplied buffer, which should be aligned for std::max_align_t.
+// Holds the coroutine frames of one session so that starting a session doesn't use the heap.
+// Only freeing the most recent allocation makes space available again, which suits frames that
+// are created and destroyed in nested order.
+class arena
+{
+public:
+	arena(void *p_buf, std::size_t size) noexcept
+		: m_base(static_cast<unsigned char *>(p_buf)), m_size(size), m_used(0)
+	{
+	}
+
+	arena(const arena &) = delete;
+	arena &operator=(const arena &) = delete;
+
+	// Returns nullptr if there isn't enough space left
+	void *allocate(std::size_t size) noexcept
+	{
+		size = round_up(size);
+		if(size > m_size - m_used)
+			return nullptr;
+
+		void *p_block = m_base + m_used;
+		m_used += size;
+		return p_block;
+	}
+
+	void deallocate(void *p_block, std::size_t size) noexcept
+	{
+		size = round_up(size);
+		if(static_cast<unsigned char *>(p_block) + size == m_base + m_used)
+			m_used -= size;
+	}
+
+	std::size_t used() const noexcept
+	{
+		return m_used;
+	}
+
+	static constexpr std::size_t round_up(std::size_t size) noexcept
+	{
+		return (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+	}
+
+private:
+	unsigned char *m_base;
+	std::size_t m_size;
+	std::size_t m_used;
+};
+
+// Return type for a coroutine running one session, started with a frame allocated from an arena
+// by start(), e.g.
+//
+//     emrl::session shell(reader_type &reader)
+//     {
+//         while(const char *p_line = co_await reader.read_line())
+//             ...
+//     }
+//
+//     emrl::session s = emrl::session::start(session_arena, shell, reader);
+//
+// The coroutine runs as soon as it is started, up to its first suspension. If the arena is too
+// small, or the coroutine is called directly rather than through start(), the returned session
+// is not valid(). Exceptions thrown out of the coroutine terminate.
+class session
+{
+public:
+	struct promise_type
+	{
+		// Frames are prefixed with a pointer back to their arena for the deallocation
+		static constexpr std::size_t header = arena::round_up(sizeof(arena *));
+
+		static void *operator new(std::size_t size) noexcept
+		{
+			if(nullptr == s_p_arena)
+				return nullptr;
+
+			unsigned char *p_block = static_cast<unsigned char *>(s_p_arena->allocate(header + size));
+			if(nullptr == p_block)
+				return nullptr;
+
+			*reinterpret_cast<arena **>(p_block) = s_p_arena;
+			return p_block + header;
+		}
+
+		static void operator delete(void *p_frame, std::size_t size) noexcept
+		{
+			unsigned char *p_block = static_cast<unsigned char *>(p_frame) - header;
+			(*reinterpret_cast<arena **>(p_block))->deallocate(p_block, header + size);
+		}
+
+		static session get_return_object_on_allocation_failure() noexcept
+		{
+			return session();
+		}
+
+		session get_return_object() noexcept
+		{
+			return session(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_never initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		// Stay suspended at the end so the owner can see the session is done
+		std::suspend_always final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void return_void() noexcept
+		{
+		}
+
+		void unhandled_exception() noexcept
+		{
+			std::terminate();
+		}
+	};
+
+	session() noexcept = default;
+
+	template<typename Func, typename... Args>
+	static session start(arena &ar, Func &&func, Args &&...args)
+	{
+		arena *p_prev = std::exchange(s_p_arena, &ar);
+		session started = std::forward<Func>(func)(std::forward<Args>(args)...);
+		s_p_arena = p_prev;
+		return started;
+	}
+
+	session(session &&other) noexcept
+		: m_handle(std::exchange(other.m_handle, nullptr))
+	{
+	}
+
+	session &operator=(session &&other) noexcept
+	{
+		if(this != &other)
+		{
+			destroy();
+			m_handle = std::exchange(other.m_handle, nullptr);
+		}
+		return *this;
+	}
+
+	~session()
+	{
+		destroy();
+	}
+
+	bool valid() const noexcept
+	{
+		return static_cast<bool>(m_handle);
+	}
+
+	bool done() const noexcept
+	{
+		return !m_handle || m_handle.done();
+	}
+
+private:
+	explicit session(std::coroutine_handle<promise_type> handle) noexcept
+		: m_handle(handle)
+	{
+	}
+
+	void destroy() noexcept
+	{
+		if(m_handle)
+			m_handle.destroy();
+		m_handle = nullptr;
+	}
+
+	// Arena for frames allocated by the coroutine called from start()
+	static inline thread_local arena *s_p_arena = nullptr;
+
+	std::coroutine_handle<promise_type> m_handle;
+};
+
+// Line editor whose completed lines are collected by a coroutine awaiting read_line(), while an
+// event loop passes input to feed(). Resuming a waiting coroutine doesn't allocate, the awaiter
+// only stores its handle.
+//
+// A line returned by read_line() remains valid until the next call to read_line(). Until then
+// feed() doesn't consume input, so a session may await other events while it handles a line.
+template<std::size_t MaxCmd, std::size_t HistoryBytes, typename Sink>
+class line_reader : public line_editor<MaxCmd, HistoryBytes, Sink>
+{
+public:
+	class line_awaiter
+	{
+	public:
+		explicit line_awaiter(line_reader &reader) noexcept
+			: m_reader(reader)
+		{
+		}
+
+		bool await_ready() const noexcept
+		{
+			return nullptr != m_reader.m_line || m_reader.m_closed;
+		}
+
+		void await_suspend(std::coroutine_handle<> waiter) noexcept
+		{
+			m_reader.m_waiter = waiter;
+		}
+
+		// nullptr once the input has been closed
+		const char *await_resume() const noexcept
+		{
+			m_reader.m_busy = (nullptr != m_reader.m_line);
+			return std::exchange(m_reader.m_line, nullptr);
+		}
+
+	private:
+		line_reader &m_reader;
+	};
+
+	using line_editor<MaxCmd, HistoryBytes, Sink>::line_editor;
+
+	line_awaiter read_line() noexcept
+	{
+		m_busy = false;
+		return line_awaiter(*this);
+	}
+
+	// Process input, resuming the waiting coroutine with each completed line. Returns the number
+	// of bytes consumed, which is less than len if a line is being handled or hasn't been
+	// collected yet, pass the remainder in again later.
+	std::size_t feed(const char *p_buf, std::size_t len)
+	{
+		std::size_t total = 0;
+		while(total < len && nullptr == m_line && !m_busy && !m_closed)
+		{
+			std::size_t used;
+			const char *p_line = this->process(p_buf + total, len - total, used);
+			total += used;
+
+			if(nullptr != p_line)
+			{
+				m_line = p_line;
+				resume();
+			}
+		}
+
+		return total;
+	}
+
+	// End of input, a waiting or later read_line() returns nullptr
+	void close()
+	{
+		m_closed = true;
+		resume();
+	}
+
+private:
+	void resume()
+	{
+		std::coroutine_handle<> waiter = std::exchange(m_waiter, nullptr);
+		if(waiter)
+			waiter.resume();
+	}
+
+	std::coroutine_handle<> m_waiter;
+	const char *m_line = nullptr;
+	bool m_busy = false;
+	bool m_closed = false;
+};
+
+}	// namespace emrl
+
+#endif	/* EMRL_CORO_HPP */
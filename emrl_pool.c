@@ -0,0 +1,471 @@
+/*
+ * emrl_pool.c -- emrl history storage shared by many line editors
+ *
+ * Copyright (C) 2017 Graeme Hattan (graemeh.dev@gmail.com)
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "emrl_pool.h"
+
+#ifdef USE_HISTORY
+#if EMRL_HISTORY_BUF_BYTES % EMRL_POOL_CHUNK_BYTES != 0 || \
+    (EMRL_POOL_SLAB_CHUNKS & (EMRL_POOL_SLAB_CHUNKS - 1)) != 0
+#error "EMRL_HISTORY_BUF_BYTES must be EMRL_POOL_CHUNK_BYTES times a power of two"
+#endif
+
+#if EMRL_POOL_SLAB_CHUNKS >= (1L << (EMRL_POOL_MAX_ORDERS - 1))
+#error "Too many chunks in a slab, raise EMRL_POOL_MAX_ORDERS"
+#endif
+
+// A free block holds the links of its free list, and the smallest history buffer is 4 bytes
+#if EMRL_POOL_CHUNK_BYTES < 8
+#error "EMRL_POOL_CHUNK_BYTES must be at least 8"
+#endif
+
+// Tag of the first chunk of a free block, any other chunk is tagged 0
+#define TAG_FREE			0x80
+
+// Free list links at the start of a free block, chunk numbers plus one, 0 for none
+enum link
+{
+	link_next,
+	link_prev
+};
+
+static inline bool grow(struct emrl_pool *p_pool, struct emrl_pool_history *p_hist, unsigned long since,
+                        bool *p_reclaimed);
+static inline struct emrl_pool_history *least_recent(const struct emrl_pool *p_pool, unsigned order,
+                                                     unsigned long since);
+static inline void trade(struct emrl_pool *p_pool, struct emrl_pool_history *p_hist,
+                         struct emrl_pool_history *p_idle);
+static inline void halve(struct emrl_pool *p_pool, struct emrl_pool_history *p_hist);
+static inline bool have_free(const struct emrl_pool *p_pool, unsigned order);
+static inline char *alloc_order(struct emrl_pool *p_pool, unsigned order);
+static inline void free_order(struct emrl_pool *p_pool, uint32_t chunk, unsigned order);
+static inline void release(struct emrl_pool *p_pool, uint32_t chunk, unsigned order);
+static inline void list_push(struct emrl_pool *p_pool, uint32_t chunk, unsigned order);
+static inline void list_remove(struct emrl_pool *p_pool, uint32_t chunk, unsigned order);
+static inline uint32_t link_get(const struct emrl_pool *p_pool, uint32_t chunk, enum link link);
+static inline void link_set(struct emrl_pool *p_pool, uint32_t chunk, enum link link, uint32_t value);
+static inline unsigned block_order(size_t size);
+static inline uint32_t block_chunk(const struct emrl_pool *p_pool, const char *p_block);
+static inline void held_add(struct emrl_pool *p_pool, struct emrl_pool_history *p_hist, bool recent);
+static inline void held_remove(struct emrl_pool *p_pool, struct emrl_pool_history *p_hist);
+
+// Memory for as many slabs as fit in size, see EMRL_POOL_BYTES(). p_mem needn't be aligned.
+void emrl_pool_init(struct emrl_pool *p_pool, void *p_mem, size_t size)
+{
+	size_t slabs = size / (EMRL_HISTORY_BUF_BYTES + EMRL_POOL_SLAB_CHUNKS);
+	assert(slabs <= UINT32_MAX / EMRL_POOL_SLAB_CHUNKS);
+
+	p_pool->p_mem = p_mem;
+	p_pool->p_tags = (uint8_t *)p_mem + slabs * EMRL_HISTORY_BUF_BYTES;
+	p_pool->chunks = slabs * EMRL_POOL_SLAB_CHUNKS;
+	p_pool->top = block_order(EMRL_HISTORY_BUF_BYTES);
+	p_pool->clock = 0;
+	(void)memset(p_pool->p_tags, 0, p_pool->chunks);
+	for(unsigned order = 0; order < EMRL_POOL_MAX_ORDERS; ++order)
+	{
+		p_pool->free[order] = 0;
+		p_pool->p_held[order] = p_pool->p_held_last[order] = NULL;
+	}
+
+	(void)memset(&p_pool->stats, 0, sizeof p_pool->stats);
+	p_pool->stats.total_bytes = slabs * EMRL_HISTORY_BUF_BYTES;
+
+	// Pushed last first so that the first slab is used first
+	for(size_t slab = slabs; slab > 0; --slab)
+		list_push(p_pool, (slab - 1) * EMRL_POOL_SLAB_CHUNKS, p_pool->top);
+}
+
+// Returns a block of at least size bytes, no more than EMRL_HISTORY_BUF_BYTES, or NULL if there
+// is no room. The block isn't aligned.
+void *emrl_pool_alloc(struct emrl_pool *p_pool, size_t size)
+{
+	unsigned order = block_order(size);
+	if(order > p_pool->top)
+	{
+		++p_pool->stats.failed;
+		return NULL;
+	}
+
+	return alloc_order(p_pool, order);
+}
+
+// size must be the size the block was allocated with
+void emrl_pool_free(struct emrl_pool *p_pool, void *p_block, size_t size)
+{
+	free_order(p_pool, block_chunk(p_pool, p_block), block_order(size));
+}
+
+const struct emrl_pool_stats *emrl_pool_stats(const struct emrl_pool *p_pool)
+{
+	return &p_pool->stats;
+}
+
+// Keep the history of a line editor in the pool, with up to max_size bytes, rounded down to a
+// block size and no less than EMRL_POOL_CHUNK_BYTES. Any history buffer given to emrl_init() is no
+// longer used and its entries are dropped. Lines should then be added to the history with
+// emrl_pool_add_to_history() only.
+//
+// The history mustn't hold a block, it is either zero initialised or has been detached. A block
+// left held would be lost to the pool, and one from a pool since thrown away couldn't be told from
+// a live one, so attach doesn't detach for the caller.
+void emrl_pool_attach(struct emrl_pool *p_pool, struct emrl_pool_history *p_hist,
+                      struct emrl_res *p_emrl, size_t max_size)
+{
+	assert(NULL == p_hist->p_block);
+
+	p_hist->p_emrl = p_emrl;
+	p_hist->p_prev = p_hist->p_next = NULL;
+	p_hist->p_block = NULL;
+	p_hist->used = p_pool->clock;
+	p_hist->order = 0;
+
+	unsigned max_order = 0;
+	while(max_order < p_pool->top && ((size_t)EMRL_POOL_CHUNK_BYTES << (max_order + 1)) <= max_size)
+		++max_order;
+
+	p_hist->max_order = max_order;
+	emrl_history_rebuffer(p_emrl, NULL, 0);
+}
+
+// Give back the memory of a history, e.g. when its session ends or has been idle for a while. The
+// entries are dropped. The history may be used again, starting from nothing.
+void emrl_pool_detach(struct emrl_pool *p_pool, struct emrl_pool_history *p_hist)
+{
+	emrl_history_rebuffer(p_hist->p_emrl, NULL, 0);
+	if(NULL == p_hist->p_block)
+		return;
+
+	held_remove(p_pool, p_hist);
+	free_order(p_pool, block_chunk(p_pool, p_hist->p_block), p_hist->order);
+	p_hist->p_block = NULL;
+}
+
+// Like emrl_add_to_history(), first doubling the history's block until the command fits without
+// dropping older entries, if the per history limit and the pool allow
+void emrl_pool_add_to_history(struct emrl_pool *p_pool, struct emrl_pool_history *p_hist,
+                              const char *p_command)
+{
+	struct emrl_res *p_emrl = p_hist->p_emrl;
+
+	// Move to the most recently used end
+	unsigned long since = p_hist->used;
+	p_hist->used = ++p_pool->clock;
+	if(NULL != p_hist->p_block)
+	{
+		held_remove(p_pool, p_hist);
+		held_add(p_pool, p_hist, true);
+	}
+
+	bool reclaimed = false;
+	bool fits = emrl_history_fits(p_emrl, p_command);
+	while(!fits && grow(p_pool, p_hist, since, &reclaimed))
+		fits = emrl_history_fits(p_emrl, p_command);
+
+	if(!fits)
+		++p_pool->stats.dropped;
+
+	emrl_add_to_history(p_emrl, p_command);
+}
+
+// Move to a block of twice the size, or the smallest block if none is held. Memory is only
+// reclaimed from histories idle since before since, when this one was last used before now, except
+// to give it the smallest block, and at most once per addition, *p_reclaimed being set when it is.
+// Returns false if the history is at its limit or there's no room.
+static inline bool grow(struct emrl_pool *p_pool, struct emrl_pool_history *p_hist, unsigned long since,
+                        bool *p_reclaimed)
+{
+	unsigned order = (NULL != p_hist->p_block) ? p_hist->order + 1u : 0;
+	if(order > p_hist->max_order)
+		return false;
+
+	if(0 == order)
+		since = p_pool->clock;
+
+	if(!have_free(p_pool, order))
+	{
+		struct emrl_pool_history *p_idle = *p_reclaimed ? NULL : least_recent(p_pool, order, since);
+		if(NULL == p_idle)
+		{
+			++p_pool->stats.failed;
+			return false;
+		}
+
+		*p_reclaimed = true;
+		++p_pool->stats.reclaimed;
+		if(p_idle->order == order)
+		{
+			trade(p_pool, p_hist, p_idle);
+			return true;
+		}
+
+		halve(p_pool, p_idle);
+	}
+
+	char *p_block = alloc_order(p_pool, order);
+	emrl_history_rebuffer(p_hist->p_emrl, p_block, (size_t)EMRL_POOL_CHUNK_BYTES << order);
+	if(NULL != p_hist->p_block)
+	{
+		held_remove(p_pool, p_hist);
+		free_order(p_pool, block_chunk(p_pool, p_hist->p_block), p_hist->order);
+	}
+
+	p_hist->p_block = p_block;
+	p_hist->order = order;
+	held_add(p_pool, p_hist, true);
+	++p_pool->stats.grown;
+	return true;
+}
+
+// The least recently used history of those holding blocks of at least order and idle since before
+// since, or NULL if there are none. Each list is in order of use, so only the first of each needs
+// looking at. Ages are compared rather than clock values, which may wrap around.
+static inline struct emrl_pool_history *least_recent(const struct emrl_pool *p_pool, unsigned order,
+                                                     unsigned long since)
+{
+	unsigned long oldest = p_pool->clock - since;
+	struct emrl_pool_history *p_hist = NULL;
+	for(; order <= p_pool->top; ++order)
+	{
+		struct emrl_pool_history *p_first = p_pool->p_held[order];
+		if(NULL != p_first && p_pool->clock - p_first->used > oldest)
+		{
+			p_hist = p_first;
+			oldest = p_pool->clock - p_first->used;
+		}
+	}
+
+	return p_hist;
+}
+
+// Give a history the block of an idle one of the size it wants. The idle history moves to the
+// block given up, keeping the newest entries that fit, or is left without one.
+static inline void trade(struct emrl_pool *p_pool, struct emrl_pool_history *p_hist,
+                         struct emrl_pool_history *p_idle)
+{
+	char *p_block = p_idle->p_block;
+	unsigned order = p_idle->order;
+	held_remove(p_pool, p_idle);
+	if(NULL != p_hist->p_block)
+	{
+		// The idle history waits in the scratch buffer while its block is taken
+		size_t size = (size_t)EMRL_POOL_CHUNK_BYTES << p_hist->order;
+		emrl_history_rebuffer(p_idle->p_emrl, p_pool->scratch, size);
+		emrl_history_rebuffer(p_hist->p_emrl, p_block, (size_t)EMRL_POOL_CHUNK_BYTES << order);
+		emrl_history_rebuffer(p_idle->p_emrl, p_hist->p_block, size);
+
+		held_remove(p_pool, p_hist);
+		p_idle->p_block = p_hist->p_block;
+		p_idle->order = p_hist->order;
+		held_add(p_pool, p_idle, false);
+	}
+	else
+	{
+		emrl_history_rebuffer(p_idle->p_emrl, NULL, 0);
+		emrl_history_rebuffer(p_hist->p_emrl, p_block, (size_t)EMRL_POOL_CHUNK_BYTES << order);
+		p_idle->p_block = NULL;
+	}
+
+	p_hist->p_block = p_block;
+	p_hist->order = order;
+	held_add(p_pool, p_hist, true);
+	++p_pool->stats.grown;
+}
+
+// Halve the block of a history, copying out the newest entries that fit in the lower half and back
+// in, and free the upper half
+static inline void halve(struct emrl_pool *p_pool, struct emrl_pool_history *p_hist)
+{
+	unsigned order = p_hist->order;
+	size_t half = (size_t)EMRL_POOL_CHUNK_BYTES << (order - 1);
+	emrl_history_rebuffer(p_hist->p_emrl, p_pool->scratch, half);
+	emrl_history_rebuffer(p_hist->p_emrl, p_hist->p_block, half);
+
+	held_remove(p_pool, p_hist);
+	p_hist->order = order - 1;
+	held_add(p_pool, p_hist, false);
+
+	struct emrl_pool_stats *p_stats = &p_pool->stats;
+	--p_stats->blocks[order];
+	++p_stats->blocks[order - 1];
+	p_stats->used_bytes -= half;
+	release(p_pool, block_chunk(p_pool, p_hist->p_block + half), order - 1);
+}
+
+static inline bool have_free(const struct emrl_pool *p_pool, unsigned order)
+{
+	for(; order <= p_pool->top; ++order)
+	{
+		if(0 != p_pool->free[order])
+			return true;
+	}
+
+	return false;
+}
+
+// Take the smallest free block of at least order, splitting off and freeing its upper halves
+// until it is the size wanted
+static inline char *alloc_order(struct emrl_pool *p_pool, unsigned order)
+{
+	struct emrl_pool_stats *p_stats = &p_pool->stats;
+	unsigned from = order;
+	while(from <= p_pool->top && 0 == p_pool->free[from])
+		++from;
+
+	if(from > p_pool->top)
+	{
+		++p_stats->failed;
+		return NULL;
+	}
+
+	uint32_t chunk = p_pool->free[from] - 1;
+	list_remove(p_pool, chunk, from);
+	while(from > order)
+	{
+		--from;
+		list_push(p_pool, chunk + (UINT32_C(1) << from), from);
+	}
+
+	++p_stats->allocs;
+	++p_stats->blocks[order];
+	p_stats->used_bytes += (size_t)EMRL_POOL_CHUNK_BYTES << order;
+	if(p_stats->used_bytes > p_stats->peak_bytes)
+		p_stats->peak_bytes = p_stats->used_bytes;
+
+	return p_pool->p_mem + (size_t)chunk * EMRL_POOL_CHUNK_BYTES;
+}
+
+static inline void free_order(struct emrl_pool *p_pool, uint32_t chunk, unsigned order)
+{
+	struct emrl_pool_stats *p_stats = &p_pool->stats;
+	assert(0 != p_stats->blocks[order]);
+
+	++p_stats->frees;
+	--p_stats->blocks[order];
+	p_stats->used_bytes -= (size_t)EMRL_POOL_CHUNK_BYTES << order;
+	release(p_pool, chunk, order);
+}
+
+// Put a block on its free list, first merging it with its buddy, the other half of the block of
+// twice the size, for as long as that is free too
+static inline void release(struct emrl_pool *p_pool, uint32_t chunk, unsigned order)
+{
+	while(order < p_pool->top)
+	{
+		uint32_t buddy = chunk ^ (UINT32_C(1) << order);
+		if((TAG_FREE | order) != p_pool->p_tags[buddy])
+			break;
+
+		list_remove(p_pool, buddy, order);
+		chunk &= ~(UINT32_C(1) << order);
+		++order;
+	}
+
+	list_push(p_pool, chunk, order);
+}
+
+static inline void list_push(struct emrl_pool *p_pool, uint32_t chunk, unsigned order)
+{
+	uint32_t next = p_pool->free[order];
+	link_set(p_pool, chunk, link_next, next);
+	link_set(p_pool, chunk, link_prev, 0);
+	if(0 != next)
+		link_set(p_pool, next - 1, link_prev, chunk + 1);
+
+	p_pool->free[order] = chunk + 1;
+	p_pool->p_tags[chunk] = TAG_FREE | order;
+}
+
+static inline void list_remove(struct emrl_pool *p_pool, uint32_t chunk, unsigned order)
+{
+	uint32_t next = link_get(p_pool, chunk, link_next);
+	uint32_t prev = link_get(p_pool, chunk, link_prev);
+	if(0 != prev)
+		link_set(p_pool, prev - 1, link_next, next);
+	else
+		p_pool->free[order] = next;
+
+	if(0 != next)
+		link_set(p_pool, next - 1, link_prev, prev);
+
+	p_pool->p_tags[chunk] = 0;
+}
+
+// Links are copied since the pool memory needn't be aligned
+static inline uint32_t link_get(const struct emrl_pool *p_pool, uint32_t chunk, enum link link)
+{
+	uint32_t value;
+	(void)memcpy(&value, p_pool->p_mem + (size_t)chunk * EMRL_POOL_CHUNK_BYTES + link * sizeof value,
+	             sizeof value);
+	return value;
+}
+
+static inline void link_set(struct emrl_pool *p_pool, uint32_t chunk, enum link link, uint32_t value)
+{
+	(void)memcpy(p_pool->p_mem + (size_t)chunk * EMRL_POOL_CHUNK_BYTES + link * sizeof value, &value,
+	             sizeof value);
+}
+
+static inline unsigned block_order(size_t size)
+{
+	unsigned order = 0;
+	while(order < EMRL_POOL_MAX_ORDERS - 1 && ((size_t)EMRL_POOL_CHUNK_BYTES << order) < size)
+		++order;
+
+	return order;
+}
+
+static inline uint32_t block_chunk(const struct emrl_pool *p_pool, const char *p_block)
+{
+	return (p_block - p_pool->p_mem) / EMRL_POOL_CHUNK_BYTES;
+}
+
+// Histories holding blocks of the same order, least recently used first. One that has just been
+// used goes last, one that has been halved goes first, having been the least recently used of the
+// larger blocks.
+static inline void held_add(struct emrl_pool *p_pool, struct emrl_pool_history *p_hist, bool recent)
+{
+	struct emrl_pool_history **pp_first = &p_pool->p_held[p_hist->order];
+	struct emrl_pool_history **pp_last = &p_pool->p_held_last[p_hist->order];
+	if(recent)
+	{
+		p_hist->p_prev = *pp_last;
+		p_hist->p_next = NULL;
+	}
+	else
+	{
+		p_hist->p_prev = NULL;
+		p_hist->p_next = *pp_first;
+	}
+
+	if(NULL != p_hist->p_prev)
+		p_hist->p_prev->p_next = p_hist;
+	else
+		*pp_first = p_hist;
+
+	if(NULL != p_hist->p_next)
+		p_hist->p_next->p_prev = p_hist;
+	else
+		*pp_last = p_hist;
+}
+
+static inline void held_remove(struct emrl_pool *p_pool, struct emrl_pool_history *p_hist)
+{
+	if(NULL != p_hist->p_prev)
+		p_hist->p_prev->p_next = p_hist->p_next;
+	else
+		p_pool->p_held[p_hist->order] = p_hist->p_next;
+
+	if(NULL != p_hist->p_next)
+		p_hist->p_next->p_prev = p_hist->p_prev;
+	else
+		p_pool->p_held_last[p_hist->order] = p_hist->p_prev;
+}
+#endif
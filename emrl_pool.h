@@ -0,0 +1,112 @@
+/*
+ * emrl_pool.h -- emrl history storage shared by many line editors
+ *
+ * Copyright (C) 2017 Graeme Hattan (graemeh.dev@gmail.com)
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef EMRL_POOL_H
+#define EMRL_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "emrl.h"
+
+#ifdef USE_HISTORY
+// Block sizes are EMRL_POOL_CHUNK_BYTES times a power of two, up to a slab of
+// EMRL_HISTORY_BUF_BYTES
+#define EMRL_POOL_SLAB_CHUNKS (EMRL_HISTORY_BUF_BYTES / EMRL_POOL_CHUNK_BYTES)
+#define EMRL_POOL_MAX_ORDERS 16
+
+// Pool memory for the given number of slabs, including a tag byte for each chunk
+#define EMRL_POOL_BYTES(slabs) ((slabs) * (EMRL_HISTORY_BUF_BYTES + EMRL_POOL_SLAB_CHUNKS))
+
+// Histories of many line editors, e.g. one per connection of a server, can share one pool of
+// memory rather than each having a buffer of EMRL_HISTORY_BUF_BYTES. A history starts with no
+// buffer and grows a block at a time as commands are added, so a session that is seldom used
+// holds little or nothing, e.g.
+//
+//     static int out(const char *p_str, emrl_file file) { return fputs(p_str, file); }
+//
+//     static char pool_mem[EMRL_POOL_BYTES(1000)];
+//     emrl_pool_init(&pool, pool_mem, sizeof pool_mem);
+//
+//     // Each session
+//     emrl_init(&p_session->emrl, out, p_session->file, "\r", p_session->cmd_buf,
+//               sizeof p_session->cmd_buf, NULL, 0);
+//     emrl_pool_attach(&pool, &p_session->hist, &p_session->emrl, 128);
+//     ...
+//     char *p_command = emrl_process_char(&p_session->emrl, chr);
+//     if(NULL != p_command)
+//         emrl_pool_add_to_history(&pool, &p_session->hist, p_command);
+//     ...
+//     emrl_pool_detach(&pool, &p_session->hist);
+//
+// The pool is a buddy allocator over slabs of EMRL_HISTORY_BUF_BYTES, each split in halves as far
+// as chunks of EMRL_POOL_CHUNK_BYTES. Allocating and freeing take time in proportion to the number
+// of block sizes, not the number of blocks, and nothing is ever taken from the C library heap.
+//
+// When a history can't grow because the pool is used up, memory is reclaimed from the least
+// recently used of the histories holding blocks at least the size needed, provided it has been
+// idle for longer than the history growing had been, so a busy session's history isn't taken by
+// one that is seldom used. A larger block is halved, keeping its newest entries, and a block of
+// the size needed is traded for the smaller one of the history growing. Any history may give up
+// memory to a history that has none. Each addition reclaims from at most one other history, once,
+// so the work done is bounded by the size of a slab. A history that still can't fit the command
+// after that drops its older entries.
+struct emrl_pool_history
+{
+	struct emrl_res *p_emrl;
+	struct emrl_pool_history *p_prev;	// Histories holding the same block size, least recently
+	struct emrl_pool_history *p_next;	// used first
+	char *p_block;						// NULL while no block is held
+	unsigned long used;					// Pool clock when last added to
+	uint8_t order;						// Block held is EMRL_POOL_CHUNK_BYTES << order bytes
+	uint8_t max_order;
+};
+
+// Counts since emrl_pool_init(), blocks of each size in use are indexed by order, see above
+struct emrl_pool_stats
+{
+	size_t total_bytes;
+	size_t used_bytes;
+	size_t peak_bytes;
+	size_t blocks[EMRL_POOL_MAX_ORDERS];
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long failed;				// Allocations the pool had no room for
+	unsigned long grown;				// Histories moved to a larger block
+	unsigned long reclaimed;			// Histories that gave up memory to another
+	unsigned long dropped;				// Additions that dropped older entries
+};
+
+struct emrl_pool
+{
+	char *p_mem;
+	uint8_t *p_tags;					// Per chunk, marks the first chunk of each free block
+	uint32_t chunks;
+	uint8_t top;						// Order of a slab
+	uint32_t free[EMRL_POOL_MAX_ORDERS];	// First free block of each order plus one, 0 if none
+	struct emrl_pool_history *p_held[EMRL_POOL_MAX_ORDERS];
+	struct emrl_pool_history *p_held_last[EMRL_POOL_MAX_ORDERS];
+	unsigned long clock;				// Counts additions to the histories
+	char scratch[EMRL_HISTORY_BUF_BYTES / 2];	// A history being halved is copied through here
+	struct emrl_pool_stats stats;
+};
+
+void emrl_pool_init(struct emrl_pool *p_pool, void *p_mem, size_t size);
+void *emrl_pool_alloc(struct emrl_pool *p_pool, size_t size);
+void emrl_pool_free(struct emrl_pool *p_pool, void *p_block, size_t size);
+const struct emrl_pool_stats *emrl_pool_stats(const struct emrl_pool *p_pool);
+void emrl_pool_attach(struct emrl_pool *p_pool, struct emrl_pool_history *p_hist,
+                      struct emrl_res *p_emrl, size_t max_size);
+void emrl_pool_detach(struct emrl_pool *p_pool, struct emrl_pool_history *p_hist);
+void emrl_pool_add_to_history(struct emrl_pool *p_pool, struct emrl_pool_history *p_hist,
+                              const char *p_command);
+#endif
+
+#endif	/* EMRL_POOL_H */
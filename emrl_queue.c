@@ -0,0 +1,174 @@
+/*
+ * emrl_queue.c -- emrl lock-free single producer, single consumer byte queue
+ *
+ * Copyright (C) 2017 Graeme Hattan (graemeh.dev@gmail.com)
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "emrl_queue.h"
+
+void emrl_queue_init(struct emrl_queue *p_q, char *buf, size_t size)
+{
+	assert(size >= 2);
+
+	p_q->buf = buf;
+	p_q->size = size;
+	atomic_init(&p_q->put, 0);
+	atomic_init(&p_q->get, 0);
+	atomic_init(&p_q->overflows, 0);
+}
+
+// Producer side, safe to call from an interrupt handler. If the queue is full the byte is not
+// stored, the overflow count is incremented and false is returned.
+bool emrl_isr_push(struct emrl_queue *p_q, char chr)
+{
+	size_t put = atomic_load_explicit(&p_q->put, memory_order_relaxed);
+	size_t next = put + 1;
+	if(next == p_q->size)
+		next = 0;
+
+	if(next == atomic_load_explicit(&p_q->get, memory_order_acquire))
+	{
+		// Only the producer writes the count, no need for a read-modify-write
+		unsigned overflows = atomic_load_explicit(&p_q->overflows, memory_order_relaxed);
+		atomic_store_explicit(&p_q->overflows, overflows + 1, memory_order_relaxed);
+		return false;
+	}
+
+	p_q->buf[put] = chr;
+
+	// Release ordering publishes the byte before the index
+	atomic_store_explicit(&p_q->put, next, memory_order_release);
+	return true;
+}
+
+// Producer side, queues all of the data or none of it. Returns false without counting an overflow
+// if there isn't enough space.
+bool emrl_queue_write(struct emrl_queue *p_q, const char *p_data, size_t len)
+{
+	size_t put = atomic_load_explicit(&p_q->put, memory_order_relaxed);
+	size_t get = atomic_load_explicit(&p_q->get, memory_order_acquire);
+
+	size_t space = (get > put) ? (get - put - 1) : (p_q->size - put + get - 1);
+	if(len > space)
+		return false;
+
+	// Copy in up to two pieces, wrapping at the end of the buffer
+	size_t to_end = p_q->size - put;
+	if(len >= to_end)
+	{
+		(void)memcpy(p_q->buf + put, p_data, to_end);
+		(void)memcpy(p_q->buf, p_data + to_end, len - to_end);
+		put = len - to_end;
+	}
+	else
+	{
+		(void)memcpy(p_q->buf + put, p_data, len);
+		put += len;
+	}
+
+	atomic_store_explicit(&p_q->put, put, memory_order_release);
+	return true;
+}
+
+// Producer side, queues a line with its terminator, all of it or none of it. A pair of queues
+// can carry lines between threads, e.g. commands to a worker thread and their output back.
+bool emrl_queue_put_line(struct emrl_queue *p_q, const char *p_line)
+{
+	return emrl_queue_write(p_q, p_line, strlen(p_line) + 1);
+}
+
+// Consumer side, takes the oldest line queued by emrl_queue_put_line() into p_buf and returns it,
+// or returns NULL if the queue is empty. A line too long for the buffer is cut short.
+char *emrl_queue_get_line(struct emrl_queue *p_q, char *p_buf, size_t size)
+{
+	assert(size >= 1);
+
+	size_t put = atomic_load_explicit(&p_q->put, memory_order_acquire);
+	size_t get = atomic_load_explicit(&p_q->get, memory_order_relaxed);
+	if(get == put)
+		return NULL;
+
+	// Lines are queued whole, so the terminator is already there
+	size_t len = 0;
+	while(get != put)
+	{
+		char chr = p_q->buf[get];
+		if(++get == p_q->size)
+			get = 0;
+
+		if('\0' == chr)
+			break;
+
+		if(len + 1 < size)
+			p_buf[len++] = chr;
+	}
+
+	p_buf[len] = '\0';
+	atomic_store_explicit(&p_q->get, get, memory_order_release);
+	return p_buf;
+}
+
+// Consumer side, feeds queued bytes to emrl until a line is completed or the queue is empty.
+// Bytes are passed on in contiguous spans and the consumer index is published once per batch
+// rather than for every byte. Any bytes remaining after a completed line stay queued for the next
+// call. In machine mode with a full line queue emrl may take no input at all, holding a line at
+// its delimiter or a streamed chunk. NULL is then returned with the input left queued, and
+// emrl_pop_line() must make room before calling again.
+char *emrl_queue_process(struct emrl_queue *p_q, struct emrl_res *p_emrl)
+{
+	size_t put = atomic_load_explicit(&p_q->put, memory_order_acquire);
+	size_t get = atomic_load_explicit(&p_q->get, memory_order_relaxed);
+	char *p_command = NULL;
+
+	while(get != put && NULL == p_command)
+	{
+		size_t span = (put > get) ? (put - get) : (p_q->size - get);
+		size_t used;
+		p_command = emrl_process_buf(p_emrl, p_q->buf + get, span, &used);
+
+		// The line queue is full, nothing more can be taken until a line is popped
+		if(0 == used)
+			break;
+
+		get += used;
+		if(get == p_q->size)
+			get = 0;
+	}
+
+	atomic_store_explicit(&p_q->get, get, memory_order_release);
+	return p_command;
+}
+
+// Consumer side, gives the longest contiguous span of queued data without removing it. The span
+// remains valid until it is released.
+size_t emrl_queue_acquire(struct emrl_queue *p_q, const char **pp_span)
+{
+	size_t put = atomic_load_explicit(&p_q->put, memory_order_acquire);
+	size_t get = atomic_load_explicit(&p_q->get, memory_order_relaxed);
+
+	*pp_span = p_q->buf + get;
+	return (put >= get) ? (put - get) : (p_q->size - get);
+}
+
+// Consumer side, removes len bytes from the queue once they have been sent. Safe to call from a
+// transfer complete interrupt handler.
+void emrl_queue_release(struct emrl_queue *p_q, size_t len)
+{
+	size_t get = atomic_load_explicit(&p_q->get, memory_order_relaxed) + len;
+	if(get >= p_q->size)
+		get -= p_q->size;
+
+	atomic_store_explicit(&p_q->get, get, memory_order_release);
+}
+
+// Total number of bytes refused by emrl_isr_push() since initialisation
+unsigned emrl_queue_overflows(const struct emrl_queue *p_q)
+{
+	return atomic_load_explicit(&p_q->overflows, memory_order_relaxed);
+}
@@ -0,0 +1,75 @@
+/*
+ * emrl_queue.h -- emrl lock-free single producer, single consumer byte queue
+ *
+ * Copyright (C) 2017 Graeme Hattan (graemeh.dev@gmail.com)
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef EMRL_QUEUE_H
+#define EMRL_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "emrl.h"
+
+// The producer and consumer each own one index, the other side only reads it. No locks are taken
+// and interrupts need not be disabled, so the producer may be an interrupt handler, e.g.
+//
+//     void uart_rx_isr(void)
+//     {
+//         (void)emrl_isr_push(&rx_queue, UART->DATA);
+//     }
+//
+//     // Main loop
+//     char *p_command = emrl_queue_process(&rx_queue, &emrl);
+//
+// The same queue can carry emrl output to a DMA driven transmitter. emrl is then the producer,
+// copying output straight into the queue (see emrl_set_tx_queue()), and the transmitter sends
+// contiguous spans in place, e.g.
+//
+//     void uart_tx_kick(emrl_file file)
+//     {
+//         if(!dma_busy())
+//         {
+//             const char *p_span;
+//             size_t len = emrl_queue_acquire(&tx_queue, &p_span);
+//             if(len > 0)
+//                 dma_start(p_span, len);
+//         }
+//     }
+//
+//     void dma_complete_isr(size_t len)
+//     {
+//         emrl_queue_release(&tx_queue, len);
+//         uart_tx_kick(NULL);
+//     }
+//
+// Lines can be passed whole with emrl_queue_put_line() and emrl_queue_get_line(), e.g. from the
+// main loop to a worker thread running commands, and their output back to be printed above the
+// line being edited.
+//
+// One byte of the buffer is always left unused to tell a full queue from an empty one.
+struct emrl_queue
+{
+	char *buf;
+	size_t size;
+	atomic_size_t put;				// Written by the producer only
+	atomic_size_t get;				// Written by the consumer only
+	atomic_uint overflows;			// Written by the producer only
+};
+
+void emrl_queue_init(struct emrl_queue *p_q, char *buf, size_t size);
+bool emrl_isr_push(struct emrl_queue *p_q, char chr);
+bool emrl_queue_write(struct emrl_queue *p_q, const char *p_data, size_t len);
+bool emrl_queue_put_line(struct emrl_queue *p_q, const char *p_line);
+char *emrl_queue_get_line(struct emrl_queue *p_q, char *p_buf, size_t size);
+char *emrl_queue_process(struct emrl_queue *p_q, struct emrl_res *p_emrl);
+size_t emrl_queue_acquire(struct emrl_queue *p_q, const char **pp_span);
+void emrl_queue_release(struct emrl_queue *p_q, size_t len);
+unsigned emrl_queue_overflows(const struct emrl_queue *p_q);
+
+#endif	/* EMRL_QUEUE_H */
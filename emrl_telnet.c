@@ -0,0 +1,296 @@
+/*
+ * emrl_telnet.c -- emrl telnet protocol input filter
+ *
+ * Copyright (C) 2017 Graeme Hattan (graemeh.dev@gmail.com)
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include <string.h>
+
+#include "emrl_telnet.h"
+
+#define SEND(seq) (void)p_tn->write(seq, sizeof seq - 1, p_tn->file)
+
+// Commands (RFC 854)
+#define TN_SE 240
+#define TN_SB 250
+#define TN_WILL 251
+#define TN_WONT 252
+#define TN_DO 253
+#define TN_DONT 254
+#define TN_IAC 255
+
+// Options
+#define TN_OPT_ECHO 1
+#define TN_OPT_SGA 3
+#define TN_OPT_NAWS 31
+#define TN_OPT_LINEMODE 34
+
+// Sequences are sent with their lengths, a reply about option 0 (TRANSMIT-BINARY) holds a zero byte
+#define SEQ_WILL_ECHO "\377\373\001"
+#define SEQ_WONT_ECHO "\377\374\001"
+#define SEQ_WILL_SGA "\377\373\003"
+#define SEQ_WONT_SGA "\377\374\003"
+#define SEQ_DO_NAWS "\377\375\037"
+#define SEQ_DO_LINEMODE "\377\375\042"
+#define SEQ_LINEMODE_EDIT "\377\372\042\001\001\377\360"		// SB LINEMODE MODE EDIT IAC SE
+
+static inline char *copy_data(struct emrl_telnet *p_tn, char *p_out, const char *p_in, size_t len);
+static inline void process_option(struct emrl_telnet *p_tn, unsigned char opt);
+static inline void process_subnegotiation(struct emrl_telnet *p_tn);
+
+void emrl_telnet_init(struct emrl_telnet *p_tn, emrl_telnet_write_func write, emrl_file file)
+{
+	p_tn->write = write;
+	p_tn->file = file;
+	p_tn->state = emrl_telnet_data;
+	p_tn->verb = 0;
+	p_tn->cr = false;
+	p_tn->local_edit = false;
+	p_tn->echo = false;
+	p_tn->sga = false;
+	p_tn->width = p_tn->height = 0;
+	p_tn->sb_len = 0;
+}
+
+// Send our initial negotiation. We echo and don't need go-aheads (character at a time mode), but
+// would like window size updates and for the client to do its own line editing if it can.
+void emrl_telnet_start(struct emrl_telnet *p_tn)
+{
+	p_tn->echo = true;
+	p_tn->sga = true;
+	SEND(SEQ_WILL_ECHO SEQ_WILL_SGA SEQ_DO_NAWS SEQ_DO_LINEMODE);
+}
+
+// Remove telnet commands from the received data in p_buf, returning the length of the data that
+// remains. Commands split across calls are handled. Data is moved in runs between IAC bytes,
+// so ordinary input costs little more than a memchr.
+size_t emrl_telnet_filter(struct emrl_telnet *p_tn, char *p_buf, size_t len)
+{
+	const char *p_in = p_buf;
+	const char *p_end = p_buf + len;
+	char *p_out = p_buf;
+
+	while(p_in < p_end)
+	{
+		if(emrl_telnet_data == p_tn->state)
+		{
+			const char *p_iac = memchr(p_in, TN_IAC, p_end - p_in);
+			const char *p_run_end = (NULL != p_iac) ? p_iac : p_end;
+
+			p_out = copy_data(p_tn, p_out, p_in, p_run_end - p_in);
+			p_in = p_run_end;
+
+			if(NULL != p_iac)
+			{
+				++p_in;
+				p_tn->state = emrl_telnet_iac;
+			}
+
+			continue;
+		}
+
+		unsigned char chr = *p_in++;
+		switch(p_tn->state)
+		{
+			case emrl_telnet_iac:
+				switch(chr)
+				{
+					case TN_IAC:
+						// Escaped 0xff data byte
+						*p_out++ = (char)chr;
+						p_tn->cr = false;
+						p_tn->state = emrl_telnet_data;
+						break;
+
+					case TN_WILL:
+					case TN_WONT:
+					case TN_DO:
+					case TN_DONT:
+						p_tn->verb = chr;
+						p_tn->state = emrl_telnet_option;
+						break;
+
+					case TN_SB:
+						p_tn->sb_len = 0;
+						p_tn->state = emrl_telnet_sb;
+						break;
+
+					default:
+						// NOP, GA etc. nothing to do
+						p_tn->state = emrl_telnet_data;
+						break;
+				}
+				break;
+
+			case emrl_telnet_option:
+				process_option(p_tn, chr);
+				p_tn->state = emrl_telnet_data;
+				break;
+
+			case emrl_telnet_sb:
+				if(TN_IAC == chr)
+					p_tn->state = emrl_telnet_sb_iac;
+				else if(p_tn->sb_len < sizeof p_tn->sb_buf)
+					p_tn->sb_buf[p_tn->sb_len++] = chr;
+				break;
+
+			case emrl_telnet_sb_iac:
+				if(TN_SE == chr)
+				{
+					process_subnegotiation(p_tn);
+					p_tn->state = emrl_telnet_data;
+				}
+				else
+				{
+					// IAC IAC is an escaped 0xff, anything else is a protocol error so just carry on
+					if(TN_IAC == chr && p_tn->sb_len < sizeof p_tn->sb_buf)
+						p_tn->sb_buf[p_tn->sb_len++] = chr;
+
+					p_tn->state = emrl_telnet_sb;
+				}
+				break;
+
+			default:
+				p_tn->state = emrl_telnet_data;
+				break;
+		}
+	}
+
+	return p_out - p_buf;
+}
+
+static inline char *copy_data(struct emrl_telnet *p_tn, char *p_out, const char *p_in, size_t len)
+{
+	if(0 == len)
+		return p_out;
+
+	(void)memmove(p_out, p_in, len);
+	char *p_end = p_out + len;
+
+	// A bare carriage return is sent as CR NUL, drop the NUL. These are rare in interactive input,
+	// so search for NULs in bulk rather than checking every byte.
+	char *p_scan = p_out;
+	bool cr = p_tn->cr;
+	while(p_scan < p_end)
+	{
+		char *p_nul = memchr(p_scan, '\0', p_end - p_scan);
+		if(NULL == p_nul)
+			break;
+
+		if(p_nul > p_scan)
+			cr = ('\r' == p_nul[-1]);
+
+		if(cr)
+		{
+			--p_end;
+			(void)memmove(p_nul, p_nul + 1, p_end - p_nul);
+			p_scan = p_nul;
+		}
+		else
+		{
+			p_scan = p_nul + 1;
+		}
+
+		cr = false;
+	}
+
+	p_tn->cr = (p_end > p_out) ? ('\r' == p_end[-1]) : cr;
+	return p_end;
+}
+
+// Options we offer are only acknowledged when they change, so that neither side ends up answering
+// the other's acknowledgements (RFC 854)
+static inline void process_option(struct emrl_telnet *p_tn, unsigned char opt)
+{
+	char reply[3] = { (char)TN_IAC, 0, (char)opt };
+
+	switch(p_tn->verb)
+	{
+		case TN_WILL:
+			if(TN_OPT_LINEMODE == opt)
+			{
+				// Client will edit lines locally, stop echoing so it can echo for itself
+				if(!p_tn->local_edit)
+				{
+					p_tn->local_edit = true;
+					SEND(SEQ_LINEMODE_EDIT);
+					if(p_tn->echo)
+					{
+						p_tn->echo = false;
+						SEND(SEQ_WONT_ECHO);
+					}
+				}
+			}
+			else if(TN_OPT_NAWS != opt)
+			{
+				reply[1] = (char)TN_DONT;
+				(void)p_tn->write(reply, sizeof reply, p_tn->file);
+			}
+			break;
+
+		case TN_WONT:
+			if(TN_OPT_LINEMODE == opt && p_tn->local_edit)
+			{
+				p_tn->local_edit = false;
+				if(!p_tn->echo)
+				{
+					p_tn->echo = true;
+					SEND(SEQ_WILL_ECHO);
+				}
+			}
+			break;
+
+		case TN_DO:
+			if(TN_OPT_ECHO == opt && !p_tn->local_edit)
+			{
+				if(!p_tn->echo)
+				{
+					p_tn->echo = true;
+					SEND(SEQ_WILL_ECHO);
+				}
+			}
+			else if(TN_OPT_SGA == opt)
+			{
+				if(!p_tn->sga)
+				{
+					p_tn->sga = true;
+					SEND(SEQ_WILL_SGA);
+				}
+			}
+			else if(TN_OPT_ECHO != opt)
+			{
+				reply[1] = (char)TN_WONT;
+				(void)p_tn->write(reply, sizeof reply, p_tn->file);
+			}
+			// Echo was already refused while the client edits lines itself
+			break;
+
+		default:
+			// DONT, neither ECHO nor SGA is essential. A client that refuses our echo echoes for
+			// itself, options that aren't enabled need no reply.
+			if(TN_OPT_ECHO == opt && p_tn->echo)
+			{
+				p_tn->echo = false;
+				SEND(SEQ_WONT_ECHO);
+			}
+			else if(TN_OPT_SGA == opt && p_tn->sga)
+			{
+				p_tn->sga = false;
+				SEND(SEQ_WONT_SGA);
+			}
+			break;
+	}
+}
+
+static inline void process_subnegotiation(struct emrl_telnet *p_tn)
+{
+	// NAWS gives 16 bit width then height, both big endian (RFC 1073)
+	if(p_tn->sb_len >= 5 && TN_OPT_NAWS == p_tn->sb_buf[0])
+	{
+		p_tn->width = (unsigned)p_tn->sb_buf[1] << 8 | p_tn->sb_buf[2];
+		p_tn->height = (unsigned)p_tn->sb_buf[3] << 8 | p_tn->sb_buf[4];
+	}
+}
@@ -0,0 +1,56 @@
+/*
+ * emrl_telnet.h -- emrl telnet protocol input filter
+ *
+ * Copyright (C) 2017 Graeme Hattan (graemeh.dev@gmail.com)
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef EMRL_TELNET_H
+#define EMRL_TELNET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "emrl.h"
+
+enum emrl_telnet_state
+{
+	emrl_telnet_data,
+	emrl_telnet_iac,
+	emrl_telnet_option,
+	emrl_telnet_sb,
+	emrl_telnet_sb_iac
+};
+
+// Sends len bytes of negotiation, which may include zero bytes, returns a negative value on failure
+typedef int (*emrl_telnet_write_func)(const char *p_data, size_t len, emrl_file file);
+
+// Sits between a telnet connection and emrl_process_char(). Received data is filtered in place,
+// removing telnet commands and answering option negotiation through write. The client's window
+// size is tracked if it supports NAWS. If the client accepts LINEMODE it edits and echoes lines
+// locally and local_edit is set. echo is clear whenever the client echoes for itself, because of
+// LINEMODE or because it refused our ECHO, the caller should then discard emrl's echo output.
+
+struct emrl_telnet
+{
+	emrl_telnet_write_func write;
+	emrl_file file;
+	enum emrl_telnet_state state;
+	unsigned char verb;
+	bool cr;
+	bool local_edit;
+	bool echo;
+	bool sga;
+	unsigned width;
+	unsigned height;
+	size_t sb_len;
+	unsigned char sb_buf[8];
+};
+
+void emrl_telnet_init(struct emrl_telnet *p_tn, emrl_telnet_write_func write, emrl_file file);
+void emrl_telnet_start(struct emrl_telnet *p_tn);
+size_t emrl_telnet_filter(struct emrl_telnet *p_tn, char *p_buf, size_t len);
+
+#endif	/* EMRL_TELNET_H */
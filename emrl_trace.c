@@ -0,0 +1,70 @@
+/*
+ * emrl_trace.c -- emrl lock-free event trace ring
+ *
+ * Copyright (C) 2017 Graeme Hattan (graemeh.dev@gmail.com)
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+
+#include "emrl_trace.h"
+
+// The record count must be a power of two
+void emrl_trace_init(struct emrl_trace *p_trace, struct emrl_trace_record *records, unsigned count)
+{
+	assert(count > 0 && 0 == (count & (count - 1)));
+
+	p_trace->records = records;
+	p_trace->mask = count - 1;
+	atomic_init(&p_trace->put, 0);
+	atomic_init(&p_trace->get, 0);
+	atomic_init(&p_trace->dropped, 0);
+}
+
+// Producer side. Indexes run freely and are masked on use, so all of the records can be filled.
+void emrl_trace_write(struct emrl_trace *p_trace, emrl_cycles time, enum emrl_trace_event event,
+                      char chr, unsigned arg)
+{
+	unsigned put = atomic_load_explicit(&p_trace->put, memory_order_relaxed);
+	unsigned get = atomic_load_explicit(&p_trace->get, memory_order_acquire);
+
+	if(put - get > p_trace->mask)
+	{
+		// Only the producer writes the count, no need for a read-modify-write
+		unsigned dropped = atomic_load_explicit(&p_trace->dropped, memory_order_relaxed);
+		atomic_store_explicit(&p_trace->dropped, dropped + 1, memory_order_relaxed);
+		return;
+	}
+
+	struct emrl_trace_record *p_record = &p_trace->records[put & p_trace->mask];
+	p_record->time = time;
+	p_record->arg = (arg > UINT16_MAX) ? UINT16_MAX : arg;
+	p_record->event = event;
+	p_record->chr = chr;
+
+	// Release ordering publishes the record before the index
+	atomic_store_explicit(&p_trace->put, put + 1, memory_order_release);
+}
+
+// Consumer side, returns false if there are no records to read
+bool emrl_trace_read(struct emrl_trace *p_trace, struct emrl_trace_record *p_record)
+{
+	unsigned get = atomic_load_explicit(&p_trace->get, memory_order_relaxed);
+	if(get == atomic_load_explicit(&p_trace->put, memory_order_acquire))
+		return false;
+
+	*p_record = p_trace->records[get & p_trace->mask];
+
+	// Release ordering ensures the record is copied before the producer may reuse it
+	atomic_store_explicit(&p_trace->get, get + 1, memory_order_release);
+	return true;
+}
+
+// Number of records lost because the ring was full
+unsigned emrl_trace_dropped(const struct emrl_trace *p_trace)
+{
+	return atomic_load_explicit(&p_trace->dropped, memory_order_relaxed);
+}
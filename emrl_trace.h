@@ -0,0 +1,57 @@
+/*
+ * emrl_trace.h -- emrl lock-free event trace ring
+ *
+ * Copyright (C) 2017 Graeme Hattan (graemeh.dev@gmail.com)
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+
+#ifndef EMRL_TRACE_H
+#define EMRL_TRACE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "emrl_config.h"
+
+enum emrl_trace_event
+{
+	emrl_trace_char,				// chr is the first character received, arg the number received
+	emrl_trace_escape,				// chr is the final byte, arg is 1 if the sequence was known, or
+									// chr is '\0' for a sequence dropped by the escape timeout
+	emrl_trace_history,				// chr is 'A' (older) or 'B' (newer), arg is 0 on leaving history,
+									// or 'C' with the suggestion taken into the line
+	emrl_trace_render,				// arg is the number of bytes output by the API call
+	emrl_trace_line					// arg is the length of the line returned
+};
+
+struct emrl_trace_record
+{
+	emrl_cycles time;
+	uint16_t arg;
+	uint8_t event;
+	char chr;
+};
+
+// Records are written by emrl when built with USE_TRACE (see emrl_set_trace()) and read by a
+// consumer which may run in another thread, or write them out from a low priority task. As with
+// emrl_queue each side owns one index. Records are dropped rather than overwritten when the ring
+// is full, so a slow reader sees a gap, counted by emrl_trace_dropped(), rather than torn records.
+struct emrl_trace
+{
+	struct emrl_trace_record *records;
+	unsigned mask;
+	atomic_uint put;				// Written by the producer only
+	atomic_uint get;				// Written by the consumer only
+	atomic_uint dropped;			// Written by the producer only
+};
+
+void emrl_trace_init(struct emrl_trace *p_trace, struct emrl_trace_record *records, unsigned count);
+void emrl_trace_write(struct emrl_trace *p_trace, emrl_cycles time, enum emrl_trace_event event,
+                      char chr, unsigned arg);
+bool emrl_trace_read(struct emrl_trace *p_trace, struct emrl_trace_record *p_record);
+unsigned emrl_trace_dropped(const struct emrl_trace *p_trace);
+
+#endif	/* EMRL_TRACE_H */
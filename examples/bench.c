@@ -0,0 +1,190 @@
+// emrl throughput benchmarks
+//
+// usage: bench [iterations]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "emrl.h"
+
+
+#define DEFAULT_ITERATIONS	20000
+#define HIGHLIGHT_SPANS		16
+
+struct input
+{
+	const char *name;
+	const char *data;
+};
+
+static const struct input inputs[] =
+{
+	{
+		// Pasted text, long runs of printable characters
+		"paste",
+		"set banner \"Welcome to the device console, unauthorised access is prohibited\"\r"
+		"route add 192.168.100.0/24 via 10.0.0.1 dev eth0 metric 100 table main\r"
+		"log filter add level=debug module=uart,spi,i2c,dma,timer,adc dest=ring\r"
+	},
+	{
+		// Scripted interactive use, short runs with editing and history recall
+		"script",
+		"show interfaces\r"
+		"set speed 115200\033[D\033[D\033[D\b9\r"
+		"\033[A\033[A\033[C\033[C\r"
+		"reset counters\033[D\033[D\033[D\033[3~\r"
+	}
+};
+
+static unsigned long long out_bytes;
+
+static int count_puts(const char *p_str, emrl_file file)
+{
+	(void)file;
+	out_bytes += strlen(p_str);
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Command word in one colour, numeric arguments in another
+static size_t highlight(void *p_ctx, const char *p_line, size_t len, struct emrl_span *p_spans, size_t max_spans)
+{
+	(void)p_ctx;
+
+	size_t count = 0;
+	size_t pos = 0;
+	while(pos < len && count < max_spans)
+	{
+		while(pos < len && ' ' == p_line[pos])
+			++pos;
+
+		size_t start = pos;
+		bool number = true;
+		while(pos < len && ' ' != p_line[pos])
+			number &= (0 != isdigit((unsigned char)p_line[pos++]));
+
+		if(start == pos)
+			break;
+
+		if(0 == start || number)
+		{
+			p_spans[count].start = start;
+			p_spans[count].len = pos - start;
+			p_spans[count].attr = (0 == start) ? 1 : 2;
+			++count;
+		}
+	}
+
+	return count;
+}
+
+static void init(struct emrl_res *p_emrl, bool highlighted)
+{
+	static char cmd_buf[EMRL_MAX_CMD_LEN + 1];
+	static char hist_buf[EMRL_HISTORY_BUF_BYTES];
+	emrl_init(p_emrl, count_puts, NULL, "\r", cmd_buf, sizeof cmd_buf, hist_buf, sizeof hist_buf);
+	out_bytes = 0;
+
+	if(highlighted)
+	{
+		static const char *const sgr[] = { "", "1;32", "36" };
+		static struct emrl_span spans[HIGHLIGHT_SPANS];
+		static uint8_t shown[sizeof cmd_buf];
+		static struct emrl_highlight hl;
+		emrl_highlight_init(&hl, highlight, NULL, sgr, spans, HIGHLIGHT_SPANS, shown);
+		emrl_set_highlight(p_emrl, &hl);
+	}
+}
+
+static void feed_char(struct emrl_res *p_emrl, const char *p_data, size_t len)
+{
+	for(size_t i = 0; i < len; ++i)
+	{
+		const char *p_command = emrl_process_char(p_emrl, p_data[i]);
+		if(NULL != p_command && '\0' != *p_command)
+			emrl_add_to_history(p_emrl, p_command);
+	}
+}
+
+static void feed_buf(struct emrl_res *p_emrl, const char *p_data, size_t len)
+{
+	while(len > 0)
+	{
+		size_t used;
+		const char *p_command = emrl_process_buf(p_emrl, p_data, len, &used);
+		if(NULL != p_command && '\0' != *p_command)
+			emrl_add_to_history(p_emrl, p_command);
+
+		p_data += used;
+		len -= used;
+	}
+}
+
+// Baseline for machine mode, copying lines out of the input costs at least this much
+static void feed_memcpy(struct emrl_res *p_emrl, const char *p_data, size_t len)
+{
+	static char copy[1024];
+	(void)p_emrl;
+
+	while(len > 0)
+	{
+		size_t copy_len = (len > sizeof copy) ? sizeof copy : len;
+		(void)memcpy(copy, p_data, copy_len);
+		p_data += copy_len;
+		len -= copy_len;
+	}
+}
+
+static void run(const char *name,
+                void (*feed)(struct emrl_res *, const char *, size_t),
+                bool machine,
+                bool highlighted,
+                const struct input *p_input,
+                unsigned long iterations)
+{
+	struct emrl_res emrl;
+	init(&emrl, highlighted);
+	emrl_set_machine_mode(&emrl, machine);
+
+	size_t len = strlen(p_input->data);
+	double start = now();
+	for(unsigned long i = 0; i < iterations; ++i)
+		feed(&emrl, p_input->data, len);
+
+	double sec = now() - start;
+	printf("%-8s %-20s %8.1f ns/byte %10.1f MB/s %12llu bytes out\n",
+	       p_input->name,
+	       name,
+	       sec * 1e9 / ((double)len * iterations),
+	       (double)len * iterations / sec / 1e6,
+	       out_bytes);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iterations = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_ITERATIONS;
+
+	for(size_t i = 0; i < sizeof inputs / sizeof inputs[0]; ++i)
+	{
+		run("emrl_process_char", feed_char, false, false, &inputs[i], iterations);
+		run("emrl_process_buf", feed_buf, false, false, &inputs[i], iterations);
+		run("highlighted char", feed_char, false, true, &inputs[i], iterations);
+		run("highlighted buf", feed_buf, false, true, &inputs[i], iterations);
+		run("machine mode", feed_buf, true, false, &inputs[i], iterations);
+		run("memcpy", feed_memcpy, false, false, &inputs[i], iterations);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+// Compare the C++ wrapper (inlined sink) against the plain C function pointer output path
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "emrl.hpp"
+
+
+#define DEFAULT_ITERATIONS	200000
+
+// Typing, in-line editing, history recall and line completion
+static const char script[] =
+	"show interfaces verbose\r"
+	"set speed 115200\033[D\033[D\033[D\b9\r"
+	"\033[A\033[A\033[C\033[C\r"
+	"reset counters\033[D\033[D\033[D\033[3~\r";
+
+static std::size_t c_bytes;
+
+static int count_puts(const char *p_str, emrl_file file)
+{
+	(void)file;
+	c_bytes += std::strlen(p_str);
+	return 0;
+}
+
+struct count_sink
+{
+	std::size_t bytes = 0;
+
+	void operator()(const char *p_str)
+	{
+		bytes += std::strlen(p_str);
+	}
+};
+
+template<typename Func>
+static double time_ns_per_char(unsigned long iterations, Func func)
+{
+	auto start = std::chrono::steady_clock::now();
+	for(unsigned long i = 0; i < iterations; ++i)
+		func();
+
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count() / (iterations * (sizeof script - 1));
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iterations = (argc > 1) ? std::strtoul(argv[1], nullptr, 0) : DEFAULT_ITERATIONS;
+
+	static char cmd_buf[EMRL_MAX_CMD_LEN + 1];
+	static char hist_buf[EMRL_HISTORY_BUF_BYTES];
+	emrl_res c_emrl;
+	emrl_init(&c_emrl, count_puts, nullptr, "\r", cmd_buf, sizeof cmd_buf, hist_buf, sizeof hist_buf);
+
+	// Both sides take input through emrl_process_buf(), so only the output path differs
+	double c_ns = time_ns_per_char(iterations, [&]() {
+		std::size_t len = sizeof script - 1;
+		const char *p = script;
+		while(len > 0)
+		{
+			std::size_t used;
+			const char *p_line = emrl_process_buf(&c_emrl, p, len, &used);
+			if(nullptr != p_line)
+				emrl_add_to_history(&c_emrl, p_line);
+
+			p += used;
+			len -= used;
+		}
+	});
+
+	static emrl::line_editor<EMRL_MAX_CMD_LEN, EMRL_HISTORY_BUF_BYTES, count_sink> cpp_emrl("\r");
+
+	double cpp_ns = time_ns_per_char(iterations, [&]() {
+		std::size_t len = sizeof script - 1;
+		const char *p = script;
+		while(len > 0)
+		{
+			std::size_t used;
+			const char *p_line = cpp_emrl.process(p, len, used);
+			if(nullptr != p_line)
+				cpp_emrl.add_to_history(p_line);
+
+			p += used;
+			len -= used;
+		}
+	});
+
+	std::printf("%lu iterations of %zu byte script\n", iterations, sizeof script - 1);
+	std::printf("function pointer sink: %6.1f ns/char (%zu bytes out)\n", c_ns, c_bytes);
+	std::printf("inlined functor sink:  %6.1f ns/char (%zu bytes out)\n", cpp_ns, cpp_emrl.sink().bytes);
+
+	return (c_bytes == cpp_emrl.sink().bytes) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,371 @@
+// Line editing sessions on a unix socket, each run by a C++20 coroutine and resumed from an epoll
+// loop as input arrives. Connect with e.g.
+//
+//     socat -,raw,echo=0 unix-connect:/tmp/emrl-coro-socket
+//
+// Sessions and their coroutine frames live in static storage, nothing is allocated on the heap
+// after start up.
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "emrl_coro.hpp"
+
+
+#define DEFAULT_SOCKET_PATH		"/tmp/emrl-coro-socket"
+#define PROMPT					"coro> "
+#define MAX_SESSIONS			16
+#define ARENA_BYTES				1024
+#define OUT_BYTES				4096
+#define READ_BYTES				512
+
+struct connection;
+
+// Appends output to the connection's buffer, which is written out after each batch of input
+struct socket_sink
+{
+	connection *p_conn;
+
+	int operator()(const char *p_str);
+};
+
+typedef emrl::line_reader<EMRL_MAX_CMD_LEN, EMRL_HISTORY_BUF_BYTES, socket_sink> reader_type;
+
+struct connection
+{
+	connection(int fd, const char *delim)
+		: fd(fd), reader(delim, socket_sink{this}), arena(arena_buf, sizeof arena_buf)
+	{
+	}
+
+	~connection()
+	{
+		(void)close(fd);
+	}
+
+	int fd;
+	bool want_out = false;
+	std::size_t out_len = 0;
+	char out[OUT_BYTES];
+	reader_type reader;
+	alignas(std::max_align_t) unsigned char arena_buf[ARENA_BYTES];
+	emrl::arena arena;
+	emrl::session session;
+};
+
+static std::optional<connection> connections[MAX_SESSIONS];
+static unsigned long lines_handled;
+
+static volatile sig_atomic_t stop;
+
+
+static void signal_stop(int sig);
+static int listen_unix(const char *p_path);
+static void accept_connections(int epoll_fd, int listen_fd, const char *delim);
+static void handle_input(connection &conn);
+static bool flush_output(connection &conn);
+static void update_events(int epoll_fd, connection &conn, unsigned slot);
+static void print(connection &conn, const char *p_str);
+static emrl::session shell(connection &conn);
+
+int main(int argc, char *argv[])
+{
+	const char *p_path = DEFAULT_SOCKET_PATH;
+	const char *delim = "\r";
+
+	int opt;
+	while((opt = getopt(argc, argv, "ns:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'n':
+				// Line buffered clients such as nc send a new line rather than a carriage return
+				delim = "\n";
+				break;
+
+			case 's':
+				p_path = optarg;
+				break;
+
+			default:
+				(void)fprintf(stderr, "usage: %s: [-n] [-s socket_path]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	struct sigaction sa = {};
+	sa.sa_handler = signal_stop;
+	(void)sigaction(SIGINT, &sa, nullptr);
+	(void)sigaction(SIGTERM, &sa, nullptr);
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	int listen_fd = listen_unix(p_path);
+	if(listen_fd < 0)
+		return EXIT_FAILURE;
+
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u32 = MAX_SESSIONS;
+	if(epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+	{
+		perror("epoll");
+		return EXIT_FAILURE;
+	}
+
+	(void)printf("Listening on %s, %zu byte frame arena per session\n", p_path, sizeof(connection::arena_buf));
+
+	while(!stop)
+	{
+		struct epoll_event events[MAX_SESSIONS + 1];
+		int count = epoll_wait(epoll_fd, events, MAX_SESSIONS + 1, -1);
+		if(count < 0)
+		{
+			if(EINTR == errno)
+				continue;
+
+			perror("epoll_wait");
+			break;
+		}
+
+		for(int i = 0; i < count; ++i)
+		{
+			unsigned slot = events[i].data.u32;
+			if(MAX_SESSIONS == slot)
+			{
+				accept_connections(epoll_fd, listen_fd, delim);
+				continue;
+			}
+
+			std::optional<connection> &conn = connections[slot];
+			if(!conn)
+				continue;
+
+			if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				handle_input(*conn);
+
+			bool flushed = flush_output(*conn);
+			if(conn->session.done() && (flushed || (events[i].events & (EPOLLHUP | EPOLLERR))))
+				conn.reset();
+			else
+				update_events(epoll_fd, *conn, slot);
+		}
+	}
+
+	for(std::optional<connection> &conn : connections)
+		conn.reset();
+
+	(void)close(listen_fd);
+	(void)unlink(p_path);
+	(void)printf("%lu lines handled\n", lines_handled);
+
+	return EXIT_SUCCESS;
+}
+
+static void signal_stop(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static int listen_unix(const char *p_path)
+{
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if(strlen(p_path) >= sizeof addr.sun_path)
+	{
+		(void)fprintf(stderr, "Socket path too long\n");
+		return -1;
+	}
+	(void)strcpy(addr.sun_path, p_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0 || bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof addr) < 0 ||
+	   listen(fd, MAX_SESSIONS) < 0)
+	{
+		perror(p_path);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void accept_connections(int epoll_fd, int listen_fd, const char *delim)
+{
+	int fd;
+	while((fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		unsigned slot = 0;
+		while(slot < MAX_SESSIONS && connections[slot])
+			++slot;
+
+		if(MAX_SESSIONS == slot)
+		{
+			static const char busy[] = "Too many sessions\r\n";
+			(void)!write(fd, busy, sizeof busy - 1);
+			(void)close(fd);
+			continue;
+		}
+
+		connection &conn = connections[slot].emplace(fd, delim);
+		struct epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.u32 = slot;
+		if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			connections[slot].reset();
+			continue;
+		}
+
+		// Runs until the session first waits for a line
+		conn.session = emrl::session::start(conn.arena, shell, conn);
+		if(!conn.session.valid())
+		{
+			print(conn, "Session arena too small\r\n");
+			(void)flush_output(conn);
+			connections[slot].reset();
+			continue;
+		}
+
+		(void)flush_output(conn);
+	}
+}
+
+static void handle_input(connection &conn)
+{
+	char buf[READ_BYTES];
+	ssize_t len = read(conn.fd, buf, sizeof buf);
+	if(len < 0 && (EAGAIN == errno || EINTR == errno))
+		return;
+
+	if(len <= 0)
+	{
+		// Resumes the session with a null line so it can finish
+		conn.reader.close();
+		return;
+	}
+
+	// The shell collects each line as soon as it is complete, so all input is consumed unless the
+	// session ends part way through
+	std::size_t used = 0;
+	while(used < static_cast<std::size_t>(len) && !conn.session.done())
+	{
+		std::size_t fed = conn.reader.feed(buf + used, len - used);
+		if(0 == fed)
+			break;
+
+		used += fed;
+	}
+
+	// Output was lost if the buffer filled, show the line again once it has been written out
+	if(emrl_print_error(conn.reader.res()) && !conn.session.done())
+	{
+		print(conn, "\r\n");
+		emrl_redraw(conn.reader.res());
+	}
+}
+
+// Returns true once all buffered output has been written
+static bool flush_output(connection &conn)
+{
+	std::size_t written = 0;
+	while(written < conn.out_len)
+	{
+		ssize_t res = write(conn.fd, conn.out + written, conn.out_len - written);
+		if(res < 0)
+		{
+			if(EINTR == errno)
+				continue;
+
+			// Drop output for a broken connection, it will be closed when the hang up is seen
+			if(EAGAIN != errno)
+				written = conn.out_len;
+
+			break;
+		}
+
+		written += res;
+	}
+
+	conn.out_len -= written;
+	(void)memmove(conn.out, conn.out + written, conn.out_len);
+
+	return 0 == conn.out_len;
+}
+
+// Wait for the socket to become writable while output is pending
+static void update_events(int epoll_fd, connection &conn, unsigned slot)
+{
+	bool want_out = (0 != conn.out_len);
+	if(want_out != conn.want_out)
+	{
+		struct epoll_event ev = {};
+		ev.events = want_out ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+		ev.data.u32 = slot;
+		(void)epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.fd, &ev);
+		conn.want_out = want_out;
+	}
+}
+
+int socket_sink::operator()(const char *p_str)
+{
+	std::size_t len = strlen(p_str);
+	if(len > sizeof p_conn->out - p_conn->out_len)
+		return EOF;
+
+	(void)memcpy(p_conn->out + p_conn->out_len, p_str, len);
+	p_conn->out_len += len;
+	return 0;
+}
+
+static void print(connection &conn, const char *p_str)
+{
+	(void)conn.reader.sink()(p_str);
+}
+
+// One session: read lines until the client sends exit or disconnects
+static emrl::session shell(connection &conn)
+{
+	reader_type &reader = conn.reader;
+
+	print(conn, "Type 'exit' to close the session, 'arena' for frame memory in use\r\n");
+	emrl_set_prompt(reader.res(), PROMPT);
+	emrl_redraw(reader.res());
+
+	while(const char *p_line = co_await reader.read_line())
+	{
+		print(conn, "\r\n");
+		++lines_handled;
+
+		if(0 == strcmp(p_line, "exit"))
+			break;
+
+		if(0 == strcmp(p_line, "arena"))
+		{
+			char msg[64];
+			(void)snprintf(msg, sizeof msg, "%zu of %zu bytes\r\n", conn.arena.used(), sizeof conn.arena_buf);
+			print(conn, msg);
+		}
+		else if('\0' != *p_line)
+		{
+			reader.add_to_history(p_line);
+			print(conn, "Got '");
+			print(conn, p_line);
+			print(conn, "'\r\n");
+		}
+
+		emrl_redraw(reader.res());
+	}
+
+	print(conn, "Bye\r\n");
+}
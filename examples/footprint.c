@@ -0,0 +1,7 @@
+// RAM per line editor for make footprint, the .bss of this object is one struct emrl_res. The
+// command and history buffers are supplied by the caller and are counted separately.
+
+#include "emrl.h"
+
+
+struct emrl_res footprint_res;
@@ -0,0 +1,794 @@
+// Load generator for the posix example. Starts a number of instances, each on its own pty or unix
+// socket, and types into all of them at once: insertions, cursor movement, deletion, history recall
+// and pastes. Reports keystroke to echo latency percentiles over all sessions and the CPU time each
+// instance used, e.g.
+//
+//     loadgen -n 64 -r 20 -d 10
+//
+// Every keystroke sent is one that is certain to produce output, so the first output read back
+// after it is its echo. Keystrokes are sent on schedule and timed from when they were due, not when
+// they were sent, so a session that falls behind shows up in the latency rather than being hidden
+// by a slower rate of typing. Only one keystroke per session is outstanding at a time. For a paste
+// the latency is to the first output, not to the end of the echo.
+//
+// Options given with -a are passed on to every instance, e.g. to compare commands that take 200 ms
+// run in the main loop against the same commands on worker threads
+//
+//     loadgen -a "-q 200 -w 0"
+//     loadgen -a "-q 200 -w 2"
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+
+#define DEFAULT_SESSIONS		8
+#define DEFAULT_SECONDS			10.0
+#define DEFAULT_RATE			10.0
+#define DEFAULT_PASTE_PERCENT	2.0
+#define DEFAULT_POSIX_PATH		"bin/posix"
+#define MAX_POSIX_ARGS			16
+#define PROMPT					"emrl>"
+#define EOT						4
+
+// Lines are kept well inside the posix example's command buffer so that every insertion is echoed,
+// including after recalling a line from history whose length isn't tracked
+#define LINE_MAX_TYPED			60
+#define LINE_MAX_ADDED			40
+#define PASTE_MIN				10
+#define PASTE_MAX				30
+
+#define START_TIMEOUT_NS		5000000000LL
+#define STOP_TIMEOUT_NS			2000000000LL
+#define READ_BYTES				4096
+
+
+enum action
+{
+	action_insert,
+	action_left,
+	action_right,
+	action_backspace,
+	action_recall,
+	action_paste,
+	action_enter
+};
+
+struct setup
+{
+	unsigned sessions;
+	double seconds;
+	double rate;
+	double paste_percent;
+	bool sockets;
+	const char *posix_path;
+	const char *posix_args;
+};
+
+struct session
+{
+	pid_t pid;
+	int fd;
+	char sock_path[64];
+
+	// Typing model, lengths are lower bounds after a line is recalled from history
+	unsigned seed;
+	unsigned cursor;
+	unsigned len;
+	unsigned room;
+	unsigned target;
+	bool recalled;
+	unsigned long lines;
+
+	// Start up waits for the first prompt
+	bool ready;
+	unsigned prompt_pos;
+
+	int64_t due;
+	bool waiting;
+
+	unsigned long keys;
+	unsigned long long bytes_out;
+	unsigned long long bytes_in;
+	struct rusage usage;
+};
+
+struct samples
+{
+	int64_t *p_ns;
+	size_t count;
+	size_t size;
+	unsigned long dropped;
+};
+
+
+static inline void parse_args(struct setup *p_setup, int argc, char *argv[]);
+static inline void start_session(struct session *p_sess, unsigned index, const struct setup *p_setup);
+static inline int spawn_on_pty(const struct setup *p_setup, pid_t *p_pid);
+static inline int spawn_on_socket(const struct setup *p_setup, const char *sock_path, pid_t *p_pid);
+static inline void exec_posix(const struct setup *p_setup, const char *sock_path);
+static inline int connect_unix(const char *sock_path, int64_t deadline);
+static inline bool wait_ready(struct session *p_sessions, unsigned count);
+static inline void run_load(struct session *p_sessions, unsigned count, const struct setup *p_setup,
+                            struct samples *p_samples);
+static inline void send_action(struct session *p_sess, double paste_percent);
+static inline enum action choose_action(struct session *p_sess, double paste_percent);
+static inline bool read_output(struct session *p_sess);
+static inline void schedule_next(struct session *p_sess, double rate, int64_t now);
+static inline void stop_session(struct session *p_sess, bool sockets);
+static inline void add_sample(struct samples *p_samples, int64_t ns);
+static inline void print_report(const struct session *p_sessions, unsigned count,
+                                const struct setup *p_setup, struct samples *p_samples, double elapsed);
+static int compare_ns(const void *p_a, const void *p_b);
+static inline double rand_unit(unsigned *p_seed);
+static inline int64_t now_ns(void);
+static inline double timeval_sec(const struct timeval *p_tv);
+static void perror_exit(const char *info);
+
+
+int main(int argc, char *argv[])
+{
+	struct setup setup =
+	{
+		.sessions = DEFAULT_SESSIONS,
+		.seconds = DEFAULT_SECONDS,
+		.rate = DEFAULT_RATE,
+		.paste_percent = DEFAULT_PASTE_PERCENT,
+		.sockets = false,
+		.posix_path = DEFAULT_POSIX_PATH,
+		.posix_args = NULL
+	};
+
+	parse_args(&setup, argc, argv);
+
+	// A session that exits early shouldn't take the generator with it
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	struct session *p_sessions = calloc(setup.sessions, sizeof *p_sessions);
+	if(NULL == p_sessions)
+		perror_exit("calloc");
+
+	for(unsigned i = 0; i < setup.sessions; ++i)
+		start_session(&p_sessions[i], i, &setup);
+
+	if(!wait_ready(p_sessions, setup.sessions))
+	{
+		(void)fprintf(stderr, "Timed out waiting for prompts from '%s'\n", setup.posix_path);
+		for(unsigned i = 0; i < setup.sessions; ++i)
+			stop_session(&p_sessions[i], setup.sockets);
+
+		return EXIT_FAILURE;
+	}
+
+	// Room for every keystroke at the nominal rate, with some slack for the random intervals
+	struct samples samples = { .size = (size_t)(setup.sessions * setup.seconds * setup.rate * 1.5) + 1024 };
+	samples.p_ns = malloc(samples.size * sizeof *samples.p_ns);
+	if(NULL == samples.p_ns)
+		perror_exit("malloc");
+
+	(void)printf("%u sessions on %s, %.1f keystrokes/s each for %.1f s\n",
+	             setup.sessions,
+	             setup.sockets ? "unix sockets" : "ptys",
+	             setup.rate,
+	             setup.seconds);
+	(void)fflush(stdout);
+
+	int64_t start = now_ns();
+	run_load(p_sessions, setup.sessions, &setup, &samples);
+	double elapsed = (now_ns() - start) / 1e9;
+
+	for(unsigned i = 0; i < setup.sessions; ++i)
+		stop_session(&p_sessions[i], setup.sockets);
+
+	print_report(p_sessions, setup.sessions, &setup, &samples, elapsed);
+
+	free(samples.p_ns);
+	free(p_sessions);
+
+	return EXIT_SUCCESS;
+}
+
+static inline void parse_args(struct setup *p_setup, int argc, char *argv[])
+{
+	int opt;
+	bool usage = false;
+
+	while((opt = getopt(argc, argv, "a:d:n:p:r:sx:")) != -1 && !usage)
+	{
+		char *p_end = NULL;
+		switch(opt)
+		{
+			case 'a':
+				p_setup->posix_args = optarg;
+				break;
+
+			case 'd':
+				p_setup->seconds = strtod(optarg, &p_end);
+				usage = (p_setup->seconds <= 0.0);
+				break;
+
+			case 'n':
+				p_setup->sessions = strtoul(optarg, &p_end, 0);
+				usage = (p_setup->sessions < 1 || p_setup->sessions > 4096);
+				break;
+
+			case 'p':
+				p_setup->paste_percent = strtod(optarg, &p_end);
+				usage = (p_setup->paste_percent < 0.0 || p_setup->paste_percent > 100.0);
+				break;
+
+			case 'r':
+				p_setup->rate = strtod(optarg, &p_end);
+				usage = (p_setup->rate < 0.1 || p_setup->rate > 1e5);
+				break;
+
+			case 's':
+				p_setup->sockets = true;
+				break;
+
+			case 'x':
+				p_setup->posix_path = optarg;
+				break;
+
+			default:
+				usage = true;
+				break;
+		}
+
+		if(NULL != p_end && '\0' != *p_end)
+			usage = true;
+	}
+
+	if(usage || optind < argc)
+	{
+		const char *prog_path = (argc > 0) ? argv[0] : "loadgen";
+		(void)fprintf(stderr,
+		              "usage: %s: [-n sessions] [-d seconds] [-r keystrokes_per_sec] [-p paste_percent] "
+		              "[-s] [-x posix_path] [-a posix_options]\n",
+		              prog_path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static inline void start_session(struct session *p_sess, unsigned index, const struct setup *p_setup)
+{
+	p_sess->seed = 0x9e3779b9u * (index + 1);
+	p_sess->room = LINE_MAX_TYPED;
+	p_sess->target = 1 + rand_unit(&p_sess->seed) * LINE_MAX_TYPED;
+
+	if(p_setup->sockets)
+	{
+		(void)snprintf(p_sess->sock_path, sizeof p_sess->sock_path, "/tmp/emrl-loadgen-%ld-%u",
+		               (long)getpid(), index);
+		p_sess->fd = spawn_on_socket(p_setup, p_sess->sock_path, &p_sess->pid);
+	}
+	else
+	{
+		p_sess->fd = spawn_on_pty(p_setup, &p_sess->pid);
+	}
+
+	if(0 != fcntl(p_sess->fd, F_SETFL, fcntl(p_sess->fd, F_GETFL) | O_NONBLOCK))
+		perror_exit("fcntl");
+}
+
+// The instance talks to the slave side as its standard input and output, like a user's terminal
+static inline int spawn_on_pty(const struct setup *p_setup, pid_t *p_pid)
+{
+	int fd = posix_openpt(O_RDWR|O_NOCTTY);
+	if(fd < 0)
+		perror_exit("posix_openpt");
+
+	if(grantpt(fd) < 0)
+		perror_exit("grantpt");
+
+	if(unlockpt(fd) < 0)
+		perror_exit("unlockpt");
+
+	char *slave_path = ptsname(fd);
+	if(NULL == slave_path)
+		perror_exit("ptsname");
+
+	pid_t pid = fork();
+	if(pid < 0)
+		perror_exit("fork");
+
+	if(0 == pid)
+	{
+		// The slave becomes the controlling terminal of a new session
+		(void)setsid();
+		int slave = open(slave_path, O_RDWR);
+		int null = open("/dev/null", O_WRONLY);
+		if(slave < 0 || null < 0 ||
+		   dup2(slave, STDIN_FILENO) < 0 || dup2(slave, STDOUT_FILENO) < 0 || dup2(null, STDERR_FILENO) < 0)
+		{
+			_exit(EXIT_FAILURE);
+		}
+
+		(void)close(fd);
+		exec_posix(p_setup, NULL);
+		_exit(EXIT_FAILURE);
+	}
+
+	*p_pid = pid;
+	return fd;
+}
+
+static inline int spawn_on_socket(const struct setup *p_setup, const char *sock_path, pid_t *p_pid)
+{
+	pid_t pid = fork();
+	if(pid < 0)
+		perror_exit("fork");
+
+	if(0 == pid)
+	{
+		int null = open("/dev/null", O_RDWR);
+		if(null < 0 ||
+		   dup2(null, STDIN_FILENO) < 0 || dup2(null, STDOUT_FILENO) < 0 || dup2(null, STDERR_FILENO) < 0)
+		{
+			_exit(EXIT_FAILURE);
+		}
+
+		exec_posix(p_setup, sock_path);
+		_exit(EXIT_FAILURE);
+	}
+
+	*p_pid = pid;
+	return connect_unix(sock_path, now_ns() + START_TIMEOUT_NS);
+}
+
+// Runs in the child, unthrottled with any options given with -a split at spaces, then on the
+// socket if there is one. Only returns if exec fails.
+static inline void exec_posix(const struct setup *p_setup, const char *sock_path)
+{
+	static char options[256];
+	char *args[MAX_POSIX_ARGS + 5];
+	size_t count = 0;
+	args[count++] = (char *)p_setup->posix_path;
+	args[count++] = "-u";
+
+	if(NULL != p_setup->posix_args)
+	{
+		(void)snprintf(options, sizeof options, "%s", p_setup->posix_args);
+		for(char *p_arg = strtok(options, " "); NULL != p_arg && count < MAX_POSIX_ARGS + 2;
+		    p_arg = strtok(NULL, " "))
+		{
+			args[count++] = p_arg;
+		}
+	}
+
+	if(NULL != sock_path)
+	{
+		args[count++] = "-s";
+		args[count++] = (char *)sock_path;
+	}
+
+	args[count] = NULL;
+	(void)execv(p_setup->posix_path, args);
+}
+
+// The instance creates its socket after starting, keep trying until it is there
+static inline int connect_unix(const char *sock_path, int64_t deadline)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if(strlen(sock_path) >= sizeof addr.sun_path)
+	{
+		(void)fprintf(stderr, "Socket path '%s' too long\n", sock_path);
+		exit(EXIT_FAILURE);
+	}
+	(void)strcpy(addr.sun_path, sock_path);
+
+	while(true)
+	{
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd < 0)
+			perror_exit("socket");
+
+		if(0 == connect(fd, (struct sockaddr *)&addr, sizeof addr))
+			return fd;
+
+		(void)close(fd);
+		if((ENOENT != errno && ECONNREFUSED != errno) || now_ns() > deadline)
+			perror_exit(sock_path);
+
+		const struct timespec retry = { .tv_nsec = 1000000 };
+		(void)nanosleep(&retry, NULL);
+	}
+}
+
+// Discard start up output until each instance has shown its prompt
+static inline bool wait_ready(struct session *p_sessions, unsigned count)
+{
+	struct pollfd *p_fds = calloc(count, sizeof *p_fds);
+	if(NULL == p_fds)
+		perror_exit("calloc");
+
+	int64_t deadline = now_ns() + START_TIMEOUT_NS;
+	unsigned ready = 0;
+	while(ready < count && now_ns() < deadline)
+	{
+		for(unsigned i = 0; i < count; ++i)
+		{
+			p_fds[i].fd = p_sessions[i].ready ? -1 : p_sessions[i].fd;
+			p_fds[i].events = POLLIN;
+		}
+
+		if(poll(p_fds, count, 100) < 0 && EINTR != errno)
+			perror_exit("poll");
+
+		for(unsigned i = 0; i < count; ++i)
+		{
+			struct session *p_sess = &p_sessions[i];
+			if(0 == (p_fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			char buf[READ_BYTES];
+			ssize_t res = read(p_sess->fd, buf, sizeof buf);
+			for(ssize_t pos = 0; pos < res && !p_sess->ready; ++pos)
+			{
+				p_sess->prompt_pos = (buf[pos] == PROMPT[p_sess->prompt_pos]) ? p_sess->prompt_pos + 1 : 0;
+				if('\0' == PROMPT[p_sess->prompt_pos])
+				{
+					p_sess->ready = true;
+					++ready;
+				}
+			}
+		}
+	}
+
+	free(p_fds);
+	return ready == count;
+}
+
+static inline void run_load(struct session *p_sessions, unsigned count, const struct setup *p_setup,
+                            struct samples *p_samples)
+{
+	struct pollfd *p_fds = calloc(count, sizeof *p_fds);
+	if(NULL == p_fds)
+		perror_exit("calloc");
+
+	// Spread the first keystrokes over one interval so that the sessions don't type in step
+	int64_t start = now_ns();
+	int64_t end = start + (int64_t)(p_setup->seconds * 1e9);
+	for(unsigned i = 0; i < count; ++i)
+		schedule_next(&p_sessions[i], p_setup->rate, start);
+
+	int64_t now;
+	while((now = now_ns()) < end)
+	{
+		int64_t next = end;
+		for(unsigned i = 0; i < count; ++i)
+		{
+			struct session *p_sess = &p_sessions[i];
+			if(!p_sess->waiting && p_sess->due <= now)
+			{
+				send_action(p_sess, p_setup->paste_percent);
+				p_sess->waiting = true;
+			}
+
+			if(!p_sess->waiting && p_sess->due < next)
+				next = p_sess->due;
+
+			p_fds[i].fd = p_sess->fd;
+			p_fds[i].events = POLLIN;
+		}
+
+		int timeout_ms = (int)((next - now + 999999) / 1000000);
+		int res = poll(p_fds, count, timeout_ms);
+		if(res < 0)
+		{
+			if(EINTR == errno)
+				continue;
+
+			perror_exit("poll");
+		}
+
+		if(0 == res)
+			continue;
+
+		now = now_ns();
+		for(unsigned i = 0; i < count; ++i)
+		{
+			struct session *p_sess = &p_sessions[i];
+			if(0 == (p_fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			if(!read_output(p_sess))
+			{
+				(void)fprintf(stderr, "Session %u closed early\n", i);
+				p_sess->waiting = false;
+				p_sess->due = INT64_MAX;
+				continue;
+			}
+
+			// Output after the keystroke was due is its echo
+			if(p_sess->waiting)
+			{
+				add_sample(p_samples, now - p_sess->due);
+				p_sess->waiting = false;
+				schedule_next(p_sess, p_setup->rate, p_sess->due);
+			}
+		}
+	}
+
+	free(p_fds);
+}
+
+static inline void send_action(struct session *p_sess, double paste_percent)
+{
+	char buf[PASTE_MAX + 1];
+	size_t len = 0;
+
+	switch(choose_action(p_sess, paste_percent))
+	{
+		case action_insert:
+			buf[len++] = 'a' + rand_unit(&p_sess->seed) * 26;
+			++p_sess->cursor;
+			++p_sess->len;
+			--p_sess->room;
+			break;
+
+		case action_left:
+			(void)memcpy(buf, "\033[D", 3);
+			len = 3;
+			--p_sess->cursor;
+			break;
+
+		case action_right:
+			(void)memcpy(buf, "\033[C", 3);
+			len = 3;
+			++p_sess->cursor;
+			break;
+
+		case action_backspace:
+			buf[len++] = '\b';
+			--p_sess->cursor;
+			--p_sess->len;
+			++p_sess->room;
+			break;
+
+		case action_recall:
+			// Replaces the line with one that has at least one character, cursor at its end
+			(void)memcpy(buf, "\033[A", 3);
+			len = 3;
+			p_sess->recalled = true;
+			p_sess->cursor = p_sess->len = 1;
+			p_sess->room = LINE_MAX_ADDED;
+			break;
+
+		case action_paste:
+		{
+			unsigned paste_len = PASTE_MIN + rand_unit(&p_sess->seed) * (PASTE_MAX - PASTE_MIN);
+			if(paste_len > p_sess->room)
+				paste_len = p_sess->room;
+
+			static const char text[] = "the quick brown fox jumps over the lazy dog ";
+			for(; len < paste_len; ++len)
+				buf[len] = text[len % (sizeof text - 1)];
+
+			p_sess->cursor += paste_len;
+			p_sess->len += paste_len;
+			p_sess->room -= paste_len;
+			break;
+		}
+
+		case action_enter:
+			buf[len++] = '\r';
+			p_sess->recalled = false;
+			p_sess->cursor = p_sess->len = 0;
+			p_sess->room = LINE_MAX_TYPED;
+			p_sess->target = 1 + rand_unit(&p_sess->seed) * LINE_MAX_TYPED;
+			++p_sess->lines;
+			break;
+	}
+
+	// The kernel buffers are far larger than one keystroke, a short write means the session is gone
+	if(write(p_sess->fd, buf, len) == (ssize_t)len)
+		p_sess->bytes_out += len;
+
+	++p_sess->keys;
+}
+
+// Only actions that are sure to change the display are chosen, given what is known of the line
+static inline enum action choose_action(struct session *p_sess, double paste_percent)
+{
+	if(p_sess->len >= p_sess->target || 0 == p_sess->room)
+		return (p_sess->len > 0) ? action_enter : action_insert;
+
+	double pick = rand_unit(&p_sess->seed) * 100.0;
+	if(pick < paste_percent && p_sess->room >= PASTE_MIN)
+		return action_paste;
+
+	pick = rand_unit(&p_sess->seed) * 100.0;
+	if(pick < 6.0 && p_sess->cursor > 0)
+		return action_left;
+
+	if(pick < 10.0 && p_sess->cursor < p_sess->len)
+		return action_right;
+
+	if(pick < 16.0 && p_sess->cursor > 0)
+		return action_backspace;
+
+	if(pick < 18.0 && p_sess->lines > 0 && !p_sess->recalled)
+		return action_recall;
+
+	return action_insert;
+}
+
+// Returns false if the session has gone
+static inline bool read_output(struct session *p_sess)
+{
+	char buf[READ_BYTES];
+	ssize_t res;
+	bool any = false;
+	while((res = read(p_sess->fd, buf, sizeof buf)) > 0)
+	{
+		p_sess->bytes_in += res;
+		any = true;
+	}
+
+	return any || (res < 0 && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno));
+}
+
+// Random intervals averaging the typing rate, from when the last keystroke was due
+static inline void schedule_next(struct session *p_sess, double rate, int64_t from)
+{
+	p_sess->due = from + (int64_t)((0.5 + rand_unit(&p_sess->seed)) * 1e9 / rate);
+}
+
+static inline void stop_session(struct session *p_sess, bool sockets)
+{
+	// Ctrl-D quits on a terminal, a socket closing is the end of input
+	if(sockets)
+	{
+		(void)shutdown(p_sess->fd, SHUT_WR);
+	}
+	else
+	{
+		const char eot = EOT;
+		(void)!write(p_sess->fd, &eot, 1);
+	}
+
+	// Drain the output until the instance exits, so it is never blocked writing
+	int64_t deadline = now_ns() + STOP_TIMEOUT_NS;
+	int status;
+	pid_t res;
+	while(0 == (res = wait4(p_sess->pid, &status, WNOHANG, &p_sess->usage)))
+	{
+		if(now_ns() > deadline)
+		{
+			(void)kill(p_sess->pid, SIGKILL);
+			res = wait4(p_sess->pid, &status, 0, &p_sess->usage);
+			break;
+		}
+
+		struct pollfd fd = { .fd = p_sess->fd, .events = POLLIN };
+		if(poll(&fd, 1, 10) > 0)
+			(void)read_output(p_sess);
+	}
+
+	if(res < 0)
+		perror("wait4");
+
+	(void)close(p_sess->fd);
+	if(sockets)
+		(void)unlink(p_sess->sock_path);
+}
+
+static inline void add_sample(struct samples *p_samples, int64_t ns)
+{
+	if(p_samples->count < p_samples->size)
+		p_samples->p_ns[p_samples->count++] = ns;
+	else
+		++p_samples->dropped;
+}
+
+static inline void print_report(const struct session *p_sessions, unsigned count,
+                                const struct setup *p_setup, struct samples *p_samples, double elapsed)
+{
+	unsigned long long keys = 0;
+	unsigned long long bytes_out = 0;
+	unsigned long long bytes_in = 0;
+	double cpu_total = 0.0;
+	double cpu_max = 0.0;
+	for(unsigned i = 0; i < count; ++i)
+	{
+		const struct session *p_sess = &p_sessions[i];
+		keys += p_sess->keys;
+		bytes_out += p_sess->bytes_out;
+		bytes_in += p_sess->bytes_in;
+
+		double cpu = timeval_sec(&p_sess->usage.ru_utime) + timeval_sec(&p_sess->usage.ru_stime);
+		cpu_total += cpu;
+		if(cpu > cpu_max)
+			cpu_max = cpu;
+	}
+
+	(void)printf("%llu keystrokes (%.0f/s), %llu bytes typed, %llu bytes echoed in %.3f s\n",
+	             keys, keys / elapsed, bytes_out, bytes_in, elapsed);
+
+	if(0 == p_samples->count)
+	{
+		(void)printf("No echoes timed\n");
+	}
+	else
+	{
+		qsort(p_samples->p_ns, p_samples->count, sizeof *p_samples->p_ns, compare_ns);
+
+		static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+		(void)printf("Keystroke to echo latency, %zu samples\n", p_samples->count);
+		for(size_t i = 0; i < sizeof percentiles / sizeof percentiles[0]; ++i)
+		{
+			size_t pos = (size_t)(percentiles[i] / 100.0 * (p_samples->count - 1) + 0.5);
+			(void)printf("  p%-5g %10.1f us\n", percentiles[i], p_samples->p_ns[pos] / 1e3);
+		}
+		(void)printf("  max    %10.1f us\n", p_samples->p_ns[p_samples->count - 1] / 1e3);
+
+		if(p_samples->dropped > 0)
+			(void)printf("  %lu samples not recorded\n", p_samples->dropped);
+	}
+
+	// Instance CPU includes start up and shut down, which is small next to a run of a few seconds
+	(void)printf("Instance CPU (%s): %.3f ms per session (max %.3f ms), %.3f%% of a core per session\n",
+	             p_setup->posix_path,
+	             cpu_total * 1e3 / count,
+	             cpu_max * 1e3,
+	             100.0 * cpu_total / count / elapsed);
+
+	if(keys > 0)
+		(void)printf("  %.2f us CPU per keystroke\n", cpu_total * 1e6 / keys);
+
+	struct rusage self;
+	if(0 == getrusage(RUSAGE_SELF, &self))
+	{
+		(void)printf("Load generator CPU: %.3f s\n",
+		             timeval_sec(&self.ru_utime) + timeval_sec(&self.ru_stime));
+	}
+}
+
+static int compare_ns(const void *p_a, const void *p_b)
+{
+	int64_t a = *(const int64_t *)p_a;
+	int64_t b = *(const int64_t *)p_b;
+	return (a > b) - (a < b);
+}
+
+// Uniform in [0, 1)
+static inline double rand_unit(unsigned *p_seed)
+{
+	return rand_r(p_seed) / ((double)RAND_MAX + 1.0);
+}
+
+static inline int64_t now_ns(void)
+{
+	struct timespec now;
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static inline double timeval_sec(const struct timeval *p_tv)
+{
+	return p_tv->tv_sec + p_tv->tv_usec / 1e6;
+}
+
+static void perror_exit(const char *info)
+{
+	perror(info);
+	exit(EXIT_FAILURE);
+}
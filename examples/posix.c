@@ -1,12 +1,15 @@
 #define _XOPEN_SOURCE 600
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <stddef.h>
 #include <string.h>
@@ -14,10 +17,16 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <poll.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include "emrl.h"
+#include "emrl_queue.h"
+#include "emrl_telnet.h"
+#include "emrl_trace.h"
 
 
 #define DEFAULT_BAUD			1200.0
@@ -25,40 +34,197 @@
 #define PROMPT					"emrl>"
 #define EOT						4
 
+// Worst case output from a single input character, input is only fed to emrl while there is at
+// least this much space in the ring so its output is never refused. Highlighting may change the
+// attribute of every cell, at most once per word.
+#define OUTPUT_RESERVE			(6*EMRL_MAX_CMD_LEN + 64)
+#define RING_BYTES				(4*OUTPUT_RESERVE)
+
+// Latency histograms have power of two buckets in trace time units (microseconds by default), the
+// last bucket also counts anything slower
+#define LATENCY_BUCKETS			24
+#define TRACE_RECORDS			256
+#define ECHOES_PENDING			1024
+
+#define HIGHLIGHT_SPANS			16
+
+// Saved editor state, the history entries and line are stored as text with a few bytes of fields
+#define STATE_BYTES				(EMRL_HISTORY_BUF_BYTES + EMRL_MAX_CMD_LEN + 64)
+#define RESTART_PATH_TEMPLATE	"/tmp/emrl-restart-XXXXXX"
+
+// Type-ahead queue room for a few full length lines, each stored with two bytes of overhead
+#define LINE_QUEUE_BYTES		(4*(EMRL_MAX_CMD_LEN + 2))
+
+// Output for one command run from the queue, as well as hiding and showing the line being edited
+#define COMMAND_TEXT_BYTES		(EMRL_MAX_CMD_LEN + 32)
+#define COMMAND_OUTPUT_BYTES	(OUTPUT_RESERVE + COMMAND_TEXT_BYTES)
+
+// Each worker thread has room for a couple of lines waiting to run and the output of as many
+#define MAX_WORKERS				16
+#define WORKER_LINE_BYTES		(2*(EMRL_MAX_CMD_LEN + 1) + 1)
+#define WORKER_OUTPUT_BYTES		(2*COMMAND_TEXT_BYTES + 1)
+
 
 enum mode
 {
 	mode_local,
 	mode_pty,
-	mode_socket
+	mode_socket,
+	mode_restart
 };
 
 struct setup
 {
 	enum mode mode;
 	double baud;
+	bool throttle;
+	bool telnet;
+	bool latency;
+	bool streaming;
+	bool colour;
+	bool suggest;
+	const char *term;
+	const char *restore_path;
+	long command_ms;
+	int workers;
+};
+
+// Passed to the new process image on restart, ahead of any unprocessed input and the emrl state.
+// Only this program reads it, unlike the emrl state it isn't portable between builds.
+struct restart
+{
+	int in_fd;
+	int out_fd;
+	int reset_stdin;
+	int unlink_sock_path;
+	struct termios term_orig;
+	size_t input_len;
+	size_t state_len;
 };
 
 struct ring
 {
-	char buf[32+EMRL_MAX_CMD_LEN];
+	char buf[RING_BYTES];
 	char *p_put;
 	char *p_get;
 	char *p_end;
+	unsigned long long put_total;
+};
+
+struct input
+{
+	char buf[256];
+	size_t len;
+	size_t pos;
 };
 
+// Command taken from the type-ahead queue, it stays queued until it completes. With -w commands
+// are run by command_handler() instead, on worker threads or in the main loop.
+struct command
+{
+	long ms;
+	bool running;
+	struct timespec done;
+	bool handler;
+	unsigned workers;
+	unsigned next_worker;
+	unsigned in_flight;				// Handed to a worker, output not printed yet
+};
+
+// Runs commands handed over by the main loop, one at a time. Each queue has a single producer and
+// a single consumer so neither side takes a lock, the semaphore counts lines waiting to run.
+struct worker
+{
+	pthread_t thread;
+	sem_t queued;
+	struct emrl_queue lines;		// Written by the main loop
+	struct emrl_queue output;		// Written by the worker
+	char lines_buf[WORKER_LINE_BYTES];
+	char output_buf[WORKER_OUTPUT_BYTES];
+};
+
+struct stats
+{
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	unsigned long lost_output;
+	struct timespec start;
+};
+
+#ifdef USE_TRACE
+// A keystroke whose echo is waiting in the ring, it has been written once bytes_out reaches out_end
+struct echo
+{
+	emrl_cycles key_time;
+	emrl_cycles render_time;
+	unsigned long long out_end;
+};
+
+struct histogram
+{
+	const char *name;
+	unsigned long counts[LATENCY_BUCKETS];
+};
+
+struct latency
+{
+	struct emrl_trace trace;
+	struct emrl_trace_record records[TRACE_RECORDS];
+	struct echo echoes[ECHOES_PENDING];
+	unsigned echo_put;
+	unsigned echo_get;
+	unsigned long untracked;
+	struct histogram process;
+	struct histogram queued;
+	struct histogram total;
+};
+#endif
+
 
 static inline void parse_args(struct setup *p_setup, int argc, char *argv[]);
+static inline bool set_terminal(struct emrl_res *p_emrl, const char *p_name);
 static inline void setup_termination_handlers(void);
 static inline int setup_pty(void);
 static inline int setup_socket(void);
 static inline void configure_tty(int fd);
 static inline void setup_baud_timer(sigset_t *p_sig, double baud);
+static inline void wait_baud_tick(sigset_t *p_sig);
+static inline void wait_io(int in_fd, int out_fd, bool eof);
 static inline bool ring_empty(void);
-static inline void ring_puts(const char *p_str);
-static inline void write_from_ring(int fd);
-static int emrl_puts(const char *p_str, FILE *p_file);
-static inline bool feed_emrl(int fd, struct emrl_res *p_emrl);
+static inline size_t ring_free(void);
+static inline bool ring_puts(const char *p_str);
+static inline bool ring_write(const char *p_data, size_t len);
+static inline void write_from_ring(int fd, bool throttle);
+static int emrl_puts(const char *p_str, emrl_file file);
+static int telnet_write(const char *p_data, size_t len, emrl_file file);
+static inline bool feed_emrl(int fd, struct emrl_res *p_emrl, bool throttle);
+static inline void print_stats(void);
+static inline void show_prompt(struct emrl_res *p_emrl);
+static inline void print_async_messages(struct emrl_res *p_emrl);
+static inline size_t terminal_width(int fd);
+static inline void update_width(struct emrl_res *p_emrl, int fd);
+static inline void print_command(struct emrl_res *p_emrl, const char *p_command, enum emrl_part part);
+static inline void run_queued_command(struct emrl_res *p_emrl);
+static inline int command_wait_ms(void);
+static void command_handler(const char *p_command, char *p_output, size_t size);
+static inline void start_workers(unsigned count);
+static void *worker_main(void *p_arg);
+static inline void dispatch_commands(struct emrl_res *p_emrl);
+static inline void print_command_output(struct emrl_res *p_emrl);
+static emrl_cycles monotonic_us(void);
+static inline void restart(const struct emrl_res *p_emrl, int in_fd, int out_fd, int argc, char *argv[]);
+static inline void read_restart(const char *p_path, struct restart *p_restart, unsigned char *p_state);
+static size_t highlight(void *p_ctx, const char *p_line, size_t len, struct emrl_span *p_spans, size_t max_spans);
+static void signal_async(int signum);
+static void signal_restart(int signum);
+static void signal_resize(int signum);
+#ifdef USE_TRACE
+static inline void collect_latency(void);
+static inline void echoes_written(void);
+static inline void add_to_histogram(struct histogram *p_hist, emrl_cycles time);
+static void print_latency(void);
+static void signal_latency(int signum);
+#endif
 static void cleanup(void);
 static void perror_exit(const char *info);
 static void signal_exit(int signum);
@@ -67,6 +233,13 @@ static void signal_exit(int signum);
 static volatile sig_atomic_t reset_stdin = 0;
 static struct termios term_orig;
 
+static volatile sig_atomic_t async_pending = 0;
+static unsigned long async_count = 0;
+
+static volatile sig_atomic_t restart_pending = 0;
+
+static volatile sig_atomic_t resize_pending = 0;
+
 static volatile sig_atomic_t unlink_sock_path = 0;
 static const char *sock_path = DEFAULT_SOCKET_PATH;
 
@@ -78,21 +251,62 @@ static struct ring ring =
 	.p_end = ring.buf + sizeof ring.buf
 };
 
+static struct input input;
+static struct command command;
+static struct worker workers[MAX_WORKERS];
+static int output_pipe[2] = { -1, -1 };	// Workers write a byte here after queuing output
+static struct stats stats;
+
+#ifdef USE_TRACE
+static bool measure_latency = false;
+static volatile sig_atomic_t latency_dump = 0;
+static struct latency latency =
+{
+	.process = { .name = "emrl processing" },
+	.queued = { .name = "queued for output" },
+	.total = { .name = "keystroke to echo" }
+};
+#endif
+
+static bool use_telnet = false;
+static struct emrl_telnet telnet;
+
 int main(int argc, char *argv[])
 {
 	struct setup setup =
 	{
 		.mode = mode_local,
-		.baud = DEFAULT_BAUD
+		.baud = DEFAULT_BAUD,
+		.throttle = true,
+		.telnet = false,
+		.latency = false,
+		.streaming = false,
+		.colour = false,
+		.suggest = false,
+		.term = NULL,
+		.restore_path = NULL,
+		.command_ms = -1,
+		.workers = -1
 	};
 
 	parse_args(&setup, argc, argv);
-	printf("\nEMbedded ReadLine test application\n\nSimulating %.0f baud\n\n", setup.baud);
+
+	// After a restart the terminal is still showing the line being edited
+	if(mode_restart != setup.mode)
+	{
+		printf("\nEMbedded ReadLine test application\n\n");
+		if(setup.throttle)
+			printf("Simulating %.0f baud\n\n", setup.baud);
+		else
+			printf("Unthrottled\n\n");
+	}
 
 	// Before configuring terminal, ensure cleanup() will be called on termination
 	setup_termination_handlers();
 
 	// Setup application input and output
+	static unsigned char state[STATE_BYTES];
+	struct restart restarted;
 	int in_fd;
 	int out_fd;
 	switch(setup.mode)
@@ -120,38 +334,189 @@ int main(int argc, char *argv[])
 
         break;
 
+    case mode_restart:
+        // Carry on with the input and output of the process that was replaced
+        read_restart(setup.restore_path, &restarted, state);
+        in_fd = restarted.in_fd;
+        out_fd = restarted.out_fd;
+        break;
+
     default:
         assert(false);
         return EXIT_FAILURE;
 	}
 
+	// When unthrottled, input and output must be non-blocking so that neither stalls the other
+	if(!setup.throttle)
+	{
+		if(0 != fcntl(in_fd, F_SETFL, fcntl(in_fd, F_GETFL) | O_NONBLOCK))
+			perror_exit("fcntl(in_fd)");
+
+		if(0 != fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) | O_NONBLOCK))
+			perror_exit("fcntl(out_fd)");
+	}
+
 	sigset_t signal;
-	setup_baud_timer(&signal, setup.baud);
+	if(setup.throttle)
+		setup_baud_timer(&signal, setup.baud);
 
 	// Initialise emrl, use emrl_fputs for output, '\r' is line delimiter
+	static char cmd_buf[EMRL_MAX_CMD_LEN + 1];
+	static char hist_buf[EMRL_HISTORY_BUF_BYTES];
 	struct emrl_res emrl;
-	emrl_init(&emrl, emrl_puts, 0, "\r");
+	emrl_init(&emrl, emrl_puts, 0, "\r", cmd_buf, sizeof cmd_buf, hist_buf, sizeof hist_buf);
+	emrl_set_prompt(&emrl, PROMPT);
+	emrl_set_streaming(&emrl, setup.streaming);
+
+	// Lines typed while a command runs wait in the queue, and are echoed and editable meanwhile
+	if(setup.command_ms >= 0)
+	{
+		static char line_queue[LINE_QUEUE_BYTES];
+		emrl_set_line_queue(&emrl, line_queue, sizeof line_queue);
+		command.ms = setup.command_ms;
+	}
+
+	// Commands run while the line is edited, with their output printed above it when done
+	if(setup.workers >= 0)
+	{
+		command.handler = true;
+		start_workers(setup.workers);
+	}
+
+	// The replaced process had already chosen the terminal profile
+	bool restored = false;
+	if(mode_restart == setup.mode)
+	{
+		restored = emrl_restore_state(&emrl, state, restarted.state_len);
+		if(!restored)
+			(void)ring_puts("\r\n[editor state not restored]\r\n");
+	}
+	else if(NULL != setup.term)
+	{
+		set_terminal(&emrl, setup.term);
+	}
+
+	// Known commands in green, unknown in red and numeric arguments in cyan
+	if(setup.colour)
+	{
+		static const char *const sgr[] = { "", "1;32", "1;31", "36" };
+		static struct emrl_span spans[HIGHLIGHT_SPANS];
+		static uint8_t shown[sizeof cmd_buf];
+		static struct emrl_highlight hl;
+		emrl_highlight_init(&hl, highlight, NULL, sgr, spans, HIGHLIGHT_SPANS, shown);
+		emrl_set_highlight(&emrl, &hl);
+	}
+
+	// The newest history entry starting with the line is shown after it, cursor right takes it
+	if(setup.suggest)
+	{
+		static emrl_hist_idx suggest_index[EMRL_SUGGEST_SLOTS(sizeof hist_buf)];
+		emrl_set_suggestions(&emrl, suggest_index, EMRL_SUGGEST_SLOTS(sizeof hist_buf));
+	}
+
+	// A lone ESC key doesn't swallow the next keystroke, the time allowed follows the simulated
+	// baud rate
+	unsigned long esc_baud = setup.throttle ? (unsigned long)ceil(setup.baud) : 0;
+	emrl_set_escape_timeout(&emrl, monotonic_us, emrl_escape_gap(esc_baud, 1000000));
+
+#ifdef USE_TRACE
+	// Trace records pair each keystroke with the output it produced
+	measure_latency = setup.latency;
+	if(measure_latency)
+	{
+		emrl_trace_init(&latency.trace, latency.records, TRACE_RECORDS);
+		emrl_set_trace(&emrl, &latency.trace);
+	}
+#endif
+
+	// Telnet negotiation goes before the prompt
+	use_telnet = setup.telnet;
+	if(use_telnet)
+	{
+		emrl_telnet_init(&telnet, telnet_write, NULL);
+		emrl_telnet_start(&telnet);
+	}
+
+	// Output is written straight to the file descriptor from here on, flush anything printed so far
+	(void)fflush(stdout);
+
+	// Long lines wrap at the width of the terminal window, or the telnet client's once it sends NAWS
+	emrl_set_width(&emrl, terminal_width(in_fd));
 
 	// Write a prompt as soon as we start the loop
-	ring_puts(PROMPT);
+	if(!restored)
+		show_prompt(&emrl);
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &stats.start);
 
 	bool eof = false;
 	do
 	{
-		int signo;
-		errno = sigwait(&signal, &signo);
-		if(0 != errno)
-			perror_exit("sigwait");
+		if(setup.throttle)
+			wait_baud_tick(&signal);
+		else
+			wait_io(in_fd, out_fd, eof);
+
+		write_from_ring(out_fd, setup.throttle);
 
-		assert(SIGRTMIN == signo);
+		// Output refused by a full ring shouldn't happen given the output reserve. emrl stops
+		// printing after a refusal, so once the ring has drained the line is redrawn on a new row.
+		if(ring_empty() && emrl_print_error(&emrl))
+		{
+			++stats.lost_output;
+			(void)ring_puts("\r\n");
+			show_prompt(&emrl);
+		}
+
+#ifdef USE_TRACE
+		if(measure_latency)
+		{
+			echoes_written();
+
+			// SIGQUIT prints the histograms so far
+			if(latency_dump)
+			{
+				latency_dump = 0;
+				print_latency();
+			}
+		}
+#endif
 
-		write_from_ring(out_fd);
+		// SIGUSR1 simulates asynchronous events logged while the user is typing
+		if(async_pending)
+			print_async_messages(&emrl);
+
+		if(resize_pending || (use_telnet && telnet.width != emrl_width(&emrl)))
+			update_width(&emrl, in_fd);
+
+		// SIGUSR2 replaces the process with a new copy of the program, once output has drained
+		// and queued commands have run
+		if(restart_pending && ring_empty() && 0 == emrl_lines_queued(&emrl) && 0 == command.in_flight)
+			restart(&emrl, in_fd, out_fd, argc, argv);
 
 		// Stop reading from terminal after EOF condition
 		if(!eof)
-			eof = feed_emrl(in_fd, &emrl);
+			eof = feed_emrl(in_fd, &emrl, setup.throttle);
+
+		if(command.handler)
+		{
+			print_command_output(&emrl);
+			dispatch_commands(&emrl);
+		}
+		else
+		{
+			run_queued_command(&emrl);
+		}
 	}
-	while(!eof || !ring_empty());
+	while(!eof || !ring_empty() || 0 != emrl_lines_queued(&emrl) || 0 != command.in_flight);
+
+	if(!setup.throttle)
+		print_stats();
+
+#ifdef USE_TRACE
+	if(measure_latency)
+		print_latency();
+#endif
 
 	return EXIT_SUCCESS;
 }
@@ -162,7 +527,7 @@ static inline void parse_args(struct setup *p_setup, int argc, char *argv[])
 	bool usage = false;
 
 	// Colon at the start of the opt string allows detection of missing option arguments
-	while((opt = getopt(argc, argv, ":b:ps:")) != -1 && !usage)
+	while((opt = getopt(argc, argv, ":ab:Cclpq:R:T:s:tuw:")) != -1 && !usage)
 	{
 		// If argument is missing we get a colon for opt and option is in optopt
 		bool missing_arg = (opt == ':');
@@ -171,6 +536,10 @@ static inline void parse_args(struct setup *p_setup, int argc, char *argv[])
 
 		switch(opt)
 		{
+        case 'a':
+            p_setup->suggest = true;
+            break;
+
         case 'b':
             if(missing_arg)
             {
@@ -191,30 +560,140 @@ static inline void parse_args(struct setup *p_setup, int argc, char *argv[])
 
             break;
 
+        case 'C':
+            p_setup->colour = true;
+            break;
+
+        case 'c':
+            p_setup->streaming = true;
+            break;
+
+        case 'l':
+#ifdef USE_TRACE
+            p_setup->latency = true;
+#else
+            // Needs the trace hooks, build with make trace
+            usage = true;
+#endif
+            break;
+
         case 'p':
             p_setup->mode = mode_pty;
             break;
 
+        case 'q':
+            // Queue lines while simulated commands take this many milliseconds each
+            if(missing_arg)
+            {
+                usage = true;
+            }
+            else
+            {
+                char *p_end;
+                p_setup->command_ms = strtol(optarg, &p_end, 10);
+                usage = ('\0' == *optarg || '\0' != *p_end || p_setup->command_ms < 0 ||
+                         p_setup->command_ms > 60000);
+            }
+            break;
+
+        case 'R':
+            // Added when restarting, must come after any other mode option
+            p_setup->mode = mode_restart;
+            p_setup->restore_path = optarg;
+            usage = missing_arg;
+            break;
+
         case 's':
             p_setup->mode = mode_socket;
             if(!missing_arg)
                 sock_path = optarg;
             break;
 
+        case 'T':
+            p_setup->term = optarg;
+            usage = missing_arg || !set_terminal(NULL, optarg);
+            break;
+
+        case 't':
+            p_setup->telnet = true;
+            break;
+
+        case 'u':
+            p_setup->throttle = false;
+            break;
+
+        case 'w':
+            // Run commands on this many worker threads, or 0 to run them in the main loop
+            if(missing_arg)
+            {
+                usage = true;
+            }
+            else
+            {
+                char *p_end;
+                long workers = strtol(optarg, &p_end, 10);
+                usage = ('\0' == *optarg || '\0' != *p_end || workers < 0 || workers > MAX_WORKERS);
+                p_setup->workers = (int)workers;
+            }
+            break;
+
         default:
             usage = true;
             break;
 		}
 	}
 
+	// Commands run by the handler are instant unless given a time
+	if(p_setup->workers >= 0 && p_setup->command_ms < 0)
+		p_setup->command_ms = 0;
+
 	if(usage || optind < argc)
 	{
 		const char *prog_path = (argc > 0) ? argv[0] : "posix";
-		(void)fprintf(stderr, "usage: %s: [-b <baud[K]]> [-p | -s [socket_path]]\n", prog_path);
+		(void)fprintf(stderr, "usage: %s: [-b <baud[K]> | -u] [-p | -s [socket_path]] [-t] [-l] [-c] [-C] [-a]\n"
+		              "       [-q command_ms] [-w workers] [-T dumb|vt100|xterm|auto] [-R restart_path]\n",
+		              prog_path);
 		exit(EXIT_FAILURE);
 	}
 }
 
+// Select a terminal profile by name, or ask the terminal for "auto". With a NULL p_emrl only
+// checks the name.
+static inline bool set_terminal(struct emrl_res *p_emrl, const char *p_name)
+{
+	static const struct
+	{
+		const char *name;
+		unsigned caps;
+	}
+	profiles[] =
+	{
+		{ "dumb", EMRL_TERM_DUMB },
+		{ "vt100", EMRL_TERM_VT100 },
+		{ "xterm", EMRL_TERM_XTERM }
+	};
+
+	for(size_t i = 0; i < sizeof profiles / sizeof profiles[0]; ++i)
+	{
+		if(0 == strcmp(p_name, profiles[i].name))
+		{
+			if(NULL != p_emrl)
+				emrl_set_terminal(p_emrl, profiles[i].caps);
+			return true;
+		}
+	}
+
+	// Stays with the default profile unless the terminal replies
+	if(0 == strcmp(p_name, "auto"))
+	{
+		if(NULL != p_emrl)
+			emrl_detect_terminal(p_emrl);
+		return true;
+	}
+
+	return false;
+}
+
 static inline void setup_termination_handlers(void)
 {
 	// Handle the standard termination signals that don't cause a core dump
@@ -247,6 +726,57 @@ static inline void setup_termination_handlers(void)
 		perror_exit("sigaction(SIGHUP)");
 
 
+	// SIGUSR1 triggers an asynchronous message, restart system calls as it isn't a termination
+	struct sigaction async_action = {
+		.sa_handler = signal_async,
+		.sa_flags = SA_RESTART
+	};
+
+	if(sigemptyset(&async_action.sa_mask))
+		perror_exit("sigemptyset");
+
+	if(sigaction(SIGUSR1, &async_action, NULL) < 0)
+		perror_exit("sigaction(SIGUSR1)");
+
+	// SIGUSR2 restarts the program without losing the line being edited
+	struct sigaction restart_action = {
+		.sa_handler = signal_restart,
+		.sa_flags = SA_RESTART
+	};
+
+	if(sigemptyset(&restart_action.sa_mask))
+		perror_exit("sigemptyset");
+
+	if(sigaction(SIGUSR2, &restart_action, NULL) < 0)
+		perror_exit("sigaction(SIGUSR2)");
+
+	// SIGWINCH reports a change of terminal window size
+	struct sigaction resize_action = {
+		.sa_handler = signal_resize,
+		.sa_flags = SA_RESTART
+	};
+
+	if(sigemptyset(&resize_action.sa_mask))
+		perror_exit("sigemptyset");
+
+	if(sigaction(SIGWINCH, &resize_action, NULL) < 0)
+		perror_exit("sigaction(SIGWINCH)");
+
+#ifdef USE_TRACE
+	// SIGQUIT prints latency histograms without exiting
+	struct sigaction latency_action = {
+		.sa_handler = signal_latency,
+		.sa_flags = SA_RESTART
+	};
+
+	if(sigemptyset(&latency_action.sa_mask))
+		perror_exit("sigemptyset");
+
+	if(sigaction(SIGQUIT, &latency_action, NULL) < 0)
+		perror_exit("sigaction(SIGQUIT)");
+#endif
+
+
 	// Register cleanup function to be called at exit
 	if(atexit(cleanup) < 0)
 		perror_exit("atexit");
@@ -406,106 +936,837 @@ static inline void setup_baud_timer(sigset_t *p_sig, double baud)
 		perror_exit("timer_settime");
 }
 
+static inline void wait_baud_tick(sigset_t *p_sig)
+{
+	int signo;
+	errno = sigwait(p_sig, &signo);
+	if(0 != errno)
+		perror_exit("sigwait");
+
+	assert(SIGRTMIN == signo);
+}
+
+static inline void wait_io(int in_fd, int out_fd, bool eof)
+{
+	struct pollfd fds[3] = {
+		{ .fd = in_fd, .events = 0 },
+		{ .fd = out_fd, .events = 0 }
+	};
+
+	// Only ask for input when there is room for the output it may generate
+	if(!eof && ring_free() >= OUTPUT_RESERVE)
+		fds[0].events |= POLLIN;
+
+	if(!ring_empty())
+		fds[1].events |= POLLOUT;
+
+	// Input and output may share a file descriptor (pty or socket)
+	nfds_t nfds = 2;
+	if(in_fd == out_fd)
+	{
+		fds[0].events |= fds[1].events;
+		nfds = 1;
+	}
+
+	// Worker threads wake the loop when they have output
+	if(command.workers > 0)
+		fds[nfds++] = (struct pollfd){ .fd = output_pipe[0], .events = POLLIN };
+
+	// Don't block if there is still buffered input to process, or past the end of a command
+	int timeout = (input.pos < input.len) ? 0 : command_wait_ms();
+
+	if(poll(fds, nfds, timeout) < 0 && EINTR != errno)
+		perror_exit("poll");
+}
+
 static inline bool ring_empty(void)
 {
 	return (ring.p_get == ring.p_put);
 }
 
-static inline void ring_puts(const char *p_str)
+static inline size_t ring_free(void)
+{
+	// One byte is left unused so that a full ring can be distinguished from an empty one
+	ptrdiff_t used = ring.p_put - ring.p_get;
+	if(used < 0)
+		used += sizeof ring.buf;
+
+	return sizeof ring.buf - 1 - used;
+}
+
+static inline bool ring_puts(const char *p_str)
+{
+	return ring_write(p_str, strlen(p_str));
+}
+
+static inline bool ring_write(const char *p_data, size_t len)
 {
-	size_t len = strlen(p_str);
+	// All or nothing, a partial escape sequence would corrupt the display
+	if(len > ring_free())
+		return false;
+
+	ring.put_total += len;
 
 	size_t wrap = ring.p_end - ring.p_put;
 	if(len >= wrap)
 	{
-		memcpy(ring.p_put, p_str, wrap);
+		memcpy(ring.p_put, p_data, wrap);
 		len -= wrap;
-		p_str += wrap;
+		p_data += wrap;
 		ring.p_put = ring.buf;
 	}
 
-	memcpy(ring.p_put, p_str, len);
+	memcpy(ring.p_put, p_data, len);
 	ring.p_put += len;
+
+	return true;
 }
 
-static int emrl_puts(const char *p_str, FILE *p_file)
+static int emrl_puts(const char *p_str, emrl_file file)
 {
-	(void)p_file;
-	ring_puts(p_str);
-	return 0;
+	(void)file;
+
+	// Telnet client is echoing locally, emrl's echo isn't wanted
+	if(use_telnet && !telnet.echo)
+		return 0;
+
+	return ring_puts(p_str) ? 0 : EOF;
 }
 
-static inline void write_from_ring(int fd)
+static int telnet_write(const char *p_data, size_t len, emrl_file file)
+{
+	(void)file;
+	return ring_write(p_data, len) ? 0 : EOF;
+}
+
+static inline void write_from_ring(int fd, bool throttle)
 {
 	if(ring_empty())
 		return;
 
-	// Write will be non-blocking for a socket and blocking otherwise. This doesn't matter as
-	// either way we don't read until all the data is written.
+	// Write both halves of the ring in one call, unless simulating a baud rate in which case
+	// one byte is written for each timer tick
+	struct iovec iov[2];
+	int iovcnt = 1;
+	iov[0].iov_base = ring.p_get;
+	if(ring.p_put > ring.p_get)
+	{
+		iov[0].iov_len = ring.p_put - ring.p_get;
+	}
+	else
+	{
+		iov[0].iov_len = ring.p_end - ring.p_get;
+		iov[1].iov_base = ring.buf;
+		iov[1].iov_len = ring.p_put - ring.buf;
+		if(iov[1].iov_len > 0)
+			iovcnt = 2;
+	}
+
+	if(throttle)
+	{
+		iov[0].iov_len = 1;
+		iovcnt = 1;
+	}
+
+	// Write will be non-blocking for a socket or when unthrottled and blocking otherwise. A
+	// partial write just leaves the remainder queued in the ring for the next call.
 	//
-	// For a socket we could get either EGAIN or EWOULDBLOCK if kernel buffer is full. As far as I
-	// can see write shouldn't return zero (unlike read), but handle this case anyway.
-	ssize_t res = write(fd, ring.p_get, 1);
+	// We could get either EGAIN or EWOULDBLOCK if kernel buffer is full. As far as I can see
+	// write shouldn't return zero (unlike read), but handle this case anyway.
+	ssize_t res = writev(fd, iov, iovcnt);
 	if(res < 0)
 	{
 		if(EAGAIN != errno && EWOULDBLOCK != errno)
-			perror_exit("write");
+			perror_exit("writev");
 	}
 	else if(res > 0)
 	{
-		++ring.p_get;
-		if(ring.p_get >= ring.p_end)
-			ring.p_get = ring.buf;
+		stats.bytes_out += res;
+
+		ptrdiff_t to_end = ring.p_end - ring.p_get;
+		if(res >= to_end)
+			ring.p_get = ring.buf + (res - to_end);
+		else
+			ring.p_get += res;
 	}
 }
 
-static inline bool feed_emrl(int fd, struct emrl_res *p_emrl)
+static inline bool feed_emrl(int fd, struct emrl_res *p_emrl, bool throttle)
 {
-	// Don't do anything if there is output backed up in the ring
-	if(!ring_empty())
+	// When simulating a baud rate don't do anything if there is output backed up in the ring,
+	// otherwise keep going as long as there is room for the worst case output
+	if(throttle ? !ring_empty() : (ring_free() < OUTPUT_RESERVE))
 		return false;
 
-	// If no data is available, read may give either EAGAIN or EWOULDBLOCK for sockets. For a
-	// terminal it may give an EAGAIN error or return zero.
-	char chr;
-	ssize_t res = read(fd, &chr, 1);
-	if(res < 0)
+	if(input.pos == input.len)
 	{
-		if(EAGAIN != errno && EWOULDBLOCK != errno)
-			perror_exit("read");
+		// If no data is available, read may give either EAGAIN or EWOULDBLOCK for sockets. For a
+		// terminal it may give an EAGAIN error or return zero, otherwise zero indicates EOF.
+		ssize_t res = read(fd, input.buf, throttle ? 1 : sizeof input.buf);
+		if(res < 0)
+		{
+			if(EAGAIN != errno && EWOULDBLOCK != errno)
+				perror_exit("read");
 
-		return false;
+			return false;
+		}
+		else if(0 == res)
+		{
+			return !isatty(fd);
+		}
+
+		stats.bytes_in += res;
+
+		// Strip telnet commands, there may be no data left
+		if(use_telnet)
+			res = emrl_telnet_filter(&telnet, input.buf, res);
+
+		input.len = res;
+		input.pos = 0;
+
+		if(0 == res)
+			return false;
 	}
-	else if(0 == res)
+
+	do
 	{
-		return false;
+		char chr = input.buf[input.pos++];
+
+		// Allow Ctrl-D to quit when reading from stdin
+		if(EOT == chr && STDIN_FILENO == fd)
+			return true;
+
+		const char *p_command = emrl_process_char(p_emrl, chr);
+
+#ifdef USE_TRACE
+		if(measure_latency)
+			collect_latency();
+#endif
+
+		// Without a line queue the command is run straight away, before any more input
+		if(NULL != p_command)
+		{
+			(void)ring_puts("\r\n");
+			print_command(p_emrl, p_command, emrl_line_part(p_emrl));
+
+			// Write the prompt
+			show_prompt(p_emrl);
+		}
 	}
+	while(input.pos < input.len && ring_free() >= OUTPUT_RESERVE);
 
-	// Allow Ctrl-D to quit when reading from stdin
-	if(EOT == chr && STDIN_FILENO == fd)
-		return true;
+	return false;
+}
 
-	const char *p_command = emrl_process_char(p_emrl, chr);
+static inline void print_stats(void)
+{
+	struct timespec end;
+	(void)clock_gettime(CLOCK_MONOTONIC, &end);
+	double sec = (end.tv_sec - stats.start.tv_sec) + (end.tv_nsec - stats.start.tv_nsec) / 1e9;
+
+	(void)fprintf(stderr,
+	              "\r\n%llu bytes in, %llu bytes out in %.3f s (%.0f bytes/s in)\r\n",
+	              stats.bytes_in,
+	              stats.bytes_out,
+	              sec,
+	              stats.bytes_in / sec);
+
+	if(stats.lost_output > 0)
+		(void)fprintf(stderr, "Output lost %lu times\r\n", stats.lost_output);
+}
 
-	// Return early if there is no command to process
-	if(NULL == p_command)
-		return false;
-	
-	// Ignore the command if it is empty
-	if('\0' != p_command[0])
+static inline void show_prompt(struct emrl_res *p_emrl)
+{
+	// Telnet client is echoing locally, there is no line to redraw and emrl output is discarded
+	if(use_telnet && !telnet.echo)
+		(void)ring_puts(PROMPT);
+	else
+		emrl_redraw(p_emrl);
+}
+
+static inline void print_async_messages(struct emrl_res *p_emrl)
+{
+	// Print all messages that arrived since the last check with a single redraw of the line. Each
+	// message needs room for itself, plus the redraw at the end.
+	char msg[64];
+	if(ring_free() < OUTPUT_RESERVE + sizeof msg)
+		return;
+
+	// Block the signal while updating the count
+	sigset_t usr1;
+	sigset_t orig;
+	if(sigemptyset(&usr1) || sigaddset(&usr1, SIGUSR1) < 0)
+		perror_exit("sigaddset(SIGUSR1)");
+
+	if(sigprocmask(SIG_BLOCK, &usr1, &orig) < 0)
+		perror_exit("sigprocmask");
+
+	emrl_hide(p_emrl);
+	while(async_pending > 0 && ring_free() >= OUTPUT_RESERVE + sizeof msg)
 	{
-		// Print the command text under the command line and add it to history
-		ring_puts("\r\n>>>>>");
-		ring_puts(p_command);
+		--async_pending;
+		(void)snprintf(msg, sizeof msg, "[async message %lu]\r\n", ++async_count);
+		emrl_print_async(p_emrl, msg);
+	}
+	emrl_show(p_emrl);
+
+	if(sigprocmask(SIG_SETMASK, &orig, NULL) < 0)
+		perror_exit("sigprocmask");
+}
+
+// Width from the telnet client's NAWS or the terminal's window size, 0 if unknown
+static inline size_t terminal_width(int fd)
+{
+	if(use_telnet)
+		return telnet.width;
+
+	struct winsize size;
+	if(!isatty(fd) || ioctl(fd, TIOCGWINSZ, &size) < 0)
+		return 0;
+
+	return size.ws_col;
+}
+
+// The line is hidden while the width changes so that it is removed as it was drawn. Terminals
+// that reflow wrapped rows on resize may still leave some of it behind.
+static inline void update_width(struct emrl_res *p_emrl, int fd)
+{
+	// Wait for room to hide and show the line
+	if(ring_free() < OUTPUT_RESERVE)
+		return;
+
+	resize_pending = 0;
+	size_t width = terminal_width(fd);
+	if(width != emrl_width(p_emrl))
+	{
+		emrl_hide(p_emrl);
+		emrl_set_width(p_emrl, width);
+		emrl_show(p_emrl);
+	}
+}
+
+// Print the command text under the command line and add it to history. Pieces of an over-length
+// line are labelled and kept out of the history, empty commands are ignored.
+static inline void print_command(struct emrl_res *p_emrl, const char *p_command, enum emrl_part part)
+{
+	if(emrl_part_whole != part)
+	{
+		static const char *const part_names[] = {"", "(first) ", "(middle) ", "(last) "};
+		(void)ring_puts(">>>>>");
+		(void)ring_puts(part_names[part]);
+		(void)ring_puts(p_command);
+		(void)ring_puts("\r\n");
+	}
+	else if('\0' != p_command[0])
+	{
+		(void)ring_puts(">>>>>");
+		(void)ring_puts(p_command);
+		(void)ring_puts("\r\n");
 		emrl_add_to_history(p_emrl, p_command);
 	}
+}
 
-	// Write the prompt
-	ring_puts("\r\n" PROMPT);
+// Commands from the type-ahead queue run one at a time, each taking the time given with -q. Its
+// output is printed above the line being edited once it completes.
+static inline void run_queued_command(struct emrl_res *p_emrl)
+{
+	enum emrl_part part;
+	const char *p_command = emrl_peek_line(p_emrl, &part);
+	if(NULL == p_command)
+		return;
 
-	return false;
+	struct timespec now;
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	if(!command.running)
+	{
+		command.running = true;
+		command.done.tv_sec = now.tv_sec + command.ms / 1000;
+		command.done.tv_nsec = now.tv_nsec + (command.ms % 1000) * 1000000;
+		if(command.done.tv_nsec >= 1000000000)
+		{
+			++command.done.tv_sec;
+			command.done.tv_nsec -= 1000000000;
+		}
+	}
+
+	if(command_wait_ms() > 0 || ring_free() < COMMAND_OUTPUT_BYTES)
+		return;
+
+	emrl_hide(p_emrl);
+	print_command(p_emrl, p_command, part);
+	emrl_show(p_emrl);
+
+	emrl_pop_line(p_emrl);
+	command.running = false;
+}
+
+// Milliseconds until the running command completes, -1 if there isn't one
+static inline int command_wait_ms(void)
+{
+	if(!command.running)
+		return -1;
+
+	struct timespec now;
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	long long ns = (command.done.tv_sec - now.tv_sec) * 1000000000LL + (command.done.tv_nsec - now.tv_nsec);
+	if(ns <= 0)
+		return 0;
+
+	// Round up so that poll doesn't wake just before the end
+	return (int)((ns + 999999) / 1000000);
+}
+
+// Stands in for a command that takes a while, e.g. one waiting on a device. Sleeps for the time
+// given with -q, then gives the same output as print_command().
+static void command_handler(const char *p_command, char *p_output, size_t size)
+{
+	struct timespec wait = {
+		.tv_sec = command.ms / 1000,
+		.tv_nsec = (command.ms % 1000) * 1000000
+	};
+
+	while(0 != nanosleep(&wait, &wait) && EINTR == errno)
+		;
+
+	(void)snprintf(p_output, size, ">>>>>%s\r\n", p_command);
+}
+
+// With no workers commands are run in the main loop, which stops echoing input while they do
+static inline void start_workers(unsigned count)
+{
+	command.workers = count;
+	if(0 == count)
+		return;
+
+	// Neither end may block, nor be left open across a restart
+	if(0 != pipe(output_pipe))
+		perror_exit("pipe");
+
+	for(unsigned i = 0; i < 2; ++i)
+	{
+		if(0 != fcntl(output_pipe[i], F_SETFL, O_NONBLOCK) || 0 != fcntl(output_pipe[i], F_SETFD, FD_CLOEXEC))
+			perror_exit("fcntl(output_pipe)");
+	}
+
+	// Signals are left to the main loop, the threads inherit the mask they are created with
+	sigset_t all;
+	sigset_t orig;
+	if(sigfillset(&all))
+		perror_exit("sigfillset");
+
+	errno = pthread_sigmask(SIG_SETMASK, &all, &orig);
+	if(0 != errno)
+		perror_exit("pthread_sigmask");
+
+	for(unsigned i = 0; i < count; ++i)
+	{
+		struct worker *p_worker = &workers[i];
+		emrl_queue_init(&p_worker->lines, p_worker->lines_buf, sizeof p_worker->lines_buf);
+		emrl_queue_init(&p_worker->output, p_worker->output_buf, sizeof p_worker->output_buf);
+		if(0 != sem_init(&p_worker->queued, 0, 0))
+			perror_exit("sem_init");
+
+		errno = pthread_create(&p_worker->thread, NULL, worker_main, p_worker);
+		if(0 != errno)
+			perror_exit("pthread_create");
+	}
+
+	errno = pthread_sigmask(SIG_SETMASK, &orig, NULL);
+	if(0 != errno)
+		perror_exit("pthread_sigmask");
+}
+
+static void *worker_main(void *p_arg)
+{
+	struct worker *p_worker = p_arg;
+	char line[EMRL_MAX_CMD_LEN + 1];
+	char output[COMMAND_TEXT_BYTES];
+
+	for(;;)
+	{
+		if(0 != sem_wait(&p_worker->queued))
+		{
+			if(EINTR != errno)
+				perror_exit("sem_wait");
+
+			continue;
+		}
+
+		// One line is queued for each post
+		if(NULL == emrl_queue_get_line(&p_worker->lines, line, sizeof line))
+			continue;
+
+		command_handler(line, output, sizeof output);
+
+		// The main loop drains the output while there is room in the ring for it
+		while(!emrl_queue_put_line(&p_worker->output, output))
+		{
+			struct timespec retry = { .tv_nsec = 1000000 };
+			(void)nanosleep(&retry, NULL);
+		}
+
+		// A full pipe already has a wake up waiting
+		(void)write(output_pipe[1], "", 1);
+	}
+
+	return NULL;
+}
+
+// Lines leave the type-ahead queue as soon as a worker takes them, going to each worker in turn
+// and skipping any that are already full. They are added to the history at once, so they can be
+// recalled while they run. Output from different workers may arrive out of order.
+static inline void dispatch_commands(struct emrl_res *p_emrl)
+{
+	enum emrl_part part;
+	const char *p_command;
+	while(ring_free() >= COMMAND_OUTPUT_BYTES && NULL != (p_command = emrl_peek_line(p_emrl, &part)))
+	{
+		// Pieces of an over-length line and empty lines aren't run
+		if(emrl_part_whole != part || '\0' == p_command[0])
+		{
+			emrl_hide(p_emrl);
+			print_command(p_emrl, p_command, part);
+			emrl_show(p_emrl);
+		}
+		else if(0 == command.workers)
+		{
+			char output[COMMAND_TEXT_BYTES];
+			command_handler(p_command, output, sizeof output);
+			emrl_hide(p_emrl);
+			(void)ring_puts(output);
+			emrl_add_to_history(p_emrl, p_command);
+			emrl_show(p_emrl);
+		}
+		else
+		{
+			struct worker *p_worker = NULL;
+			for(unsigned i = 0; i < command.workers && NULL == p_worker; ++i)
+			{
+				struct worker *p_next = &workers[(command.next_worker + i) % command.workers];
+				if(emrl_queue_put_line(&p_next->lines, p_command))
+					p_worker = p_next;
+			}
+
+			if(NULL == p_worker)
+				return;
+
+			if(0 != sem_post(&p_worker->queued))
+				perror_exit("sem_post");
+
+			command.next_worker = (unsigned)(p_worker - workers + 1) % command.workers;
+			++command.in_flight;
+			emrl_add_to_history(p_emrl, p_command);
+		}
+
+		emrl_pop_line(p_emrl);
+	}
 }
 
+// Print the output of all commands completed since the last check with a single redraw of the
+// line, while there is room in the ring for the redraw and the longest output
+static inline void print_command_output(struct emrl_res *p_emrl)
+{
+	if(0 == command.in_flight)
+		return;
+
+	// Clear wake ups first, so that output queued after this check wakes the next poll
+	char wake[64];
+	while(read(output_pipe[0], wake, sizeof wake) > 0)
+		;
+
+	bool hidden = false;
+	char output[COMMAND_TEXT_BYTES];
+	for(unsigned i = 0; i < command.workers; ++i)
+	{
+		while(ring_free() >= COMMAND_OUTPUT_BYTES &&
+		      NULL != emrl_queue_get_line(&workers[i].output, output, sizeof output))
+		{
+			if(!hidden)
+			{
+				emrl_hide(p_emrl);
+				hidden = true;
+			}
+
+			(void)ring_puts(output);
+			--command.in_flight;
+		}
+	}
+
+	if(hidden)
+		emrl_show(p_emrl);
+}
+
+// Time source for the escape timeout
+static emrl_cycles monotonic_us(void)
+{
+	struct timespec now;
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	return (emrl_cycles)(now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+
+// Replace the process with a new copy of the program, which carries on editing the same line with
+// the same input and output. The file descriptors stay open across exec, the rest is passed in a
+// file named by the -R option. Only returns if the restart fails.
+static inline void restart(const struct emrl_res *p_emrl, int in_fd, int out_fd, int argc, char *argv[])
+{
+	restart_pending = 0;
+
+	static unsigned char state[STATE_BYTES];
+	struct restart header =
+	{
+		.in_fd = in_fd,
+		.out_fd = out_fd,
+		.reset_stdin = reset_stdin,
+		.unlink_sock_path = unlink_sock_path,
+		.term_orig = term_orig,
+		.input_len = input.len - input.pos,
+		.state_len = emrl_save_state(p_emrl, state, sizeof state)
+	};
+
+	if(header.state_len > sizeof state)
+	{
+		(void)fprintf(stderr, "Editor state too large to restart\r\n");
+		return;
+	}
+
+	char path[] = RESTART_PATH_TEMPLATE;
+	int fd = mkstemp(path);
+	FILE *p_file = (fd < 0) ? NULL : fdopen(fd, "wb");
+	if(NULL == p_file)
+	{
+		perror("restart");
+		if(fd >= 0)
+		{
+			(void)close(fd);
+			(void)unlink(path);
+		}
+		return;
+	}
+
+	// Input that was read but not yet processed goes with the state
+	bool written = (1 == fwrite(&header, sizeof header, 1, p_file) &&
+	                header.input_len == fwrite(input.buf + input.pos, 1, header.input_len, p_file) &&
+	                header.state_len == fwrite(state, 1, header.state_len, p_file));
+	if(0 != fclose(p_file) || !written)
+	{
+		perror("restart");
+		(void)unlink(path);
+		return;
+	}
+
+	// Same arguments, replacing the restart option from any earlier restart
+	static char restart_opt[] = "-R";
+	char *new_argv[argc + 3];
+	int new_argc = 0;
+	for(int i = 0; i < argc; ++i)
+	{
+		if(0 == strcmp(argv[i], restart_opt) && i + 1 < argc)
+			++i;
+		else
+			new_argv[new_argc++] = argv[i];
+	}
+
+	new_argv[new_argc++] = restart_opt;
+	new_argv[new_argc++] = path;
+	new_argv[new_argc] = NULL;
+
+	(void)execv(argv[0], new_argv);
+	perror("execv");
+	(void)unlink(path);
+}
+
+// Pick up from the process that was replaced by restart(), the file is removed once read
+static inline void read_restart(const char *p_path, struct restart *p_restart, unsigned char *p_state)
+{
+	FILE *p_file = fopen(p_path, "rb");
+	if(NULL == p_file)
+		perror_exit(p_path);
+
+	(void)unlink(p_path);
+
+	bool ok = (1 == fread(p_restart, sizeof *p_restart, 1, p_file) &&
+	           p_restart->input_len <= sizeof input.buf && p_restart->state_len <= STATE_BYTES &&
+	           p_restart->input_len == fread(input.buf, 1, p_restart->input_len, p_file) &&
+	           p_restart->state_len == fread(p_state, 1, p_restart->state_len, p_file));
+	(void)fclose(p_file);
+
+	if(!ok)
+	{
+		(void)fprintf(stderr, "Bad restart file '%s'\n", p_path);
+		exit(EXIT_FAILURE);
+	}
+
+	input.len = p_restart->input_len;
+	input.pos = 0;
+
+	// Clean up at exit as the replaced process would have
+	term_orig = p_restart->term_orig;
+	reset_stdin = p_restart->reset_stdin;
+	unlink_sock_path = p_restart->unlink_sock_path;
+}
+
+// Colour the command word by whether it is one of ours, and arguments that are numbers
+static size_t highlight(void *p_ctx, const char *p_line, size_t len, struct emrl_span *p_spans, size_t max_spans)
+{
+	static const char *const commands[] = { "help", "reset", "set", "show" };
+	(void)p_ctx;
+
+	size_t count = 0;
+	size_t pos = 0;
+	bool first = true;
+	while(pos < len && count < max_spans)
+	{
+		while(pos < len && ' ' == p_line[pos])
+			++pos;
+
+		size_t start = pos;
+		bool number = true;
+		while(pos < len && ' ' != p_line[pos])
+			number &= (0 != isdigit((unsigned char)p_line[pos++]));
+
+		if(start == pos)
+			break;
+
+		uint8_t attr = 0;
+		if(first)
+		{
+			attr = 2;
+			for(size_t i = 0; i < sizeof commands / sizeof commands[0]; ++i)
+			{
+				if(strlen(commands[i]) == pos - start && 0 == memcmp(commands[i], p_line + start, pos - start))
+					attr = 1;
+			}
+
+			first = false;
+		}
+		else if(number)
+		{
+			attr = 3;
+		}
+
+		if(0 != attr)
+		{
+			p_spans[count].start = start;
+			p_spans[count].len = pos - start;
+			p_spans[count].attr = attr;
+			++count;
+		}
+	}
+
+	return count;
+}
+
+#ifdef USE_TRACE
+// Called after each character is passed to emrl. Its trace records are a character event followed
+// by a render event if anything was echoed, in which case the echo ends at the ring's put_total.
+static inline void collect_latency(void)
+{
+	bool key = false;
+	emrl_cycles key_time = 0;
+
+	struct emrl_trace_record record;
+	while(emrl_trace_read(&latency.trace, &record))
+	{
+		if(emrl_trace_char == record.event)
+		{
+			if(!key)
+			{
+				key = true;
+				key_time = record.time;
+			}
+		}
+		else if(emrl_trace_render == record.event && key)
+		{
+			// Renders without a keystroke, e.g. redrawing the prompt, aren't counted
+			if(latency.echo_put - latency.echo_get < ECHOES_PENDING)
+			{
+				struct echo *p_echo = &latency.echoes[latency.echo_put++ % ECHOES_PENDING];
+				p_echo->key_time = key_time;
+				p_echo->render_time = record.time;
+				p_echo->out_end = ring.put_total;
+			}
+			else
+			{
+				++latency.untracked;
+			}
+
+			key = false;
+		}
+	}
+}
+
+// Called after writing from the ring, completes the echoes that have been written in full
+static inline void echoes_written(void)
+{
+	emrl_cycles now = EMRL_TRACE_TIME();
+	while(latency.echo_get != latency.echo_put)
+	{
+		const struct echo *p_echo = &latency.echoes[latency.echo_get % ECHOES_PENDING];
+		if(p_echo->out_end > stats.bytes_out)
+			break;
+
+		add_to_histogram(&latency.process, p_echo->render_time - p_echo->key_time);
+		add_to_histogram(&latency.queued, now - p_echo->render_time);
+		add_to_histogram(&latency.total, now - p_echo->key_time);
+		++latency.echo_get;
+	}
+}
+
+static inline void add_to_histogram(struct histogram *p_hist, emrl_cycles time)
+{
+	// Bucket n counts times below 2^n
+	unsigned bucket = 0;
+	while(time > 0 && bucket < LATENCY_BUCKETS - 1)
+	{
+		time >>= 1;
+		++bucket;
+	}
+
+	++p_hist->counts[bucket];
+}
+
+static void print_latency(void)
+{
+	const struct histogram *hists[] = { &latency.total, &latency.process, &latency.queued };
+
+	for(size_t i = 0; i < sizeof hists / sizeof hists[0]; ++i)
+	{
+		unsigned long samples = 0;
+		for(unsigned bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+			samples += hists[i]->counts[bucket];
+
+		(void)fprintf(stderr, "\r\n%s latency, %lu samples\r\n", hists[i]->name, samples);
+		for(unsigned bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+		{
+			unsigned long count = hists[i]->counts[bucket];
+			if(count > 0)
+			{
+				(void)fprintf(stderr,
+				              "  %s %8lu us %10lu %6.2f%%\r\n",
+				              (bucket < LATENCY_BUCKETS - 1) ? "< " : ">=",
+				              1ul << ((bucket < LATENCY_BUCKETS - 1) ? bucket : bucket - 1),
+				              count,
+				              100.0 * count / samples);
+			}
+		}
+	}
+
+	if(latency.untracked > 0 || emrl_trace_dropped(&latency.trace) > 0)
+	{
+		(void)fprintf(stderr,
+		              "%lu echoes untracked, %u trace records dropped\r\n",
+		              latency.untracked,
+		              emrl_trace_dropped(&latency.trace));
+	}
+}
+
+static void signal_latency(int signum)
+{
+	(void)signum;
+	latency_dump = 1;
+}
+#endif
+
 static void cleanup(void)
 {
 	// From Linux atexit(3) man page:
@@ -539,6 +1800,24 @@ static inline void perror_exit(const char *info)
 	exit(EXIT_FAILURE);
 }
 
+static void signal_async(int signum)
+{
+	(void)signum;
+	++async_pending;
+}
+
+static void signal_restart(int signum)
+{
+	(void)signum;
+	restart_pending = 1;
+}
+
+static void signal_resize(int signum)
+{
+	(void)signum;
+	resize_pending = 1;
+}
+
 static void signal_exit(int signum)
 {
 	cleanup();
@@ -0,0 +1,152 @@
+// Checks emrl_queue_process() feeding a machine mode editor with a line queue, run by make check
+//
+// usage: queue
+//
+// The command buffer and line queue are only a few lines long, so the line queue fills while input
+// is still waiting in the receive queue. emrl then holds a line at its delimiter, or a streamed
+// chunk, and takes no more input. emrl_queue_process() must return rather than spin, leaving the
+// input queued, and carry on where it left off once lines have been popped. Every line and chunk
+// must arrive once, in order. An alarm fails the check if a call never returns.
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "emrl.h"
+#include "emrl_queue.h"
+
+
+#define CMD_BUF_BYTES		16
+#define LINE_QUEUE_BYTES	20
+#define RX_BYTES			128
+#define OUT_BYTES			256
+#define MAX_ROUNDS			100
+#define TIMEOUT_S			5
+
+static const char lines_input[] = "one\rtwo\rthree\rfour\rfive\rsix\rseven\r";
+static const char lines_expected[] = "one|two|three|four|five|six|seven|";
+
+// Chunks of the long line are joined back together, '|' marks the end of each whole line
+static const char stream_input[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEF\rend\r";
+static const char stream_expected[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEF|end|";
+
+static unsigned long failures;
+
+
+static int null_puts(const char *p_str, emrl_file file)
+{
+	(void)p_str;
+	(void)file;
+	return 0;
+}
+
+static void timed_out(int signum)
+{
+	(void)signum;
+	static const char msg[] = "FAIL: emrl_queue_process() didn't return\n";
+	(void)write(STDERR_FILENO, msg, sizeof msg - 1);
+	_exit(EXIT_FAILURE);
+}
+
+static void fail(const char *p_what, const char *p_detail)
+{
+	(void)fprintf(stderr, "FAIL: %s (%s)\n", p_what, p_detail);
+	++failures;
+}
+
+// Feed the input through a receive queue, popping lines only once emrl can take no more input
+static void check(const char *p_name, const char *p_input, const char *p_expected, bool streaming)
+{
+	struct emrl_res emrl;
+	char cmd_buf[CMD_BUF_BYTES];
+	char line_buf[LINE_QUEUE_BYTES];
+	char rx_buf[RX_BYTES];
+	struct emrl_queue rx;
+
+	emrl_init(&emrl, null_puts, NULL, "\r", cmd_buf, sizeof cmd_buf, NULL, 0);
+	emrl_set_machine_mode(&emrl, true);
+	emrl_set_streaming(&emrl, streaming);
+	emrl_set_line_queue(&emrl, line_buf, sizeof line_buf);
+
+	emrl_queue_init(&rx, rx_buf, sizeof rx_buf);
+	if(!emrl_queue_write(&rx, p_input, strlen(p_input)))
+	{
+		fail(p_name, "input doesn't fit the receive queue");
+		return;
+	}
+
+	char out[OUT_BYTES];
+	size_t out_len = 0;
+	unsigned long stalls = 0;
+	for(unsigned round = 0; round < MAX_ROUNDS; ++round)
+	{
+		if(NULL != emrl_queue_process(&rx, &emrl))
+			fail(p_name, "line returned with a line queue");
+
+		const char *p_span;
+		bool waiting = (0 != emrl_queue_acquire(&rx, &p_span));
+		if(waiting)
+			++stalls;
+
+		if(0 == emrl_lines_queued(&emrl))
+		{
+			if(waiting)
+				fail(p_name, "input left queued with room in the line queue");
+
+			break;
+		}
+
+		enum emrl_part part;
+		const char *p_line;
+		while(NULL != (p_line = emrl_peek_line(&emrl, &part)))
+		{
+			size_t len = strlen(p_line);
+			if(len + 2 > sizeof out - out_len)
+			{
+				fail(p_name, "too much output");
+				return;
+			}
+
+			(void)memcpy(out + out_len, p_line, len);
+			out_len += len;
+			if(emrl_part_whole == part || emrl_part_last == part)
+				out[out_len++] = '|';
+
+			emrl_pop_line(&emrl);
+		}
+	}
+
+	out[out_len] = '\0';
+	if(0 != strcmp(out, p_expected))
+		fail(p_name, out);
+
+	if(0 == stalls)
+		fail(p_name, "line queue never filled");
+
+	printf("%s: %lu calls stopped by a full line queue\n", p_name, stalls);
+}
+
+int main(void)
+{
+#if defined(USE_MACHINE_MODE) && defined(USE_LINE_QUEUE) && defined(USE_STREAMING)
+	(void)signal(SIGALRM, timed_out);
+	(void)alarm(TIMEOUT_S);
+
+	check("lines", lines_input, lines_expected, false);
+	check("chunks", stream_input, stream_expected, true);
+
+	if(0 != failures)
+	{
+		printf("%lu failures\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	printf("ok\n");
+#else
+	printf("needs USE_MACHINE_MODE, USE_LINE_QUEUE and USE_STREAMING\n");
+#endif
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,193 @@
+// Compare history retention policies by how often a command is still in the history when it is
+// entered again
+//
+// usage: retention [trace_file]
+//
+// The trace has one command per line. Without one, a day at a device console is generated: a few
+// short commands used all the time, long diagnostic commands rerun a couple of times, and one off
+// configuration commands. A command found in the history is recalled with the up arrow and entered
+// unchanged, as an operator would, otherwise it is typed.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emrl.h"
+
+
+#define MAX_COMMANDS		20000
+#define GENERATED_COMMANDS	5000
+#define SEQ_UP				"\033[A"
+
+struct result
+{
+	unsigned long hits;
+	unsigned long ups;
+};
+
+static const size_t history_sizes[] = { 48, 64, 96, 128, 192, EMRL_HISTORY_BUF_BYTES };
+
+static char commands[MAX_COMMANDS][EMRL_MAX_CMD_LEN];
+static size_t command_count;
+
+static int null_puts(const char *p_str, emrl_file file)
+{
+	(void)p_str;
+	(void)file;
+	return 0;
+}
+
+static bool read_trace(const char *p_path)
+{
+	FILE *p_file = fopen(p_path, "r");
+	if(NULL == p_file)
+	{
+		perror(p_path);
+		return false;
+	}
+
+	// Lines too long to recall are cut short, like the line editor would
+	char line[1024];
+	while(command_count < MAX_COMMANDS && NULL != fgets(line, sizeof line, p_file))
+	{
+		size_t len = strcspn(line, "\r\n");
+		if(len >= sizeof commands[0])
+			len = sizeof commands[0] - 1;
+
+		if(len > 0)
+		{
+			(void)memcpy(commands[command_count], line, len);
+			commands[command_count++][len] = '\0';
+		}
+	}
+
+	(void)fclose(p_file);
+	return true;
+}
+
+static void generate_trace(void)
+{
+	static const char *const frequent[] =
+	{
+		"status", "status", "status", "show log", "show log", "uptime",
+		"show interfaces", "ping 10.0.0.1", "reset counters"
+	};
+	static const char *const modules[] = { "uart", "spi", "i2c", "dma", "timer", "adc" };
+
+	srand(1);
+	while(command_count < GENERATED_COMMANDS)
+	{
+		char *p_cmd = commands[command_count++];
+		int kind = rand() % 100;
+		if(kind < 70)
+		{
+			(void)strcpy(p_cmd, frequent[rand() % (sizeof frequent / sizeof frequent[0])]);
+		}
+		else if(kind < 85)
+		{
+			(void)snprintf(p_cmd, sizeof commands[0],
+			               "diag dump --module=%s --level=%d --since=%02d:%02d --format=verbose --output=ring",
+			               modules[rand() % 6], rand() % 4, rand() % 24, rand() % 60);
+
+			// Often run again shortly after
+			for(int repeat = rand() % 3; repeat > 0 && command_count < GENERATED_COMMANDS; --repeat)
+				(void)strcpy(commands[command_count++], p_cmd);
+		}
+		else
+		{
+			(void)snprintf(p_cmd, sizeof commands[0], "route add 192.168.%d.0/24 via 10.0.0.%d",
+			               rand() % 256, 1 + rand() % 254);
+		}
+	}
+}
+
+static void feed(struct emrl_res *p_emrl, const char *p_str)
+{
+	size_t len = strlen(p_str);
+	while(len > 0)
+	{
+		size_t used;
+		const char *p_command = emrl_process_buf(p_emrl, p_str, len, &used);
+		if(NULL != p_command && '\0' != *p_command)
+			emrl_add_to_history(p_emrl, p_command);
+
+		p_str += used;
+		len -= used;
+	}
+}
+
+static struct result run(size_t hist_size, bool retain)
+{
+	static char cmd_buf[EMRL_MAX_CMD_LEN + 1];
+	static char hist_buf[EMRL_HISTORY_BUF_BYTES];
+	struct emrl_res emrl;
+	emrl_init(&emrl, null_puts, NULL, "\r", cmd_buf, sizeof cmd_buf, hist_buf, hist_size);
+	emrl_set_history_retention(&emrl, retain);
+
+	struct result result = { 0, 0 };
+	for(size_t i = 0; i < command_count; ++i)
+	{
+		// How far back is the command, if it's there at all?
+		char entry[EMRL_MAX_CMD_LEN + 1];
+		size_t back = 0;
+		while(emrl_history_entry(&emrl, back, entry) && 0 != strcmp(entry, commands[i]))
+			++back;
+
+		if(emrl_history_entry(&emrl, back, entry))
+		{
+			++result.hits;
+			result.ups += back + 1;
+			for(size_t up = 0; up <= back; ++up)
+				feed(&emrl, SEQ_UP);
+		}
+		else
+		{
+			feed(&emrl, commands[i]);
+		}
+
+		feed(&emrl, "\r");
+	}
+
+	return result;
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc > 1)
+	{
+		if(!read_trace(argv[1]))
+			return EXIT_FAILURE;
+	}
+	else
+	{
+		generate_trace();
+	}
+
+	if(0 == command_count)
+	{
+		(void)fprintf(stderr, "No commands in trace\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%zu commands\n\n", command_count);
+	printf("%8s %22s %22s\n", "", "fifo", "retain");
+	printf("%8s %8s %6s %6s %8s %6s %6s\n", "bytes", "hit %", "%/KB", "ups", "hit %", "%/KB", "ups");
+	for(size_t i = 0; i < sizeof history_sizes / sizeof history_sizes[0]; ++i)
+	{
+		size_t size = history_sizes[i];
+		printf("%8zu", size);
+		for(int retain = 0; retain < 2; ++retain)
+		{
+			struct result result = run(size, retain);
+			double hit_rate = 100.0 * result.hits / command_count;
+			printf(" %8.1f %6.1f %6.2f",
+			       hit_rate,
+			       hit_rate * 1024 / size,
+			       result.hits ? (double)result.ups / result.hits : 0.0);
+		}
+		printf("\n");
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,256 @@
+// Memory used by the histories of many sessions, and how often a command is still in its session's
+// history when entered again, with a fixed buffer per session against sharing an emrl_pool
+//
+// usage: sessions [count] [bytes_per_session]
+//
+// A few sessions are busy and most are seldom used, as on a server with many consoles connected.
+// Each session mixes a few short commands used all the time, long diagnostic commands rerun a
+// couple of times and one off configuration commands. The pool is given bytes_per_session for each
+// session, default 64, and each history may grow to EMRL_HISTORY_BUF_BYTES.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "emrl.h"
+#include "emrl_pool.h"
+
+
+#define DEFAULT_SESSIONS		4000
+#define DEFAULT_SHARE			64
+#define COMMANDS_PER_SESSION	40
+
+struct session
+{
+	struct emrl_res emrl;
+	struct emrl_pool_history hist;
+	char cmd_buf[EMRL_MAX_CMD_LEN + 1];
+	char diag[EMRL_MAX_CMD_LEN + 1];	// Last diagnostic command, often rerun
+};
+
+struct result
+{
+	size_t bytes;
+	unsigned long hits;
+	double add_ns;
+};
+
+static size_t session_count = DEFAULT_SESSIONS;
+static size_t share = DEFAULT_SHARE;
+static struct session *p_sessions;
+static char *p_bufs;
+static struct emrl_pool pool;
+
+static int null_puts(const char *p_str, emrl_file file)
+{
+	(void)p_str;
+	(void)file;
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The same sequence for every run, busy sessions have low numbers
+static struct session *next_command(char *p_cmd)
+{
+	static const char *const frequent[] =
+	{
+		"status", "status", "show log", "uptime", "show interfaces", "ping 10.0.0.1"
+	};
+	static const char *const modules[] = { "uart", "spi", "i2c", "dma", "timer", "adc" };
+
+	double u = (double)rand() / RAND_MAX;
+	size_t index = (size_t)(session_count * u * u * u * u);
+	struct session *p_session = &p_sessions[(index < session_count) ? index : session_count - 1];
+
+	int kind = rand() % 100;
+	if(kind < 60)
+	{
+		(void)strcpy(p_cmd, frequent[rand() % (sizeof frequent / sizeof frequent[0])]);
+	}
+	else if(kind < 75 && '\0' != p_session->diag[0])
+	{
+		(void)strcpy(p_cmd, p_session->diag);
+	}
+	else if(kind < 90)
+	{
+		(void)snprintf(p_session->diag, sizeof p_session->diag,
+		               "diag dump --module=%s --level=%d --since=%02d:%02d --format=verbose",
+		               modules[rand() % 6], rand() % 4, rand() % 24, rand() % 60);
+		(void)strcpy(p_cmd, p_session->diag);
+	}
+	else
+	{
+		(void)snprintf(p_cmd, EMRL_MAX_CMD_LEN + 1, "route add 192.168.%d.0/24 via 10.0.0.%d",
+		               rand() % 256, 1 + rand() % 254);
+	}
+
+	return p_session;
+}
+
+static bool in_history(struct emrl_res *p_emrl, const char *p_cmd)
+{
+	char entry[EMRL_MAX_CMD_LEN + 1];
+	for(size_t back = 0; emrl_history_entry(p_emrl, back, entry); ++back)
+	{
+		if(0 == strcmp(entry, p_cmd))
+			return true;
+	}
+
+	return false;
+}
+
+// Fixed buffers of size bytes per session, or the pool with a size of 0
+static void setup(size_t size)
+{
+	if(0 != size)
+		p_bufs = malloc(session_count * size);
+	else
+		p_bufs = malloc(EMRL_POOL_BYTES(session_count * share / EMRL_HISTORY_BUF_BYTES));
+
+	if(NULL == p_bufs)
+	{
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if(0 == size)
+		emrl_pool_init(&pool, p_bufs, EMRL_POOL_BYTES(session_count * share / EMRL_HISTORY_BUF_BYTES));
+
+	for(size_t i = 0; i < session_count; ++i)
+	{
+		struct session *p_session = &p_sessions[i];
+		char *p_hist_buf = (0 != size) ? p_bufs + i * size : NULL;
+		emrl_init(&p_session->emrl, null_puts, NULL, "\r", p_session->cmd_buf,
+		          sizeof p_session->cmd_buf, p_hist_buf, size);
+		if(0 == size)
+		{
+			// The previous pool was thrown away whole, so its histories start again from nothing
+			// rather than being detached
+			(void)memset(&p_session->hist, 0, sizeof p_session->hist);
+			emrl_pool_attach(&pool, &p_session->hist, &p_session->emrl, EMRL_HISTORY_BUF_BYTES);
+		}
+
+		p_session->diag[0] = '\0';
+	}
+}
+
+static struct result run(size_t size)
+{
+	struct result result = { 0, 0, 0.0 };
+	result.bytes = (0 != size) ? session_count * size : 0;
+	size_t steps = session_count * COMMANDS_PER_SESSION;
+	char cmd[EMRL_MAX_CMD_LEN + 1];
+
+	// Recall, checking the history before each command is added
+	setup(size);
+	srand(1);
+	for(size_t step = 0; step < steps; ++step)
+	{
+		struct session *p_session = next_command(cmd);
+		if(in_history(&p_session->emrl, cmd))
+			++result.hits;
+
+		if(0 != size)
+			emrl_add_to_history(&p_session->emrl, cmd);
+		else
+			emrl_pool_add_to_history(&pool, &p_session->hist, cmd);
+	}
+
+	if(0 == size)
+		result.bytes = emrl_pool_stats(&pool)->total_bytes;
+
+	free(p_bufs);
+
+	// Time taken by adding alone
+	setup(size);
+	srand(1);
+	double elapsed = 0.0;
+	for(size_t step = 0; step < steps; ++step)
+	{
+		struct session *p_session = next_command(cmd);
+		double start = now();
+		if(0 != size)
+			emrl_add_to_history(&p_session->emrl, cmd);
+		else
+			emrl_pool_add_to_history(&pool, &p_session->hist, cmd);
+
+		elapsed += now() - start;
+	}
+
+	result.add_ns = elapsed * 1e9 / steps;
+	free(p_bufs);
+	return result;
+}
+
+static void print_result(const char *p_name, struct result result)
+{
+	size_t steps = session_count * COMMANDS_PER_SESSION;
+	printf("%-16s %10zu %8.1f %10.0f\n", p_name, result.bytes, 100.0 * result.hits / steps,
+	       result.add_ns);
+}
+
+static void print_pool(void)
+{
+	const struct emrl_pool_stats *p_stats = emrl_pool_stats(&pool);
+	size_t holding = 0;
+	printf("\npool: %zu of %zu bytes used, peak %zu\n", p_stats->used_bytes, p_stats->total_bytes,
+	       p_stats->peak_bytes);
+	for(unsigned order = 0; ((size_t)EMRL_POOL_CHUNK_BYTES << order) <= EMRL_HISTORY_BUF_BYTES; ++order)
+	{
+		printf("  %6zu byte blocks %8zu\n", (size_t)EMRL_POOL_CHUNK_BYTES << order,
+		       p_stats->blocks[order]);
+		holding += p_stats->blocks[order];
+	}
+
+	printf("  sessions without a block %zu\n", session_count - holding);
+	printf("allocs %lu frees %lu failed %lu grown %lu reclaimed %lu dropped %lu\n",
+	       p_stats->allocs, p_stats->frees, p_stats->failed, p_stats->grown, p_stats->reclaimed,
+	       p_stats->dropped);
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc > 1)
+		session_count = strtoul(argv[1], NULL, 0);
+
+	if(argc > 2)
+		share = strtoul(argv[2], NULL, 0);
+
+	if(0 == session_count || share < 4 || share > EMRL_HISTORY_BUF_BYTES ||
+	   session_count * share < EMRL_HISTORY_BUF_BYTES)
+	{
+		(void)fprintf(stderr, "usage: %s [count] [bytes_per_session]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	p_sessions = calloc(session_count, sizeof *p_sessions);
+	if(NULL == p_sessions)
+	{
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	printf("%zu sessions, %zu commands\n\n", session_count, session_count * COMMANDS_PER_SESSION);
+	printf("%-16s %10s %8s %10s\n", "history", "bytes", "hit %", "ns/add");
+
+	char name[32];
+	(void)snprintf(name, sizeof name, "fixed %d", EMRL_HISTORY_BUF_BYTES);
+	print_result(name, run(EMRL_HISTORY_BUF_BYTES));
+	(void)snprintf(name, sizeof name, "fixed %zu", share);
+	print_result(name, run(share));
+	print_result("pool", run(0));
+	print_pool();
+
+	free(p_sessions);
+	return EXIT_SUCCESS;
+}
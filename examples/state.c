@@ -0,0 +1,473 @@
+// Checks emrl_save_state() and emrl_restore_state(), run by make check
+//
+// usage: state
+//
+// A scripted session is cut at every byte, including in the middle of escape sequences, of a
+// Device Attributes reply, of a delimiter and of a history search. The state saved at the cut is
+// restored into a new instance, and both instances are given the rest of the session. They must
+// print the same output, return the same lines and end in the same state.
+//
+// Every truncation of each saved state must be refused, leaving the instance unchanged. States
+// with each combination of escape sequence state and length, with bad header fields and with
+// corrupted bytes must be refused unless they are ones that input could have left, and any state
+// that is accepted must carry on safely. Build with the address and undefined behaviour
+// sanitizers, as make check does, to catch writes outside the instance's buffers.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emrl.h"
+
+
+#define STATE_BYTES			(EMRL_HISTORY_BUF_BYTES + EMRL_MAX_CMD_LEN + 64)
+#define OUT_BYTES			8192
+#define MAGIC_LEN			4
+
+// Header fields of the state, in order after the magic bytes
+enum field
+{
+	field_version,
+	field_flags,
+	field_line_part,
+	field_caps,
+	field_da_level,
+	field_hide_depth,
+	field_delim_pos,
+	field_esc_state,
+	field_esc_len
+};
+
+struct editor
+{
+	struct emrl_res emrl;
+	char cmd_buf[EMRL_MAX_CMD_LEN + 1];
+	char hist_buf[EMRL_HISTORY_BUF_BYTES];
+	char out[OUT_BYTES];
+	size_t out_len;
+	char lines[OUT_BYTES];					// Each line returned, followed by '\n'
+	size_t lines_len;
+};
+
+struct blob
+{
+	unsigned char buf[STATE_BYTES];
+	size_t len;
+};
+
+// Typed lines, editing keys, history searches left part way and a reply to emrl_detect_terminal()
+static const char script[] =
+	"\033[?62;1;6c"
+	"status\r"
+	"show log\r"
+	"ping 10.0.0.1\r"
+	"sho\033[A\033[Aw\033[D\033[3~x\033[B\033[B\033[Ay\r"
+	"abc\033[D\033[D\033OH\033[C\033[1~z\033[4~\r"
+	"\033[A\033[A\033[A\033[1;5D\033[F\033[B\033[A\r"
+	"typed \033xnot an escape\r"
+	"\033[A\033[2~\033[H\033[A\x7f\x7f\r";
+
+static struct editor *p_feeding;
+static unsigned long failures;
+
+
+static int capture(const char *p_str, emrl_file file)
+{
+	(void)file;
+	size_t len = strlen(p_str);
+	if(len > OUT_BYTES - p_feeding->out_len)
+		len = OUT_BYTES - p_feeding->out_len;
+
+	(void)memcpy(p_feeding->out + p_feeding->out_len, p_str, len);
+	p_feeding->out_len += len;
+	return 0;
+}
+
+static void init(struct editor *p_ed)
+{
+	p_feeding = p_ed;
+	emrl_init(&p_ed->emrl, capture, NULL, "\r", p_ed->cmd_buf, sizeof p_ed->cmd_buf, p_ed->hist_buf,
+	          sizeof p_ed->hist_buf);
+	p_ed->out_len = 0;
+	p_ed->lines_len = 0;
+}
+
+static void feed(struct editor *p_ed, const char *p_input, size_t len)
+{
+	p_feeding = p_ed;
+	for(size_t i = 0; i < len; ++i)
+	{
+		const char *p_line = emrl_process_char(&p_ed->emrl, p_input[i]);
+		if(NULL != p_line)
+		{
+			size_t line_len = strlen(p_line);
+			if(line_len + 1 <= OUT_BYTES - p_ed->lines_len)
+			{
+				(void)memcpy(p_ed->lines + p_ed->lines_len, p_line, line_len);
+				p_ed->lines[p_ed->lines_len + line_len] = '\n';
+				p_ed->lines_len += line_len + 1;
+			}
+
+			if(0 != line_len)
+				emrl_add_to_history(&p_ed->emrl, p_line);
+		}
+	}
+}
+
+static void feed_str(struct editor *p_ed, const char *p_input)
+{
+	feed(p_ed, p_input, strlen(p_input));
+}
+
+static void save(struct editor *p_ed, struct blob *p_blob)
+{
+	p_blob->len = emrl_save_state(&p_ed->emrl, p_blob->buf, sizeof p_blob->buf);
+	if(p_blob->len > sizeof p_blob->buf)
+	{
+		(void)fprintf(stderr, "state of %zu bytes doesn't fit\n", p_blob->len);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void fail(const char *p_what, size_t where)
+{
+	(void)fprintf(stderr, "FAIL: %s (%zu)\n", p_what, where);
+	++failures;
+}
+
+static bool same_state(struct editor *p_a, struct editor *p_b)
+{
+	struct blob a;
+	struct blob b;
+	save(p_a, &a);
+	save(p_b, &b);
+	return a.len == b.len && 0 == memcmp(a.buf, b.buf, a.len);
+}
+
+// Input that goes through every escape sequence state, to run after a state is accepted
+static void exercise(struct editor *p_ed)
+{
+	feed_str(p_ed, "1;2c~\033[?6c\033[12345678~\033OAxyz\033[A\033[B\r\033[A\r");
+}
+
+static size_t put_uint(unsigned char *p_out, size_t value)
+{
+	size_t len = 0;
+	do
+	{
+		unsigned char byte = value & 0x7f;
+		value >>= 7;
+		p_out[len++] = byte | ((0 != value) ? 0x80 : 0);
+	}
+	while(0 != value);
+
+	return len;
+}
+
+// Offset of a header field, every field before it must be present
+static size_t field_offset(const struct blob *p_blob, enum field field)
+{
+	size_t pos = MAGIC_LEN;
+	for(unsigned i = 0; i < field; ++i)
+	{
+		while(p_blob->buf[pos] & 0x80)
+			++pos;
+
+		++pos;
+	}
+
+	return pos;
+}
+
+static size_t get_field(const struct blob *p_blob, enum field field)
+{
+	size_t pos = field_offset(p_blob, field);
+	size_t value = 0;
+	for(unsigned shift = 0; ; shift += 7)
+	{
+		value |= (size_t)(p_blob->buf[pos] & 0x7f) << shift;
+		if(0 == (p_blob->buf[pos++] & 0x80))
+			return value;
+	}
+}
+
+// Copy of p_in with a header field replaced, and for the escape sequence length the bytes of the
+// sequence too
+static void set_field(const struct blob *p_in, struct blob *p_out, enum field field, size_t value,
+                      const char *p_esc)
+{
+	size_t start = field_offset(p_in, field);
+	size_t end = field_offset(p_in, field + 1);
+	if(field_esc_len == field)
+		end += get_field(p_in, field_esc_len);
+
+	(void)memcpy(p_out->buf, p_in->buf, start);
+	size_t len = start + put_uint(p_out->buf + start, value);
+	if(field_esc_len == field)
+	{
+		(void)memcpy(p_out->buf + len, p_esc, value);
+		len += value;
+	}
+
+	(void)memcpy(p_out->buf + len, p_in->buf + end, p_in->len - end);
+	p_out->len = len + p_in->len - end;
+}
+
+// A refused state must leave the instance as it was
+static void expect_refused(const struct blob *p_blob, const char *p_what, size_t where)
+{
+	static struct editor before;
+	static struct editor ed;
+	init(&before);
+	init(&ed);
+	if(emrl_restore_state(&ed.emrl, p_blob->buf, p_blob->len))
+		fail(p_what, where);
+	else if(!same_state(&before, &ed))
+		fail("refused state changed the instance", where);
+}
+
+// Cut the script at every byte and carry on from the saved state in a new instance
+static void check_round_trips(void)
+{
+	static struct editor a;
+	static struct editor b;
+	static struct blob blob;
+	static struct blob cut;
+	size_t len = sizeof script - 1;
+	unsigned long escapes = 0;
+	unsigned long searches = 0;
+
+	for(size_t split = 0; split <= len; ++split)
+	{
+		init(&a);
+		emrl_detect_terminal(&a.emrl);
+		feed(&a, script, split);
+		save(&a, &blob);
+
+		if(emrl_esc_none != a.emrl.esc_state)
+			++escapes;
+
+		if(0 != a.emrl.history.current)
+			++searches;
+
+		init(&b);
+		if(!emrl_restore_state(&b.emrl, blob.buf, blob.len))
+		{
+			fail("state refused", split);
+			continue;
+		}
+
+		if(!same_state(&a, &b))
+			fail("restored state differs", split);
+
+		a.out_len = a.lines_len = 0;
+		feed(&a, script + split, len - split);
+		feed(&b, script + split, len - split);
+		if(a.out_len != b.out_len || 0 != memcmp(a.out, b.out, a.out_len))
+			fail("output differs after restore", split);
+
+		if(a.lines_len != b.lines_len || 0 != memcmp(a.lines, b.lines, a.lines_len))
+			fail("lines differ after restore", split);
+
+		if(!same_state(&a, &b))
+			fail("final state differs", split);
+
+		for(cut.len = 0; cut.len < blob.len; ++cut.len)
+		{
+			(void)memcpy(cut.buf, blob.buf, cut.len);
+			expect_refused(&cut, "truncated state accepted", split * 1000 + cut.len);
+		}
+	}
+
+	printf("%zu cuts, %lu in an escape sequence, %lu in a history search\n", len + 1, escapes,
+	       searches);
+	if(0 == escapes || 0 == searches)
+		fail("script doesn't cover escape sequences and history searches", 0);
+}
+
+// Only pairs that input can leave are accepted: none and new with nothing buffered, SS3 after its
+// 'O', CSI after its '[' with up to three more bytes, and a Device Attributes reply after "[?"
+// with the parameter being read or skipped
+static bool esc_valid(size_t state, size_t len)
+{
+	switch(state)
+	{
+		case emrl_esc_none:
+		case emrl_esc_new:
+			return 0 == len;
+
+		case emrl_esc_ss3:
+			return 1 == len;
+
+		case emrl_esc_csi:
+			return len >= 1 && len <= 4;
+
+		case emrl_esc_da:
+			return 2 == len || 3 == len;
+
+		default:
+			return false;
+	}
+}
+
+static void check_escape_states(void)
+{
+	static struct editor ed;
+	static struct blob base;
+	static struct blob with_state;
+	static struct blob blob;
+	unsigned long accepted = 0;
+
+	init(&ed);
+	feed_str(&ed, "abc");
+	save(&ed, &base);
+
+	for(size_t state = 0; state <= emrl_esc_da + 2; ++state)
+	{
+		for(size_t len = 0; len <= 8; ++len)
+		{
+			// The bytes an accepted sequence would start with
+			const char *p_esc = (emrl_esc_ss3 == state) ? "OOOOOOOO" : "[?1;2;3;";
+			set_field(&base, &with_state, field_esc_state, state, NULL);
+			set_field(&with_state, &blob, field_esc_len, len, p_esc);
+
+			init(&ed);
+			bool restored = emrl_restore_state(&ed.emrl, blob.buf, blob.len);
+			if(restored != esc_valid(state, len))
+			{
+				fail(restored ? "escape state accepted" : "escape state refused", state * 100 + len);
+				continue;
+			}
+
+			if(restored)
+			{
+				++accepted;
+				exercise(&ed);
+			}
+		}
+	}
+
+	// The buffered bytes must be ones that lead to the state
+	set_field(&base, &with_state, field_esc_state, emrl_esc_csi, NULL);
+	set_field(&with_state, &blob, field_esc_len, 2, "x1");
+	expect_refused(&blob, "CSI without '[' accepted", 0);
+	set_field(&base, &with_state, field_esc_state, emrl_esc_da, NULL);
+	set_field(&with_state, &blob, field_esc_len, 2, "[1");
+	expect_refused(&blob, "Device Attributes reply without '?' accepted", 0);
+	set_field(&base, &with_state, field_esc_state, emrl_esc_ss3, NULL);
+	set_field(&with_state, &blob, field_esc_len, 1, "[");
+	expect_refused(&blob, "SS3 without 'O' accepted", 0);
+
+	printf("%lu escape sequence states accepted\n", accepted);
+}
+
+static void check_bad_fields(void)
+{
+	static struct editor ed;
+	static struct blob base;
+	static struct blob blob;
+
+	init(&ed);
+	feed_str(&ed, "status\rshow log\rabc\033[D");
+	save(&ed, &base);
+
+	static const struct
+	{
+		enum field field;
+		size_t value;
+	}
+	bad[] =
+	{
+		{ field_version, 0 },
+		{ field_version, 2 },
+		{ field_line_part, emrl_part_last + 1 },
+		{ field_caps, 256 },
+		{ field_da_level, 256 },
+		{ field_hide_depth, 256 },
+		{ field_delim_pos, 1 },
+		{ field_esc_state, emrl_esc_da + 1 },
+		{ field_esc_state, (size_t)-1 }
+	};
+
+	for(size_t i = 0; i < sizeof bad / sizeof bad[0]; ++i)
+	{
+		set_field(&base, &blob, bad[i].field, bad[i].value, NULL);
+		expect_refused(&blob, "bad header field accepted", i);
+	}
+
+	// Magic bytes
+	blob = base;
+	blob.buf[0] ^= 1;
+	expect_refused(&blob, "bad magic accepted", 0);
+
+	// Trailing varint that never ends
+	blob = base;
+	(void)memset(blob.buf + field_offset(&base, field_esc_len), 0xff, 12);
+	expect_refused(&blob, "unterminated field accepted", 0);
+}
+
+// Any byte changed, the state is either refused or safe to carry on from
+static void check_corruption(void)
+{
+	static struct editor ed;
+	static struct blob base;
+	static struct blob blob;
+	static struct blob again;
+	static const unsigned char values[] = { 0x00, 0x01, 0x05, 0x7f, 0x80, 0xff };
+	unsigned long accepted = 0;
+	unsigned long tried = 0;
+
+	init(&ed);
+	emrl_detect_terminal(&ed.emrl);
+	feed_str(&ed, "status\rshow log\rping\033[A\033[");
+	save(&ed, &base);
+
+	for(size_t pos = 0; pos < base.len; ++pos)
+	{
+		for(size_t i = 0; i <= sizeof values; ++i)
+		{
+			blob = base;
+			blob.buf[pos] = (i < sizeof values) ? values[i] : (base.buf[pos] ^ 0x01);
+			if(blob.buf[pos] == base.buf[pos])
+				continue;
+
+			++tried;
+			init(&ed);
+			if(!emrl_restore_state(&ed.emrl, blob.buf, blob.len))
+				continue;
+
+			// What was accepted must save and restore as it is
+			++accepted;
+			save(&ed, &again);
+			init(&ed);
+			if(!emrl_restore_state(&ed.emrl, again.buf, again.len))
+				fail("accepted state doesn't restore again", pos);
+
+			exercise(&ed);
+		}
+	}
+
+	printf("%lu of %lu corrupted states accepted\n", accepted, tried);
+}
+
+int main(void)
+{
+#if defined(USE_SAVE_STATE) && defined(USE_HISTORY) && defined(USE_ESCAPE_INPUT)
+	check_round_trips();
+	check_escape_states();
+	check_bad_fields();
+	check_corruption();
+
+	if(0 != failures)
+	{
+		printf("%lu failures\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	printf("ok\n");
+#else
+	printf("needs USE_SAVE_STATE, USE_HISTORY and USE_ESCAPE_INPUT\n");
+#endif
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,186 @@
+// Checks the telnet input filter, run by make check
+//
+// usage: telnet
+//
+// Each case gives received bytes and the data that must remain after filtering, the negotiation
+// that must be sent back and the option state that must result. Every case is also filtered split
+// into two calls at each byte, and a byte at a time, which must give the same results as filtering
+// it whole.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emrl_telnet.h"
+
+
+#define OUT_BYTES			64
+
+// Option state after a case, as flags
+#define ST_ECHO				0x01
+#define ST_SGA				0x02
+#define ST_LOCAL_EDIT		0x04
+
+struct filter_case
+{
+	const char *p_name;
+	const char *p_in;
+	size_t in_len;
+	const char *p_data;
+	size_t data_len;
+	const char *p_sent;
+	size_t sent_len;
+	unsigned state;
+	unsigned width;
+	unsigned height;
+};
+
+#define BYTES(str) str, sizeof str - 1
+
+// Sent by emrl_telnet_start()
+#define START "\377\373\001\377\373\003\377\375\037\377\375\042"
+
+static const struct filter_case cases[] =
+{
+	{ "plain data", BYTES("show log\r\n"), BYTES("show log\r\n"), BYTES(""), ST_ECHO | ST_SGA, 0, 0 },
+	{ "escaped 0xff", BYTES("a\377\377b"), BYTES("a\377b"), BYTES(""), ST_ECHO | ST_SGA, 0, 0 },
+	{ "CR NUL", BYTES("a\r\0b\r\0"), BYTES("a\rb\r"), BYTES(""), ST_ECHO | ST_SGA, 0, 0 },
+	{ "NUL not after CR", BYTES("a\0b\n\0"), BYTES("a\0b\n\0"), BYTES(""), ST_ECHO | ST_SGA, 0, 0 },
+	{ "CR NUL around a command", BYTES("\r\377\361\0x"), BYTES("\rx"), BYTES(""), ST_ECHO | ST_SGA, 0, 0 },
+	{ "NOP and GA", BYTES("a\377\361b\377\371c"), BYTES("abc"), BYTES(""), ST_ECHO | ST_SGA, 0, 0 },
+	{ "NAWS", BYTES("x\377\372\037\0\120\0\030\377\360y"), BYTES("xy"), BYTES(""), ST_ECHO | ST_SGA,
+	  80, 24 },
+	{ "NAWS with 0xff", BYTES("\377\372\037\0\377\377\001\000\377\360"), BYTES(""), BYTES(""),
+	  ST_ECHO | ST_SGA, 255, 256 },
+	{ "DO BINARY", BYTES("\377\375\0"), BYTES(""), BYTES("\377\374\0"), ST_ECHO | ST_SGA, 0, 0 },
+	{ "WILL BINARY", BYTES("\377\373\0"), BYTES(""), BYTES("\377\376\0"), ST_ECHO | ST_SGA, 0, 0 },
+	{ "DO and WILL other", BYTES("\377\375\030\377\373\030"), BYTES(""), BYTES("\377\374\030\377\376\030"),
+	  ST_ECHO | ST_SGA, 0, 0 },
+	{ "WILL NAWS", BYTES("\377\373\037"), BYTES(""), BYTES(""), ST_ECHO | ST_SGA, 0, 0 },
+	{ "DO ECHO and SGA acknowledged", BYTES("\377\375\001\377\375\003"), BYTES(""), BYTES(""),
+	  ST_ECHO | ST_SGA, 0, 0 },
+	{ "DONT ECHO", BYTES("\377\376\001"), BYTES(""), BYTES("\377\374\001"), ST_SGA, 0, 0 },
+	{ "DONT ECHO twice", BYTES("\377\376\001\377\376\001"), BYTES(""), BYTES("\377\374\001"), ST_SGA, 0, 0 },
+	{ "DONT then DO ECHO", BYTES("\377\376\001\377\375\001\377\375\001"), BYTES(""),
+	  BYTES("\377\374\001\377\373\001"), ST_ECHO | ST_SGA, 0, 0 },
+	{ "DONT SGA", BYTES("\377\376\003"), BYTES(""), BYTES("\377\374\003"), ST_ECHO, 0, 0 },
+	{ "DONT then DO SGA", BYTES("\377\376\003\377\375\003"), BYTES(""), BYTES("\377\374\003\377\373\003"),
+	  ST_ECHO | ST_SGA, 0, 0 },
+	{ "DONT not enabled", BYTES("\377\376\037\377\376\0"), BYTES(""), BYTES(""), ST_ECHO | ST_SGA, 0, 0 },
+	{ "WILL LINEMODE", BYTES("\377\373\042"), BYTES(""), BYTES("\377\372\042\001\001\377\360\377\374\001"),
+	  ST_SGA | ST_LOCAL_EDIT, 0, 0 },
+	{ "DO ECHO while editing locally", BYTES("\377\373\042\377\375\001"), BYTES(""),
+	  BYTES("\377\372\042\001\001\377\360\377\374\001"), ST_SGA | ST_LOCAL_EDIT, 0, 0 },
+	{ "WONT LINEMODE", BYTES("\377\373\042\377\374\042"), BYTES(""),
+	  BYTES("\377\372\042\001\001\377\360\377\374\001\377\373\001"), ST_ECHO | ST_SGA, 0, 0 },
+	{ "WILL LINEMODE after DONT ECHO", BYTES("\377\376\001\377\373\042"), BYTES(""),
+	  BYTES("\377\374\001\377\372\042\001\001\377\360"), ST_SGA | ST_LOCAL_EDIT, 0, 0 },
+	{ "mixed", BYTES("ls\r\0\377\375\0-l\377\377\r\n"), BYTES("ls\r-l\377\r\n"), BYTES("\377\374\0"),
+	  ST_ECHO | ST_SGA, 0, 0 },
+};
+
+static char sent[OUT_BYTES];
+static size_t sent_len;
+static unsigned long failures;
+
+
+static int capture(const char *p_data, size_t len, emrl_file file)
+{
+	(void)file;
+	if(len > sizeof sent - sent_len)
+		len = sizeof sent - sent_len;
+
+	(void)memcpy(sent + sent_len, p_data, len);
+	sent_len += len;
+	return 0;
+}
+
+static void fail(const char *p_name, const char *p_what, size_t split)
+{
+	(void)fprintf(stderr, "FAIL: %s, %s (split %zu)\n", p_name, p_what, split);
+	++failures;
+}
+
+static unsigned state_of(const struct emrl_telnet *p_tn)
+{
+	return (p_tn->echo ? ST_ECHO : 0) | (p_tn->sga ? ST_SGA : 0) | (p_tn->local_edit ? ST_LOCAL_EDIT : 0);
+}
+
+// Filter the case's input in calls of at most step bytes, after a split at split
+static void run(const struct filter_case *p_case, size_t split, size_t step)
+{
+	struct emrl_telnet tn;
+	emrl_telnet_init(&tn, capture, NULL);
+	emrl_telnet_start(&tn);
+	if(sent_len != sizeof START - 1 || 0 != memcmp(sent, START, sent_len))
+		fail(p_case->p_name, "start negotiation", split);
+
+	sent_len = 0;
+
+	char buf[OUT_BYTES];
+	char data[OUT_BYTES];
+	size_t data_len = 0;
+	size_t pos = 0;
+	while(pos < p_case->in_len)
+	{
+		size_t len = p_case->in_len - pos;
+		if(pos < split && len > split - pos)
+			len = split - pos;
+		if(len > step)
+			len = step;
+
+		(void)memcpy(buf, p_case->p_in + pos, len);
+		size_t out_len = emrl_telnet_filter(&tn, buf, len);
+		if(out_len > len)
+		{
+			fail(p_case->p_name, "more data out than in", split);
+			return;
+		}
+
+		(void)memcpy(data + data_len, buf, out_len);
+		data_len += out_len;
+		pos += len;
+	}
+
+	if(data_len != p_case->data_len || 0 != memcmp(data, p_case->p_data, data_len))
+		fail(p_case->p_name, "data", split);
+
+	if(sent_len != p_case->sent_len || 0 != memcmp(sent, p_case->p_sent, sent_len))
+		fail(p_case->p_name, "negotiation sent", split);
+
+	if(state_of(&tn) != p_case->state)
+		fail(p_case->p_name, "option state", split);
+
+	if(tn.width != p_case->width || tn.height != p_case->height)
+		fail(p_case->p_name, "window size", split);
+
+	sent_len = 0;
+}
+
+int main(void)
+{
+	unsigned long runs = 0;
+	for(size_t i = 0; i < sizeof cases / sizeof cases[0]; ++i)
+	{
+		const struct filter_case *p_case = &cases[i];
+		for(size_t split = 0; split <= p_case->in_len; ++split)
+		{
+			run(p_case, split, OUT_BYTES);
+			++runs;
+		}
+
+		run(p_case, 0, 1);
+		++runs;
+	}
+
+	printf("%zu cases filtered %lu ways\n", sizeof cases / sizeof cases[0], runs);
+	if(0 != failures)
+	{
+		printf("%lu failures\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	printf("ok\n");
+	return EXIT_SUCCESS;
+}
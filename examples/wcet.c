@@ -0,0 +1,162 @@
+// Drive emrl with worst case inputs and report cycles spent in each API call
+//
+// usage: wcet [rounds] [retain]
+//
+// Built with USE_CYCLE_STATS, see the Makefile bench target. Cycle counts depend on the machine so
+// aren't checked, but the bound they rest on is: no call may print more than a whole command line
+// plus PRINT_SLACK_BYTES of prompt, cursor movement and caret notation. Fails if any call does.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emrl.h"
+
+
+#define DEFAULT_ROUNDS		10000
+#define PRINT_SLACK_BYTES	32
+
+#define SEQ_UP			"\033[A"
+#define SEQ_DOWN		"\033[B"
+#define SEQ_LEFT		"\033[D"
+#define SEQ_DELETE		"\033[3~"
+
+static const char *api_names[emrl_api_count] =
+{
+	[emrl_api_process_char] = "emrl_process_char",
+	[emrl_api_process_buf] = "emrl_process_buf",
+	[emrl_api_add_to_history] = "emrl_add_to_history"
+};
+
+// Bytes printed by the call in progress, and the most printed by any one call to each API
+static size_t printed;
+static size_t most_printed[emrl_api_count];
+
+
+static int count_puts(const char *p_str, emrl_file file)
+{
+	(void)file;
+	printed += strlen(p_str);
+	return 0;
+}
+
+static void printed_by(enum emrl_api api)
+{
+	if(printed > most_printed[api])
+		most_printed[api] = printed;
+
+	printed = 0;
+}
+
+static void add(struct emrl_res *p_emrl, const char *p_command)
+{
+	emrl_add_to_history(p_emrl, p_command);
+	printed_by(emrl_api_add_to_history);
+}
+
+static void feed(struct emrl_res *p_emrl, const char *p_str, size_t repeat)
+{
+	for(size_t i = 0; i < repeat; ++i)
+	{
+		for(const char *p = p_str; '\0' != *p; ++p)
+		{
+			const char *p_command = emrl_process_char(p_emrl, *p);
+			printed_by(emrl_api_process_char);
+			if(NULL != p_command && '\0' != *p_command)
+				add(p_emrl, p_command);
+		}
+	}
+}
+
+static void feed_buf(struct emrl_res *p_emrl, const char *p_str)
+{
+	size_t len = strlen(p_str);
+	while(len > 0)
+	{
+		size_t used;
+		const char *p_command = emrl_process_buf(p_emrl, p_str, len, &used);
+		printed_by(emrl_api_process_buf);
+		if(NULL != p_command && '\0' != *p_command)
+			add(p_emrl, p_command);
+
+		p_str += used;
+		len -= used;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long rounds = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_ROUNDS;
+
+	static char cmd_buf[EMRL_MAX_CMD_LEN + 1];
+	static char hist_buf[EMRL_HISTORY_BUF_BYTES];
+	struct emrl_res emrl;
+	emrl_init(&emrl, count_puts, NULL, "\r", cmd_buf, sizeof cmd_buf, hist_buf, sizeof hist_buf);
+	printed = 0;
+
+	bool retain = (argc > 2 && 0 == strcmp(argv[2], "retain"));
+	emrl_set_history_retention(&emrl, retain);
+
+	// Longest command that can be recalled, plus a short one to vary the wrap point
+	char long_cmd[EMRL_MAX_CMD_LEN + 1];
+	memset(long_cmd, 'x', EMRL_MAX_CMD_LEN);
+	long_cmd[EMRL_MAX_CMD_LEN] = '\0';
+
+	for(unsigned long round = 0; round < rounds; ++round)
+	{
+		// Short entries followed by a long one overwriting several of them
+		feed(&emrl, "a\rbb\rccc\r", 1);
+		add(&emrl, long_cmd + (round % 7));
+
+		// Enter a recalled entry unchanged, so that retained entries are moved when overwritten
+		if(retain)
+			feed(&emrl, SEQ_UP SEQ_UP SEQ_UP "\r", 1);
+
+		// Recall the oldest entries then walk back down, each step reprints a whole entry
+		feed(&emrl, SEQ_UP, 8);
+		feed(&emrl, SEQ_DOWN, 8);
+
+		// Recall, edit (deferred copy of a long entry), then complete the line
+		feed(&emrl, SEQ_UP "y\r", 1);
+
+		// Fill the line, then insert and erase at its start so the whole line moves each time
+		feed(&emrl, "z", EMRL_MAX_CMD_LEN);
+		feed(&emrl, SEQ_LEFT, EMRL_MAX_CMD_LEN);
+		feed(&emrl, "w" SEQ_LEFT SEQ_DELETE, 4);
+		feed(&emrl, "\r", 1);
+
+		// Unknown escape sequences are printed in caret notation
+		feed(&emrl, "\033[1;2;3X\033Oq\r", 1);
+
+		// Bulk input, a pasted line longer than the command buffer
+		feed_buf(&emrl, long_cmd);
+		feed_buf(&emrl, long_cmd);
+		feed_buf(&emrl, "\r");
+	}
+
+	size_t print_budget = sizeof cmd_buf - 1 + PRINT_SLACK_BYTES;
+	bool over = false;
+	printf("%-20s %10s %10s %10s %12s %12s\n", "", "min", "max", "mean", "calls", "most printed");
+	for(unsigned i = 0; i < emrl_api_count; ++i)
+	{
+		const struct emrl_cycle_stats *p_stats = emrl_cycle_stats(&emrl, i);
+		bool called = (0 != p_stats->calls);
+		printf("%-20s %10lu %10lu %10.1f %12lu %12zu\n",
+		       api_names[i],
+		       called ? (unsigned long)p_stats->min : 0ul,
+		       (unsigned long)p_stats->max,
+		       called ? (double)p_stats->total_cycles / p_stats->calls : 0.0,
+		       p_stats->calls,
+		       most_printed[i]);
+
+		if(most_printed[i] > print_budget)
+		{
+			(void)fprintf(stderr, "FAIL: %s printed %zu bytes in one call, over %zu\n", api_names[i],
+			              most_printed[i], print_budget);
+			over = true;
+		}
+	}
+
+	return over ? EXIT_FAILURE : EXIT_SUCCESS;
+}